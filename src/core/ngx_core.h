@@ -24,7 +24,9 @@ typedef struct ngx_file_s            ngx_file_t;
 typedef struct ngx_event_s           ngx_event_t;
 typedef struct ngx_event_aio_s       ngx_event_aio_t;
 typedef struct ngx_connection_s      ngx_connection_t;
+typedef struct ngx_udp_connection_s  ngx_udp_connection_t;
 typedef struct ngx_thread_task_s     ngx_thread_task_t;
+typedef struct ngx_shm_snapshot_s    ngx_shm_snapshot_t;
 typedef struct ngx_ssl_s             ngx_ssl_t;
 typedef struct ngx_ssl_connection_s  ngx_ssl_connection_t;
 
@@ -77,6 +79,7 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #include <ngx_slab.h>
 #include <ngx_inet.h>
 #include <ngx_cycle.h>
+#include <ngx_shm_snapshot.h>
 #include <ngx_resolver.h>
 #if (NGX_OPENSSL)
 #include <ngx_event_openssl.h>
@@ -489,6 +489,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             goto failed;
         }
 
+        if (ngx_shm_snapshot_restore(cycle, &shm_zone[i]) != NGX_OK) {
+            goto failed;
+        }
+
     shm_zone_found:
 
         continue;
@@ -1271,6 +1275,8 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->shm.name = *name;
     shm_zone->shm.exists = 0;
     shm_zone->init = NULL;
+    shm_zone->save = NULL;
+    shm_zone->restore = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
 
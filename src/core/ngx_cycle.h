@@ -25,11 +25,15 @@
 typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+typedef ngx_int_t (*ngx_shm_zone_snapshot_pt) (ngx_shm_zone_t *zone,
+    ngx_shm_snapshot_t *ss);
 
 struct ngx_shm_zone_s {
     void                     *data;
     ngx_shm_t                 shm;
     ngx_shm_zone_init_pt      init;
+    ngx_shm_zone_snapshot_pt  save;
+    ngx_shm_zone_snapshot_pt  restore;
     void                     *tag;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
 };
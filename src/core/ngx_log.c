@@ -31,6 +31,54 @@ typedef struct {
 #endif
 
 
+#if (NGX_THREADS)
+
+#define NGX_LOG_ASYNC_BUFFER_SIZE  (128 * 1024)
+#define NGX_LOG_ASYNC_MAX_DELAY    100
+
+
+typedef struct ngx_log_async_s  ngx_log_async_t;
+
+struct ngx_log_async_s {
+    ngx_open_file_t  *file;
+    ngx_fd_t          fd;
+    ngx_fd_t          file_fd;
+
+    u_char           *start;
+    size_t            size;
+
+    ngx_atomic_t      head;
+    ngx_atomic_t      tail;
+    ngx_atomic_t      lock;
+    ngx_atomic_t      dropped;
+
+    ngx_log_async_t  *next;
+};
+
+
+typedef struct {
+    ngx_log_async_t  *logs;
+    pthread_t         tid;
+    ngx_atomic_t      stop;
+} ngx_errlog_conf_t;
+
+
+static void *ngx_log_async_create_conf(ngx_cycle_t *cycle);
+static char *ngx_log_async_set_log(ngx_conf_t *cf, ngx_log_t *log,
+    ngx_str_t *value);
+static ngx_int_t ngx_log_async_init_process(ngx_cycle_t *cycle);
+static void ngx_log_async_exit_process(ngx_cycle_t *cycle);
+static void ngx_log_async_writer(ngx_log_t *log, ngx_uint_t level,
+    u_char *buf, size_t len);
+static void *ngx_log_async_thread(void *data);
+static ngx_uint_t ngx_log_async_flush(ngx_log_async_t *alog);
+
+
+static ngx_uint_t  ngx_log_async_running;
+
+#endif
+
+
 static ngx_command_t  ngx_errlog_commands[] = {
 
     { ngx_string("error_log"),
@@ -46,7 +94,11 @@ static ngx_command_t  ngx_errlog_commands[] = {
 
 static ngx_core_module_t  ngx_errlog_module_ctx = {
     ngx_string("errlog"),
+#if (NGX_THREADS)
+    ngx_log_async_create_conf,
+#else
     NULL,
+#endif
     NULL
 };
 
@@ -58,10 +110,18 @@ ngx_module_t  ngx_errlog_module = {
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
+#if (NGX_THREADS)
+    ngx_log_async_init_process,            /* init process */
+#else
     NULL,                                  /* init process */
+#endif
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
+#if (NGX_THREADS)
+    ngx_log_async_exit_process,            /* exit process */
+#else
     NULL,                                  /* exit process */
+#endif
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -644,6 +704,18 @@ ngx_log_set_log(ngx_conf_t *cf, ngx_log_t **head)
         return NGX_CONF_ERROR;
 #endif
 
+    } else if (ngx_strncmp(value[1].data, "async:", 6) == 0) {
+
+#if (NGX_THREADS)
+        if (ngx_log_async_set_log(cf, new_log, &value[1]) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "nginx was built without threads support");
+        return NGX_CONF_ERROR;
+#endif
+
     } else if (ngx_strncmp(value[1].data, "syslog:", 7) == 0) {
         peer = ngx_pcalloc(cf->pool, sizeof(ngx_syslog_peer_t));
         if (peer == NULL) {
@@ -753,3 +825,369 @@ ngx_log_memory_cleanup(void *data)
 }
 
 #endif
+
+
+#if (NGX_THREADS)
+
+static void *
+ngx_log_async_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_errlog_conf_t  *ecf;
+
+    ecf = ngx_pcalloc(cycle->pool, sizeof(ngx_errlog_conf_t));
+    if (ecf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     ecf->logs = NULL;
+     *     ecf->stop = 0;
+     */
+
+    return ecf;
+}
+
+
+static char *
+ngx_log_async_set_log(ngx_conf_t *cf, ngx_log_t *log, ngx_str_t *value)
+{
+    u_char             *p;
+    ssize_t             size;
+    ngx_str_t           name, s;
+    ngx_log_async_t    *alog;
+    ngx_errlog_conf_t  *ecf;
+
+    name.len = value->len - 6;
+    name.data = value->data + 6;
+
+    size = NGX_LOG_ASYNC_BUFFER_SIZE;
+
+    /* "async:size:file" */
+
+    p = ngx_strlchr(name.data, name.data + name.len, ':');
+
+    if (p) {
+        s.len = p - name.data;
+        s.data = name.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            size = NGX_LOG_ASYNC_BUFFER_SIZE;
+
+        } else {
+            name.len -= s.len + 1;
+            name.data = p + 1;
+
+            if (size < NGX_MAX_ERROR_STR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no file name in \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    log->file = ngx_conf_open_file(cf->cycle, &name);
+    if (log->file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    alog = ngx_pcalloc(cf->pool, sizeof(ngx_log_async_t));
+    if (alog == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    alog->start = ngx_pnalloc(cf->pool, size);
+    if (alog->start == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    alog->size = size;
+    alog->file = log->file;
+    alog->fd = NGX_INVALID_FILE;
+
+    ecf = (ngx_errlog_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                             ngx_errlog_module);
+
+    alog->next = ecf->logs;
+    ecf->logs = alog;
+
+    log->writer = ngx_log_async_writer;
+    log->wdata = alog;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_log_async_init_process(ngx_cycle_t *cycle)
+{
+    int                 err;
+    pthread_attr_t      attr;
+    ngx_log_async_t    *alog;
+    ngx_errlog_conf_t  *ecf;
+
+    ecf = (ngx_errlog_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                             ngx_errlog_module);
+
+    if (ecf->logs == NULL) {
+        return NGX_OK;
+    }
+
+    /*
+     * the writer thread uses its own descriptors, as the ones in
+     * the cycle are closed by the main thread when logs are reopened
+     */
+
+    for (alog = ecf->logs; alog; alog = alog->next) {
+
+        alog->file_fd = alog->file->fd;
+
+        alog->fd = dup(alog->file_fd);
+
+        if (alog->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "dup() failed, async error logging disabled");
+            return NGX_OK;
+        }
+    }
+
+    err = pthread_attr_init(&attr);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_attr_init() failed");
+        return NGX_OK;
+    }
+
+    err = pthread_create(&ecf->tid, &attr, ngx_log_async_thread, ecf);
+
+    (void) pthread_attr_destroy(&attr);
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_create() failed, async error logging disabled");
+        return NGX_OK;
+    }
+
+    ngx_log_async_running = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_log_async_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_log_async_t    *alog;
+    ngx_errlog_conf_t  *ecf;
+
+    if (!ngx_log_async_running) {
+        return;
+    }
+
+    ecf = (ngx_errlog_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                             ngx_errlog_module);
+
+    ecf->stop = 1;
+
+    (void) pthread_join(ecf->tid, NULL);
+
+    ngx_log_async_running = 0;
+
+    for (alog = ecf->logs; alog; alog = alog->next) {
+        (void) ngx_log_async_flush(alog);
+    }
+}
+
+
+static void
+ngx_log_async_writer(ngx_log_t *log, ngx_uint_t level, u_char *buf,
+    size_t len)
+{
+    size_t              n, pos;
+    ngx_uint_t          i;
+    ngx_atomic_uint_t   head;
+    ngx_log_async_t    *alog;
+
+    alog = log->wdata;
+
+    if (!ngx_log_async_running) {
+        (void) ngx_write_fd(log->file->fd, buf, len);
+        return;
+    }
+
+    /*
+     * the lock is only contended by thread pool threads, and may be held
+     * by the interrupted code if we are called from a signal handler,
+     * so the line is written synchronously if the lock cannot be taken
+     */
+
+    for (i = 0; !ngx_trylock(&alog->lock); i++) {
+
+        if (i == 2048) {
+            (void) ngx_write_fd(log->file->fd, buf, len);
+            return;
+        }
+
+        ngx_cpu_pause();
+    }
+
+    head = alog->head;
+
+    if (len > alog->size - (head - alog->tail)) {
+        (void) ngx_atomic_fetch_add(&alog->dropped, 1);
+        ngx_unlock(&alog->lock);
+        return;
+    }
+
+    pos = head % alog->size;
+    n = ngx_min(len, alog->size - pos);
+
+    ngx_memcpy(alog->start + pos, buf, n);
+
+    if (n < len) {
+        ngx_memcpy(alog->start, buf + n, len - n);
+    }
+
+    ngx_memory_barrier();
+
+    alog->head = head + len;
+
+    ngx_unlock(&alog->lock);
+}
+
+
+static void *
+ngx_log_async_thread(void *data)
+{
+    ngx_errlog_conf_t *ecf = data;
+
+    sigset_t          set;
+    ngx_uint_t        busy;
+    ngx_msec_t        delay;
+    ngx_log_async_t  *alog;
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    (void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    delay = 1;
+
+    for ( ;; ) {
+
+        busy = 0;
+
+        for (alog = ecf->logs; alog; alog = alog->next) {
+            busy |= ngx_log_async_flush(alog);
+        }
+
+        if (ecf->stop) {
+            return NULL;
+        }
+
+        delay = busy ? 1 : ngx_min(delay * 2, NGX_LOG_ASYNC_MAX_DELAY);
+
+        ngx_msleep(delay);
+    }
+}
+
+
+static ngx_uint_t
+ngx_log_async_flush(ngx_log_async_t *alog)
+{
+    u_char             *p, *end;
+    size_t              pos, n;
+    ssize_t             written;
+    ngx_fd_t            fd;
+    ngx_uint_t          busy;
+    ngx_atomic_uint_t   head, tail, dropped, lost;
+    u_char              errstr[NGX_MAX_ERROR_STR];
+
+    busy = 0;
+
+    head = alog->head;
+
+    ngx_memory_barrier();
+
+    tail = alog->tail;
+
+    while (tail != head) {
+
+        pos = tail % alog->size;
+        n = ngx_min(head - tail, alog->size - pos);
+
+        written = ngx_write_fd(alog->fd, alog->start + pos, n);
+
+        if (written > 0) {
+            n = written;
+
+        } else {
+
+            /* the data are lost, account the messages as dropped */
+
+            lost = 0;
+            end = alog->start + pos + n;
+
+            for (p = alog->start + pos; p < end; p++) {
+                if (*p == LF) {
+                    lost++;
+                }
+            }
+
+            (void) ngx_atomic_fetch_add(&alog->dropped, lost ? lost : 1);
+        }
+
+        tail += n;
+
+        alog->tail = tail;
+
+        busy = 1;
+    }
+
+    dropped = alog->dropped;
+
+    if (dropped) {
+        (void) ngx_atomic_fetch_add(&alog->dropped, -dropped);
+
+        p = ngx_snprintf(errstr, NGX_MAX_ERROR_STR - NGX_LINEFEED_SIZE,
+                         "%V [alert] %P#" NGX_TID_T_FMT ": "
+                         "%uA error log messages dropped",
+                         &ngx_cached_err_log_time, ngx_log_pid, ngx_log_tid,
+                         dropped);
+
+        ngx_linefeed(p);
+
+        (void) ngx_write_fd(alog->fd, errstr, p - errstr);
+    }
+
+    /* the log was reopened by the main thread */
+
+    if (alog->file->fd != alog->file_fd) {
+        alog->file_fd = alog->file->fd;
+
+        fd = ngx_open_file(alog->file->name.data, NGX_FILE_APPEND,
+                           NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+
+        if (fd != NGX_INVALID_FILE) {
+            (void) ngx_close_file(alog->fd);
+            alog->fd = fd;
+        }
+    }
+
+    return busy;
+}
+
+#endif
@@ -9,6 +9,100 @@
 #include <ngx_core.h>
 
 
+#define NGX_PROXY_PROTOCOL_AF_INET          1
+#define NGX_PROXY_PROTOCOL_AF_INET6         2
+
+#define NGX_PROXY_PROTOCOL_CMD_LOCAL        0
+#define NGX_PROXY_PROTOCOL_CMD_PROXY        1
+
+#define NGX_PROXY_PROTOCOL_STREAM           1
+#define NGX_PROXY_PROTOCOL_DGRAM            2
+
+#define NGX_PROXY_PROTOCOL_TLV_ALPN         0x01
+#define NGX_PROXY_PROTOCOL_TLV_AUTHORITY    0x02
+#define NGX_PROXY_PROTOCOL_TLV_SSL          0x20
+
+
+#define ngx_proxy_protocol_parse_uint16(p)  ((p)[0] << 8 | (p)[1])
+
+#define ngx_proxy_protocol_write_uint16(p, n)                                \
+    (p)[0] = (u_char) ((n) >> 8); (p)[1] = (u_char) (n)
+
+
+typedef struct {
+    u_char                                  signature[12];
+    u_char                                  version_command;
+    u_char                                  family_transport;
+    u_char                                  len[2];
+} ngx_proxy_protocol_header_t;
+
+
+typedef struct {
+    u_char                                  src_addr[4];
+    u_char                                  dst_addr[4];
+    u_char                                  src_port[2];
+    u_char                                  dst_port[2];
+} ngx_proxy_protocol_inet_addrs_t;
+
+
+typedef struct {
+    u_char                                  src_addr[16];
+    u_char                                  dst_addr[16];
+    u_char                                  src_port[2];
+    u_char                                  dst_port[2];
+} ngx_proxy_protocol_inet6_addrs_t;
+
+
+typedef struct {
+    u_char                                  type;
+    u_char                                  len[2];
+} ngx_proxy_protocol_tlv_t;
+
+
+typedef struct {
+    u_char                                  client;
+    u_char                                  verify[4];
+} ngx_proxy_protocol_tlv_ssl_t;
+
+
+typedef struct {
+    ngx_str_t                               name;
+    ngx_uint_t                              type;
+} ngx_proxy_protocol_tlv_entry_t;
+
+
+static u_char *ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf,
+    u_char *last);
+static ngx_int_t ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c,
+    ngx_str_t *tlvs, ngx_uint_t type, ngx_str_t *value);
+static u_char *ngx_proxy_protocol_write_tlv(u_char *p, u_char *last,
+    ngx_uint_t type, u_char *data, size_t len);
+
+
+static u_char  ngx_proxy_protocol_v2_signature[12] =
+    "\x0d\x0a\x0d\x0a\x00\x0d\x0a\x51\x55\x49\x54\x0a";
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_entries[] = {
+    { ngx_string("alpn"),       0x01 },
+    { ngx_string("authority"),  0x02 },
+    { ngx_string("unique_id"),  0x05 },
+    { ngx_string("ssl"),        0x20 },
+    { ngx_string("netns"),      0x30 },
+    { ngx_null_string,          0x00 }
+};
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_ssl_entries[] = {
+    { ngx_string("version"),    0x21 },
+    { ngx_string("cn"),         0x22 },
+    { ngx_string("cipher"),     0x23 },
+    { ngx_string("sig_alg"),    0x24 },
+    { ngx_string("key_alg"),    0x25 },
+    { ngx_null_string,          0x00 }
+};
+
+
 u_char *
 ngx_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
 {
@@ -19,6 +113,21 @@ ngx_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
     p = buf;
     len = last - buf;
 
+    if (len >= sizeof(ngx_proxy_protocol_header_t)
+        && ngx_memcmp(p, ngx_proxy_protocol_v2_signature,
+                      sizeof(ngx_proxy_protocol_v2_signature))
+           == 0)
+    {
+        return ngx_proxy_protocol_v2_read(c, buf, last);
+    }
+
+    /* a version 1 header line including CRLF may not exceed 107 bytes */
+
+    if (len > NGX_PROXY_PROTOCOL_V1_MAX_HEADER) {
+        last = buf + NGX_PROXY_PROTOCOL_V1_MAX_HEADER;
+        len = NGX_PROXY_PROTOCOL_V1_MAX_HEADER;
+    }
+
     if (len < 8 || ngx_strncmp(p, "PROXY ", 6) != 0) {
         goto invalid;
     }
@@ -129,7 +238,7 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 {
     ngx_uint_t  port, lport;
 
-    if (last - buf < NGX_PROXY_PROTOCOL_MAX_HEADER) {
+    if (last - buf < NGX_PROXY_PROTOCOL_V1_MAX_HEADER) {
         return NULL;
     }
 
@@ -166,3 +275,453 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 
     return ngx_slprintf(buf, last, " %ui %ui" CRLF, port, lport);
 }
+
+
+static u_char *
+ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    u_char                             *end;
+    size_t                              len;
+    socklen_t                           socklen;
+    ngx_uint_t                          version, command, family, transport;
+    ngx_sockaddr_t                      sockaddr;
+    ngx_proxy_protocol_header_t        *header;
+    ngx_proxy_protocol_inet_addrs_t    *in;
+#if (NGX_HAVE_INET6)
+    ngx_proxy_protocol_inet6_addrs_t   *in6;
+#endif
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    buf += sizeof(ngx_proxy_protocol_header_t);
+
+    version = header->version_command >> 4;
+
+    if (version != 2) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "unknown PROXY protocol version: %ui", version);
+        return NULL;
+    }
+
+    len = ngx_proxy_protocol_parse_uint16(header->len);
+
+    if ((size_t) (last - buf) < len) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "header is too large or truncated");
+        return NULL;
+    }
+
+    end = buf + len;
+
+    command = header->version_command & 0x0f;
+
+    if (command != NGX_PROXY_PROTOCOL_CMD_PROXY) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 unsupported command %ui", command);
+        return end;
+    }
+
+    transport = header->family_transport & 0x0f;
+
+    if (transport != NGX_PROXY_PROTOCOL_STREAM
+        && transport != NGX_PROXY_PROTOCOL_DGRAM)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 unsupported transport %ui",
+                       transport);
+        return end;
+    }
+
+    family = header->family_transport >> 4;
+
+    ngx_memzero(&sockaddr, sizeof(ngx_sockaddr_t));
+
+    switch (family) {
+
+    case NGX_PROXY_PROTOCOL_AF_INET:
+
+        if (len < sizeof(ngx_proxy_protocol_inet_addrs_t)) {
+            goto invalid;
+        }
+
+        in = (ngx_proxy_protocol_inet_addrs_t *) buf;
+
+        sockaddr.sockaddr_in.sin_family = AF_INET;
+        sockaddr.sockaddr_in.sin_port = 0;
+        ngx_memcpy(&sockaddr.sockaddr_in.sin_addr, in->src_addr, 4);
+
+        c->proxy_protocol_port = ngx_proxy_protocol_parse_uint16(in->src_port);
+
+        socklen = sizeof(struct sockaddr_in);
+
+        buf += sizeof(ngx_proxy_protocol_inet_addrs_t);
+
+        break;
+
+#if (NGX_HAVE_INET6)
+
+    case NGX_PROXY_PROTOCOL_AF_INET6:
+
+        if (len < sizeof(ngx_proxy_protocol_inet6_addrs_t)) {
+            goto invalid;
+        }
+
+        in6 = (ngx_proxy_protocol_inet6_addrs_t *) buf;
+
+        sockaddr.sockaddr_in6.sin6_family = AF_INET6;
+        sockaddr.sockaddr_in6.sin6_port = 0;
+        ngx_memcpy(&sockaddr.sockaddr_in6.sin6_addr, in6->src_addr, 16);
+
+        c->proxy_protocol_port = ngx_proxy_protocol_parse_uint16(in6->src_port);
+
+        socklen = sizeof(struct sockaddr_in6);
+
+        buf += sizeof(ngx_proxy_protocol_inet6_addrs_t);
+
+        break;
+
+#endif
+
+    default:
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 unsupported address family %ui",
+                       family);
+        return end;
+    }
+
+    c->proxy_protocol_addr.data = ngx_pnalloc(c->pool, NGX_SOCKADDR_STRLEN);
+    if (c->proxy_protocol_addr.data == NULL) {
+        return NULL;
+    }
+
+    c->proxy_protocol_addr.len = ngx_sock_ntop(&sockaddr.sockaddr, socklen,
+                                               c->proxy_protocol_addr.data,
+                                               NGX_SOCKADDR_STRLEN, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 address: %V %d",
+                   &c->proxy_protocol_addr, c->proxy_protocol_port);
+
+    if (buf < end) {
+        len = end - buf;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 TLVs: %uz", len);
+
+        c->proxy_protocol_tlvs.data = ngx_pnalloc(c->pool, len);
+        if (c->proxy_protocol_tlvs.data == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(c->proxy_protocol_tlvs.data, buf, len);
+        c->proxy_protocol_tlvs.len = len;
+    }
+
+    return end;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "broken PROXY protocol v2 header: address block too short");
+
+    return NULL;
+}
+
+
+u_char *
+ngx_proxy_protocol_v2_write(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    u_char                             *p;
+    size_t                              len;
+    ngx_uint_t                          port, lport;
+    ngx_proxy_protocol_header_t        *header;
+    ngx_proxy_protocol_inet_addrs_t    *in;
+    struct sockaddr_in                 *sin, *lsin;
+#if (NGX_HAVE_INET6)
+    ngx_proxy_protocol_inet6_addrs_t   *in6;
+    struct sockaddr_in6                *sin6, *lsin6;
+#endif
+#if (NGX_SSL)
+    const char                         *servername;
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    unsigned int                        alpn_len;
+    const unsigned char                *alpn;
+#endif
+#endif
+
+    if ((size_t) (last - buf) < sizeof(ngx_proxy_protocol_header_t)
+                                + sizeof(ngx_proxy_protocol_inet6_addrs_t))
+    {
+        return NULL;
+    }
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    ngx_memcpy(header->signature, ngx_proxy_protocol_v2_signature,
+               sizeof(ngx_proxy_protocol_v2_signature));
+
+    header->version_command = 0x20 | NGX_PROXY_PROTOCOL_CMD_PROXY;
+    header->family_transport = (c->type == SOCK_DGRAM)
+                               ? NGX_PROXY_PROTOCOL_DGRAM
+                               : NGX_PROXY_PROTOCOL_STREAM;
+
+    p = buf + sizeof(ngx_proxy_protocol_header_t);
+
+    port = ngx_inet_get_port(c->sockaddr);
+    lport = ngx_inet_get_port(c->local_sockaddr);
+
+    switch (c->sockaddr->sa_family) {
+
+    case AF_INET:
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET << 4;
+
+        in = (ngx_proxy_protocol_inet_addrs_t *) p;
+
+        sin = (struct sockaddr_in *) c->sockaddr;
+        lsin = (struct sockaddr_in *) c->local_sockaddr;
+
+        ngx_memcpy(in->src_addr, &sin->sin_addr, 4);
+        ngx_memcpy(in->dst_addr, &lsin->sin_addr, 4);
+        ngx_proxy_protocol_write_uint16(in->src_port, port);
+        ngx_proxy_protocol_write_uint16(in->dst_port, lport);
+
+        p += sizeof(ngx_proxy_protocol_inet_addrs_t);
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET6 << 4;
+
+        in6 = (ngx_proxy_protocol_inet6_addrs_t *) p;
+
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        lsin6 = (struct sockaddr_in6 *) c->local_sockaddr;
+
+        ngx_memcpy(in6->src_addr, &sin6->sin6_addr, 16);
+        ngx_memcpy(in6->dst_addr, &lsin6->sin6_addr, 16);
+        ngx_proxy_protocol_write_uint16(in6->src_port, port);
+        ngx_proxy_protocol_write_uint16(in6->dst_port, lport);
+
+        p += sizeof(ngx_proxy_protocol_inet6_addrs_t);
+        break;
+#endif
+
+    default:
+
+        /*
+         * unspecified address family, no address block; the LOCAL
+         * command tells the receiver to use the connection endpoints
+         */
+
+        header->version_command = 0x20 | NGX_PROXY_PROTOCOL_CMD_LOCAL;
+        header->family_transport = 0;
+    }
+
+#if (NGX_SSL)
+
+    if (c->ssl) {
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+        servername = SSL_get_servername(c->ssl->connection,
+                                        TLSEXT_NAMETYPE_host_name);
+        if (servername) {
+            p = ngx_proxy_protocol_write_tlv(p, last,
+                                             NGX_PROXY_PROTOCOL_TLV_AUTHORITY,
+                                             (u_char *) servername,
+                                             ngx_strlen(servername));
+            if (p == NULL) {
+                return NULL;
+            }
+        }
+
+#endif
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+        SSL_get0_alpn_selected(c->ssl->connection, &alpn, &alpn_len);
+
+        if (alpn_len) {
+            p = ngx_proxy_protocol_write_tlv(p, last,
+                                             NGX_PROXY_PROTOCOL_TLV_ALPN,
+                                             (u_char *) alpn, alpn_len);
+            if (p == NULL) {
+                return NULL;
+            }
+        }
+
+#endif
+    }
+
+#endif
+
+    len = p - buf - sizeof(ngx_proxy_protocol_header_t);
+
+    ngx_proxy_protocol_write_uint16(header->len, len);
+
+    return p;
+}
+
+
+static u_char *
+ngx_proxy_protocol_write_tlv(u_char *p, u_char *last, ngx_uint_t type,
+    u_char *data, size_t len)
+{
+    ngx_proxy_protocol_tlv_t  *tlv;
+
+    if ((size_t) (last - p) < sizeof(ngx_proxy_protocol_tlv_t) + len) {
+        return NULL;
+    }
+
+    tlv = (ngx_proxy_protocol_tlv_t *) p;
+
+    tlv->type = (u_char) type;
+    ngx_proxy_protocol_write_uint16(tlv->len, len);
+
+    p += sizeof(ngx_proxy_protocol_tlv_t);
+
+    return ngx_cpymem(p, data, len);
+}
+
+
+ngx_int_t
+ngx_proxy_protocol_get_tlv(ngx_connection_t *c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char                          *p;
+    size_t                           n;
+    uint32_t                         verify;
+    ngx_str_t                        ssl, *tlvs;
+    ngx_int_t                        rc, type;
+    ngx_proxy_protocol_tlv_ssl_t    *tlv_ssl;
+    ngx_proxy_protocol_tlv_entry_t  *te;
+
+    tlvs = &c->proxy_protocol_tlvs;
+
+    if (tlvs->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 get tlv \"%V\"", name);
+
+    te = ngx_proxy_protocol_tlv_entries;
+    n = name->len;
+
+    if (n >= 4 && ngx_strncmp(name->data, "ssl_", 4) == 0) {
+
+        rc = ngx_proxy_protocol_lookup_tlv(c, tlvs,
+                                           NGX_PROXY_PROTOCOL_TLV_SSL, &ssl);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (ssl.len < sizeof(ngx_proxy_protocol_tlv_ssl_t)) {
+            return NGX_ERROR;
+        }
+
+        n -= 4;
+
+        if (n == 6 && ngx_strncmp(name->data + 4, "verify", 6) == 0) {
+
+            tlv_ssl = (ngx_proxy_protocol_tlv_ssl_t *) ssl.data;
+
+            verify = ((uint32_t) tlv_ssl->verify[0] << 24)
+                     | ((uint32_t) tlv_ssl->verify[1] << 16)
+                     | ((uint32_t) tlv_ssl->verify[2] << 8)
+                     | tlv_ssl->verify[3];
+
+            p = ngx_pnalloc(c->pool, NGX_INT32_LEN);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            value->data = p;
+            value->len = ngx_sprintf(p, "%uD", verify) - p;
+
+            return NGX_OK;
+        }
+
+        ssl.data += sizeof(ngx_proxy_protocol_tlv_ssl_t);
+        ssl.len -= sizeof(ngx_proxy_protocol_tlv_ssl_t);
+
+        te = ngx_proxy_protocol_tlv_ssl_entries;
+        tlvs = &ssl;
+    }
+
+    if (n >= 2 && name->data[name->len - n] == '0'
+        && name->data[name->len - n + 1] == 'x')
+    {
+        type = ngx_hextoi(name->data + name->len - n + 2, n - 2);
+        if (type == NGX_ERROR || type > 0xff) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "invalid PROXY protocol TLV \"%V\"", name);
+            return NGX_ERROR;
+        }
+
+        return ngx_proxy_protocol_lookup_tlv(c, tlvs, type, value);
+    }
+
+    for ( /* void */ ; te->type; te++) {
+        if (te->name.len == n
+            && ngx_strncmp(te->name.data, name->data + name->len - n, n) == 0)
+        {
+            return ngx_proxy_protocol_lookup_tlv(c, tlvs, te->type, value);
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "unknown PROXY protocol TLV \"%V\"", name);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c, ngx_str_t *tlvs,
+    ngx_uint_t type, ngx_str_t *value)
+{
+    u_char                    *p;
+    size_t                     n, len;
+    ngx_proxy_protocol_tlv_t  *tlv;
+
+    p = tlvs->data;
+    n = tlvs->len;
+
+    while (n) {
+        if (n < sizeof(ngx_proxy_protocol_tlv_t)) {
+            goto invalid;
+        }
+
+        tlv = (ngx_proxy_protocol_tlv_t *) p;
+        len = ngx_proxy_protocol_parse_uint16(tlv->len);
+
+        p += sizeof(ngx_proxy_protocol_tlv_t);
+        n -= sizeof(ngx_proxy_protocol_tlv_t);
+
+        if (n < len) {
+            goto invalid;
+        }
+
+        if (tlv->type == type) {
+            value->data = p;
+            value->len = len;
+            return NGX_OK;
+        }
+
+        p += len;
+        n -= len;
+    }
+
+    return NGX_DECLINED;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "broken PROXY protocol TLV");
+
+    return NGX_ERROR;
+}
@@ -33,6 +33,8 @@ typedef struct ngx_rbtree_s  ngx_rbtree_t;
 
 typedef void (*ngx_rbtree_insert_pt) (ngx_rbtree_node_t *root,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+ngx_rbtree_node_t *ngx_rbtree_next(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
 
 struct ngx_rbtree_s {
     ngx_rbtree_node_t     *root;
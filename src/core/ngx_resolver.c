@@ -51,10 +51,39 @@ typedef struct {
 } ngx_resolver_an_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t         node;
+    ngx_queue_t               queue;
+    time_t                    valid;
+    uint32_t                  ttl;
+    u_short                   nlen;
+    u_short                   naddrs;
+    u_short                   naddrs6;
+    u_short                   ipv6;
+    u_char                    data[1];
+} ngx_resolver_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+    ngx_queue_t               queue;
+} ngx_resolver_shctx_t;
+
+
+typedef struct {
+    ngx_resolver_shctx_t     *sh;
+    ngx_slab_pool_t          *shpool;
+} ngx_resolver_cache_t;
+
+
 #define ngx_resolver_node(n)                                                 \
     (ngx_resolver_node_t *)                                                  \
         ((u_char *) (n) - offsetof(ngx_resolver_node_t, node))
 
+#define ngx_resolver_cache_addrs(cn)                                         \
+    (in_addr_t *) ngx_align_ptr((cn)->data + (cn)->nlen, sizeof(in_addr_t))
+
 
 ngx_int_t ngx_udp_connect(ngx_resolver_connection_t *rec);
 ngx_int_t ngx_tcp_connect(ngx_resolver_connection_t *rec);
@@ -120,6 +149,23 @@ static void ngx_resolver_resolve_srv_names(ngx_resolver_ctx_t *ctx,
     ngx_resolver_node_t *rn);
 static void ngx_resolver_srv_names_handler(ngx_resolver_ctx_t *ctx);
 static ngx_int_t ngx_resolver_cmp_srvs(const void *one, const void *two);
+static ngx_resolver_node_t *ngx_resolver_refresh_name(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static ngx_int_t ngx_resolver_send_refresh(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_restore_stale(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_free_stale(ngx_resolver_t *r, ngx_resolver_node_t *rn);
+static ngx_int_t ngx_resolver_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_resolver_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_resolver_cache_node_t *ngx_resolver_cache_lookup(
+    ngx_resolver_t *r, ngx_resolver_cache_t *cache, ngx_resolver_node_t *rn);
+static ngx_int_t ngx_resolver_cache_get(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn, time_t valid);
+static void ngx_resolver_cache_set(ngx_resolver_t *r, ngx_resolver_node_t *rn);
+static void ngx_resolver_cache_expire(ngx_resolver_cache_t *cache,
+    ngx_uint_t n);
 
 #if (NGX_HAVE_INET6)
 static void ngx_resolver_rbtree_insert_addr6_value(ngx_rbtree_node_t *temp,
@@ -129,14 +175,20 @@ static ngx_resolver_node_t *ngx_resolver_lookup_addr6(ngx_resolver_t *r,
 #endif
 
 
+static ngx_uint_t  ngx_resolver_zone_tag;
+
+
 ngx_resolver_t *
 ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
 {
-    ngx_str_t                   s;
+    u_char                     *p;
+    ssize_t                     size;
+    ngx_str_t                   s, name;
     ngx_url_t                   u;
     ngx_uint_t                  i, j;
     ngx_resolver_t             *r;
     ngx_pool_cleanup_t         *cln;
+    ngx_resolver_cache_t       *cache;
     ngx_resolver_connection_t  *rec;
 
     cln = ngx_pool_cleanup_add(cf->pool, 0);
@@ -224,6 +276,88 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
             continue;
         }
 
+        if (ngx_strncmp(names[i].data, "stale=", 6) == 0) {
+            s.len = names[i].len - 6;
+            s.data = names[i].data + 6;
+
+            r->stale = ngx_parse_time(&s, 1);
+
+            if (r->stale == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter: %V", &names[i]);
+                return NULL;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(names[i].data, "prefetch=", 9) == 0) {
+
+            if (ngx_strcmp(&names[i].data[9], "on") == 0) {
+                r->prefetch = 1;
+
+            } else if (ngx_strcmp(&names[i].data[9], "off") == 0) {
+                r->prefetch = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter: %V", &names[i]);
+                return NULL;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(names[i].data, "zone=", 5) == 0) {
+
+            name.data = names[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &names[i]);
+                return NULL;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = names[i].data + names[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &names[i]);
+                return NULL;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &names[i]);
+                return NULL;
+            }
+
+            r->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                                &ngx_resolver_zone_tag);
+            if (r->shm_zone == NULL) {
+                return NULL;
+            }
+
+            if (r->shm_zone->data == NULL) {
+                cache = ngx_pcalloc(cf->pool, sizeof(ngx_resolver_cache_t));
+                if (cache == NULL) {
+                    return NULL;
+                }
+
+                r->shm_zone->init = ngx_resolver_init_zone;
+                r->shm_zone->data = cache;
+            }
+
+            continue;
+        }
+
 #if (NGX_HAVE_INET6)
         if (ngx_strncmp(names[i].data, "ipv6=", 5) == 0) {
 
@@ -590,7 +724,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
     ngx_rbtree_t         *tree;
     ngx_resolver_ctx_t   *next, *last;
     ngx_resolver_addr_t  *addrs;
-    ngx_resolver_node_t  *rn;
+    ngx_resolver_node_t  *rn, *an;
 
     ngx_strlow(name->data, name->data, name->len);
 
@@ -616,28 +750,37 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
         /* ctx can be a list after NGX_RESOLVE_CNAME */
         for (last = ctx; last->next; last = last->next);
 
-        if (rn->valid >= ngx_time()) {
+        an = rn;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_CORE, r->log, 0, "resolve cached");
+        if (ctx->service.len == 0 && (r->stale || r->prefetch)) {
+            an = ngx_resolver_refresh_name(r, rn);
+        }
 
-            ngx_queue_remove(&rn->queue);
+        if (rn->valid >= ngx_time() || an != rn) {
 
-            rn->expire = ngx_time() + r->expire;
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, r->log, 0, "resolve cached%s",
+                           an != rn ? " stale" : "");
 
-            ngx_queue_insert_head(expire_queue, &rn->queue);
+            if (an == rn) {
+                ngx_queue_remove(&rn->queue);
+
+                rn->expire = ngx_time() + r->expire;
+
+                ngx_queue_insert_head(expire_queue, &rn->queue);
+            }
 
-            naddrs = (rn->naddrs == (u_short) -1) ? 0 : rn->naddrs;
+            naddrs = (an->naddrs == (u_short) -1) ? 0 : an->naddrs;
 #if (NGX_HAVE_INET6)
-            naddrs += (rn->naddrs6 == (u_short) -1) ? 0 : rn->naddrs6;
+            naddrs += (an->naddrs6 == (u_short) -1) ? 0 : an->naddrs6;
 #endif
 
             if (naddrs) {
 
-                if (naddrs == 1 && rn->naddrs == 1) {
+                if (naddrs == 1 && an->naddrs == 1) {
                     addrs = NULL;
 
                 } else {
-                    addrs = ngx_resolver_export(r, rn, 1);
+                    addrs = ngx_resolver_export(r, an, 1);
                     if (addrs == NULL) {
                         return NGX_ERROR;
                     }
@@ -650,7 +793,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
 
                 do {
                     ctx->state = NGX_OK;
-                    ctx->valid = rn->valid;
+                    ctx->valid = an->valid;
                     ctx->naddrs = naddrs;
 
                     if (addrs == NULL) {
@@ -659,7 +802,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
                         ctx->addr.socklen = sizeof(struct sockaddr_in);
                         ngx_memzero(&ctx->sin, sizeof(struct sockaddr_in));
                         ctx->sin.sin_family = AF_INET;
-                        ctx->sin.sin_addr.s_addr = rn->u.addr;
+                        ctx->sin.sin_addr.s_addr = an->u.addr;
 
                     } else {
                         ctx->addrs = addrs;
@@ -791,6 +934,10 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
 
         /* unlock alloc mutex */
 
+        if (rn->stale) {
+            ngx_resolver_free_stale(r, rn);
+        }
+
     } else {
 
         rn = ngx_resolver_alloc(r, sizeof(ngx_resolver_node_t));
@@ -810,10 +957,24 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx,
 #if (NGX_HAVE_INET6)
         rn->query6 = NULL;
 #endif
+        rn->waiting = NULL;
+        rn->stale = NULL;
 
         ngx_rbtree_insert(tree, &rn->node);
     }
 
+    if (r->shm_zone && ctx->service.len == 0
+        && ngx_resolver_cache_get(r, rn, ngx_time()) == NGX_OK)
+    {
+        /* answered by another worker */
+
+        rn->expire = ngx_time() + r->expire;
+
+        ngx_queue_insert_head(expire_queue, &rn->queue);
+
+        return ngx_resolve_name_locked(r, ctx, name);
+    }
+
     if (ctx->service.len) {
         rc = ngx_resolver_create_srv_query(r, rn, name);
 
@@ -1059,6 +1220,7 @@ ngx_resolve_addr(ngx_resolver_ctx_t *ctx)
 #if (NGX_HAVE_INET6)
         rn->query6 = NULL;
 #endif
+        rn->stale = NULL;
 
         ngx_rbtree_insert(tree, &rn->node);
     }
@@ -1545,6 +1707,19 @@ ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
             continue;
         }
 
+        if (rn->stale) {
+
+            /* refresh timed out, keep serving the previous answer */
+
+            ngx_resolver_restore_stale(r, rn);
+
+            rn->expire = now + r->expire;
+
+            ngx_queue_insert_head(&r->name_expire_queue, q);
+
+            continue;
+        }
+
         ngx_rbtree_delete(tree, &rn->node);
 
         ngx_resolver_free_node(r, rn);
@@ -1991,7 +2166,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
 
         ngx_queue_remove(&rn->queue);
 
-        if (rn->waiting == NULL) {
+        if (rn->waiting == NULL && rn->stale == NULL) {
             ngx_rbtree_delete(&r->name_rbtree, &rn->node);
             ngx_resolver_free_node(r, rn);
             goto next;
@@ -2093,6 +2268,28 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
         }
 #endif
 
+        if (rn->stale
+            && rn->waiting == NULL
+            && code != NGX_RESOLVE_NXDOMAIN
+            && rn->stale->valid + r->stale >= ngx_time())
+        {
+            ngx_log_error(r->log_level, r->log, 0,
+                          "\"%*s\" could not be resolved (%i: %s), "
+                          "keeping stale answer",
+                          (size_t) rn->nlen, rn->name, code,
+                          ngx_resolver_strerror(code));
+
+            ngx_queue_remove(&rn->queue);
+
+            ngx_resolver_restore_stale(r, rn);
+
+            rn->expire = ngx_time() + r->expire;
+
+            ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+            return;
+        }
+
         next = rn->waiting;
         rn->waiting = NULL;
 
@@ -2412,6 +2609,14 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        if (rn->stale) {
+            ngx_resolver_free_stale(r, rn);
+        }
+
+        if (r->shm_zone) {
+            ngx_resolver_cache_set(r, rn);
+        }
+
         next = rn->waiting;
         rn->waiting = NULL;
 
@@ -2484,6 +2689,10 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        if (rn->stale) {
+            ngx_resolver_free_stale(r, rn);
+        }
+
         ngx_resolver_free(r, rn->query);
         rn->query = NULL;
 #if (NGX_HAVE_INET6)
@@ -4086,6 +4295,10 @@ ngx_resolver_free_node(ngx_resolver_t *r, ngx_resolver_node_t *rn)
         ngx_resolver_free_locked(r, rn->u.srvs);
     }
 
+    if (rn->stale) {
+        ngx_resolver_free_stale(r, rn);
+    }
+
     ngx_resolver_free_locked(r, rn);
 
     /* unlock alloc mutex */
@@ -4660,3 +4873,599 @@ ngx_resolver_cmp_srvs(const void *one, const void *two)
 
     return p1 - p2;
 }
+
+
+static ngx_resolver_node_t *
+ngx_resolver_refresh_name(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    time_t      now, ttl;
+    ngx_uint_t  naddrs;
+
+    now = ngx_time();
+
+    if (rn->stale) {
+
+        /* refresh is in progress */
+
+        if (rn->stale->valid + r->stale >= now) {
+            return rn->stale;
+        }
+
+        return rn;
+    }
+
+    if (rn->query || rn->cnlen || rn->nsrvs) {
+        return rn;
+    }
+
+    naddrs = rn->naddrs;
+#if (NGX_HAVE_INET6)
+    naddrs += rn->naddrs6;
+#endif
+
+    if (naddrs == 0) {
+        return rn;
+    }
+
+    if (rn->valid >= now) {
+
+        if (!r->prefetch) {
+            return rn;
+        }
+
+        /* prefetch names during the last tenth of their validity */
+
+        ttl = r->valid ? r->valid : (time_t) rn->ttl;
+
+        if ((rn->valid - now) * 10 > ttl) {
+            return rn;
+        }
+
+    } else if (rn->valid + r->stale < now) {
+        return rn;
+    }
+
+    if (ngx_resolver_send_refresh(r, rn) != NGX_OK) {
+        return rn;
+    }
+
+    return rn->stale ? rn->stale : rn;
+}
+
+
+static ngx_int_t
+ngx_resolver_send_refresh(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    ngx_str_t             name;
+    ngx_resolver_node_t  *sn;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, r->log, 0,
+                   "resolve refresh \"%*s\"", (size_t) rn->nlen, rn->name);
+
+    sn = ngx_resolver_dup(r, rn, sizeof(ngx_resolver_node_t));
+    if (sn == NULL) {
+        return NGX_ERROR;
+    }
+
+    rn->stale = sn;
+
+    rn->naddrs = 0;
+#if (NGX_HAVE_INET6)
+    rn->naddrs6 = 0;
+#endif
+
+    ngx_queue_remove(&rn->queue);
+
+    if (r->shm_zone
+        && ngx_resolver_cache_get(r, rn, ngx_max(sn->valid + 1, ngx_time()))
+           == NGX_OK)
+    {
+        /* refreshed by another worker */
+
+        ngx_resolver_free_stale(r, rn);
+
+        rn->expire = ngx_time() + r->expire;
+
+        ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+        return NGX_OK;
+    }
+
+    name.len = rn->nlen;
+    name.data = rn->name;
+
+    if (ngx_resolver_create_name_query(r, rn, &name) != NGX_OK) {
+        goto failed;
+    }
+
+    rn->last_connection = r->last_connection++;
+    if (r->last_connection == r->connections.nelts) {
+        r->last_connection = 0;
+    }
+
+    rn->naddrs = (u_short) -1;
+    rn->tcp = 0;
+#if (NGX_HAVE_INET6)
+    rn->naddrs6 = r->ipv6 ? (u_short) -1 : 0;
+    rn->tcp6 = 0;
+#endif
+
+    if (ngx_resolver_send_query(r, rn) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_resolver_resend_empty(r)) {
+        ngx_add_timer(r->event, (ngx_msec_t) (r->resend_timeout * 1000));
+    }
+
+    rn->expire = ngx_time() + r->resend_timeout;
+
+    ngx_queue_insert_head(&r->name_resend_queue, &rn->queue);
+
+    rn->code = 0;
+    rn->valid = 0;
+    rn->ttl = NGX_MAX_UINT32_VALUE;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_resolver_restore_stale(r, rn);
+
+    rn->expire = ngx_time() + r->expire;
+
+    ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_resolver_restore_stale(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    ngx_resolver_node_t  *sn;
+
+    sn = rn->stale;
+
+    if (rn->query) {
+        ngx_resolver_free(r, rn->query);
+        rn->query = NULL;
+#if (NGX_HAVE_INET6)
+        rn->query6 = NULL;
+#endif
+    }
+
+    if (rn->naddrs > 1 && rn->naddrs != (u_short) -1) {
+        ngx_resolver_free(r, rn->u.addrs);
+    }
+
+    rn->u = sn->u;
+    rn->naddrs = sn->naddrs;
+
+#if (NGX_HAVE_INET6)
+    if (rn->naddrs6 > 1 && rn->naddrs6 != (u_short) -1) {
+        ngx_resolver_free(r, rn->u6.addrs6);
+    }
+
+    rn->u6 = sn->u6;
+    rn->naddrs6 = sn->naddrs6;
+#endif
+
+    rn->code = 0;
+    rn->valid = sn->valid;
+    rn->ttl = sn->ttl;
+
+    rn->stale = NULL;
+
+    ngx_resolver_free(r, sn);
+}
+
+
+static void
+ngx_resolver_free_stale(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    ngx_resolver_node_t  *sn;
+
+    sn = rn->stale;
+
+    /* lock alloc mutex */
+
+    if (sn->naddrs > 1) {
+        ngx_resolver_free_locked(r, sn->u.addrs);
+    }
+
+#if (NGX_HAVE_INET6)
+    if (sn->naddrs6 > 1) {
+        ngx_resolver_free_locked(r, sn->u6.addrs6);
+    }
+#endif
+
+    ngx_resolver_free_locked(r, sn);
+
+    /* unlock alloc mutex */
+
+    rn->stale = NULL;
+}
+
+
+static ngx_int_t
+ngx_resolver_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_resolver_cache_t  *ocache = data;
+
+    size_t                 len;
+    ngx_resolver_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_resolver_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_resolver_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in resolver zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in resolver zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_resolver_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t         **p;
+    ngx_resolver_cache_node_t  *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_resolver_cache_node_t *) node;
+            cnt = (ngx_resolver_cache_node_t *) temp;
+
+            rc = ngx_memn2cmp(cn->data, cnt->data, cn->nlen, cnt->nlen);
+
+            if (rc == 0) {
+                rc = (ngx_int_t) cn->ipv6 - (ngx_int_t) cnt->ipv6;
+            }
+
+            p = (rc < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_resolver_cache_node_t *
+ngx_resolver_cache_lookup(ngx_resolver_t *r, ngx_resolver_cache_t *cache,
+    ngx_resolver_node_t *rn)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  ipv6;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_resolver_cache_node_t  *cn;
+
+#if (NGX_HAVE_INET6)
+    ipv6 = r->ipv6;
+#else
+    ipv6 = 0;
+#endif
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (rn->node.key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (rn->node.key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_resolver_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(rn->name, cn->data, rn->nlen, cn->nlen);
+
+        if (rc == 0) {
+            rc = (ngx_int_t) ipv6 - (ngx_int_t) cn->ipv6;
+        }
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_resolver_cache_get(ngx_resolver_t *r, ngx_resolver_node_t *rn,
+    time_t valid)
+{
+    in_addr_t                  *addrs;
+    ngx_resolver_cache_t       *cache;
+    ngx_resolver_cache_node_t  *cn;
+#if (NGX_HAVE_INET6)
+    struct in6_addr            *addrs6;
+#endif
+
+    cache = r->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_resolver_cache_lookup(r, cache, rn);
+
+    if (cn == NULL || cn->valid < valid) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    addrs = ngx_resolver_cache_addrs(cn);
+
+    if (cn->naddrs == 1) {
+        rn->u.addr = addrs[0];
+
+    } else if (cn->naddrs > 1) {
+        rn->u.addrs = ngx_resolver_dup(r, addrs,
+                                       cn->naddrs * sizeof(in_addr_t));
+        if (rn->u.addrs == NULL) {
+            goto failed;
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+    addrs6 = (struct in6_addr *) &addrs[cn->naddrs];
+
+    if (cn->naddrs6 == 1) {
+        rn->u6.addr6 = addrs6[0];
+
+    } else if (cn->naddrs6 > 1) {
+        rn->u6.addrs6 = ngx_resolver_dup(r, addrs6,
+                                         cn->naddrs6 * sizeof(struct in6_addr));
+        if (rn->u6.addrs6 == NULL) {
+            if (cn->naddrs > 1) {
+                ngx_resolver_free(r, rn->u.addrs);
+            }
+
+            goto failed;
+        }
+    }
+
+    rn->naddrs6 = cn->naddrs6;
+    rn->tcp6 = 0;
+#endif
+
+    rn->naddrs = cn->naddrs;
+    rn->tcp = 0;
+
+    rn->valid = cn->valid;
+    rn->ttl = cn->ttl;
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    rn->code = 0;
+    rn->cnlen = 0;
+    rn->nsrvs = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, r->log, 0,
+                   "resolve shared \"%*s\"", (size_t) rn->nlen, rn->name);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_resolver_cache_set(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    size_t                      size;
+    in_addr_t                  *addrs;
+    ngx_uint_t                  naddrs6;
+    ngx_resolver_cache_t       *cache;
+    ngx_resolver_cache_node_t  *cn;
+#if (NGX_HAVE_INET6)
+    struct in6_addr            *addrs6;
+#endif
+
+#if (NGX_HAVE_INET6)
+    naddrs6 = rn->naddrs6;
+#else
+    naddrs6 = 0;
+#endif
+
+    cache = r->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_resolver_cache_lookup(r, cache, rn);
+
+    if (cn && (cn->naddrs != rn->naddrs || cn->naddrs6 != naddrs6)) {
+        ngx_queue_remove(&cn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+        ngx_slab_free_locked(cache->shpool, cn);
+
+        cn = NULL;
+    }
+
+    if (cn == NULL) {
+
+        size = offsetof(ngx_resolver_cache_node_t, data)
+               + rn->nlen + sizeof(in_addr_t)
+               + rn->naddrs * sizeof(in_addr_t);
+#if (NGX_HAVE_INET6)
+        size += naddrs6 * sizeof(struct in6_addr);
+#endif
+
+        ngx_resolver_cache_expire(cache, 1);
+
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (cn == NULL) {
+            ngx_resolver_cache_expire(cache, 0);
+
+            cn = ngx_slab_alloc_locked(cache->shpool, size);
+            if (cn == NULL) {
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_ALERT, r->log, 0,
+                              "could not allocate node%s",
+                              cache->shpool->log_ctx);
+                return;
+            }
+        }
+
+        cn->node.key = rn->node.key;
+        cn->nlen = rn->nlen;
+        cn->naddrs = rn->naddrs;
+        cn->naddrs6 = (u_short) naddrs6;
+#if (NGX_HAVE_INET6)
+        cn->ipv6 = (u_short) r->ipv6;
+#else
+        cn->ipv6 = 0;
+#endif
+
+        ngx_memcpy(cn->data, rn->name, rn->nlen);
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+
+    } else {
+        ngx_queue_remove(&cn->queue);
+    }
+
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    cn->valid = rn->valid;
+    cn->ttl = r->valid ? (uint32_t) r->valid : rn->ttl;
+
+    addrs = ngx_resolver_cache_addrs(cn);
+
+    if (rn->naddrs == 1) {
+        addrs[0] = rn->u.addr;
+
+    } else if (rn->naddrs > 1) {
+        ngx_memcpy(addrs, rn->u.addrs, rn->naddrs * sizeof(in_addr_t));
+    }
+
+#if (NGX_HAVE_INET6)
+    addrs6 = (struct in6_addr *) &addrs[rn->naddrs];
+
+    if (rn->naddrs6 == 1) {
+        addrs6[0] = rn->u6.addr6;
+
+    } else if (rn->naddrs6 > 1) {
+        ngx_memcpy(addrs6, rn->u6.addrs6,
+                   rn->naddrs6 * sizeof(struct in6_addr));
+    }
+#endif
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_resolver_cache_expire(ngx_resolver_cache_t *cache, ngx_uint_t n)
+{
+    time_t                      now;
+    ngx_queue_t                *q;
+    ngx_resolver_cache_node_t  *cn;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes the least recently used entry
+     *        and one or two expired entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+
+        cn = ngx_queue_data(q, ngx_resolver_cache_node_t, queue);
+
+        if (n++ != 0 && cn->valid >= now) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+
+        ngx_slab_free_locked(cache->shpool, cn);
+    }
+}
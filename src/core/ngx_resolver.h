@@ -89,7 +89,9 @@ typedef struct {
 } ngx_resolver_srv_name_t;
 
 
-typedef struct {
+typedef struct ngx_resolver_node_s  ngx_resolver_node_t;
+
+struct ngx_resolver_node_s {
     ngx_rbtree_node_t         node;
     ngx_queue_t               queue;
 
@@ -142,7 +144,10 @@ typedef struct {
     ngx_uint_t                last_connection;
 
     ngx_resolver_ctx_t       *waiting;
-} ngx_resolver_node_t;
+
+    /* A: previous answer, used while the name is being refreshed */
+    ngx_resolver_node_t      *stale;
+};
 
 
 struct ngx_resolver_s {
@@ -187,8 +192,12 @@ struct ngx_resolver_s {
     time_t                    tcp_timeout;
     time_t                    expire;
     time_t                    valid;
+    time_t                    stale;
 
+    ngx_uint_t                prefetch;             /* unsigned  prefetch:1; */
     ngx_uint_t                log_level;
+
+    ngx_shm_zone_t           *shm_zone;
 };
 
 
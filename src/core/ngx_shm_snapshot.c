@@ -0,0 +1,678 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_SHM_SNAPSHOT_BUFSIZE  65536
+#define NGX_SHM_SNAPSHOT_VERSION  1
+
+#if (NGX_HAVE_OPENAT)
+#define NGX_SHM_SNAPSHOT_OPEN                                                 \
+    (NGX_FILE_RDONLY|NGX_FILE_NONBLOCK|NGX_FILE_NOFOLLOW)
+#else
+#define NGX_SHM_SNAPSHOT_OPEN     (NGX_FILE_RDONLY|NGX_FILE_NONBLOCK)
+#endif
+
+
+typedef struct {
+    u_char                    magic[8];
+    uint32_t                  version;
+    uint32_t                  ptr_size;
+    time_t                    time;
+} ngx_shm_snapshot_header_t;
+
+
+typedef struct {
+    ngx_path_t               *path;
+    ngx_msec_t                interval;
+} ngx_shm_snapshot_conf_t;
+
+
+static void ngx_shm_snapshot_save_zones(ngx_cycle_t *cycle);
+static ngx_int_t ngx_shm_snapshot_save(ngx_shm_zone_t *zone, ngx_str_t *name,
+    ngx_str_t *temp, ngx_shm_snapshot_t *ss, ngx_log_t *log);
+static ngx_int_t ngx_shm_snapshot_flush(ngx_shm_snapshot_t *ss);
+static ngx_int_t ngx_shm_snapshot_file_name(ngx_pool_t *pool,
+    ngx_shm_snapshot_conf_t *sscf, ngx_shm_zone_t *zone, ngx_str_t *name,
+    ngx_str_t *temp);
+static void ngx_shm_snapshot_handler(ngx_event_t *ev);
+
+static void *ngx_shm_snapshot_create_conf(ngx_cycle_t *cycle);
+static char *ngx_shm_snapshot_init_conf(ngx_cycle_t *cycle, void *conf);
+static char *ngx_shm_snapshot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_shm_snapshot_init_process(ngx_cycle_t *cycle);
+static void ngx_shm_snapshot_exit_master(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_shm_snapshot_commands[] = {
+
+    { ngx_string("shm_snapshot"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE12,
+      ngx_shm_snapshot,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_shm_snapshot_module_ctx = {
+    ngx_string("shm_snapshot"),
+    ngx_shm_snapshot_create_conf,
+    ngx_shm_snapshot_init_conf
+};
+
+
+ngx_module_t  ngx_shm_snapshot_module = {
+    NGX_MODULE_V1,
+    &ngx_shm_snapshot_module_ctx,          /* module context */
+    ngx_shm_snapshot_commands,             /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_shm_snapshot_init_process,         /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    ngx_shm_snapshot_exit_master,          /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static u_char       ngx_shm_snapshot_magic[8] = "NGXSHMS\n";
+
+static ngx_event_t  ngx_shm_snapshot_event;
+
+
+ngx_int_t
+ngx_shm_snapshot_restore(ngx_cycle_t *cycle, ngx_shm_zone_t *zone)
+{
+    ssize_t                     n;
+    ngx_int_t                   rc;
+    ngx_str_t                   name;
+    ngx_pool_t                 *pool;
+    ngx_file_info_t             fi;
+    ngx_shm_snapshot_t          ss;
+    ngx_shm_snapshot_conf_t    *sscf;
+    ngx_shm_snapshot_header_t   header;
+
+    if (zone->restore == NULL
+        || ngx_test_config
+        || ngx_process == NGX_PROCESS_SIGNALLER)
+    {
+        return NGX_OK;
+    }
+
+    sscf = (ngx_shm_snapshot_conf_t *)
+               ngx_get_conf(cycle->conf_ctx, ngx_shm_snapshot_module);
+
+    if (sscf->path == NULL) {
+        return NGX_OK;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_shm_snapshot_file_name(pool, sscf, zone, &name, NULL) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&ss, sizeof(ngx_shm_snapshot_t));
+
+    ss.file.name = name;
+    ss.file.log = cycle->log;
+
+    /* the directory is writable by worker processes, see ngx_shm_snapshot() */
+
+    ss.file.fd = ngx_open_file(name.data, NGX_SHM_SNAPSHOT_OPEN, NGX_FILE_OPEN,
+                               0);
+
+    if (ss.file.fd == NGX_INVALID_FILE) {
+
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", name.data);
+        }
+
+        ngx_destroy_pool(pool);
+        return NGX_OK;
+    }
+
+    if (ngx_fd_info(ss.file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name.data);
+        goto done;
+    }
+
+    if (!ngx_is_file(&fi)) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "shared memory snapshot \"%s\" is not a regular file, "
+                      "ignored", name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&ss.file, (u_char *) &header,
+                      sizeof(ngx_shm_snapshot_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_shm_snapshot_header_t)
+        || ngx_memcmp(header.magic, ngx_shm_snapshot_magic, 8) != 0
+        || header.version != NGX_SHM_SNAPSHOT_VERSION
+        || header.ptr_size != NGX_PTR_SIZE)
+    {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "shared memory snapshot \"%s\" is not compatible, "
+                      "ignored", name.data);
+        goto done;
+    }
+
+    ss.time = header.time;
+
+    ss.start = ngx_palloc(pool, NGX_SHM_SNAPSHOT_BUFSIZE);
+    if (ss.start == NULL) {
+        goto done;
+    }
+
+    ss.pos = ss.start;
+    ss.last = ss.start;
+    ss.end = ss.start + NGX_SHM_SNAPSHOT_BUFSIZE;
+
+    rc = zone->restore(zone, &ss);
+
+    if (rc == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "shared memory zone \"%V\" restored from \"%s\", "
+                      "saved %T seconds ago",
+                      &zone->shm.name, name.data, ngx_time() - ss.time);
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "shared memory zone \"%V\" was not fully restored "
+                      "from \"%s\"", &zone->shm.name, name.data);
+    }
+
+done:
+
+    if (ngx_close_file(ss.file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name.data);
+    }
+
+    ngx_destroy_pool(pool);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_shm_snapshot_write(ngx_shm_snapshot_t *ss, void *data, size_t size)
+{
+    size_t   n;
+    u_char  *p;
+
+    p = data;
+
+    while (size) {
+
+        if (ss->last == ss->end) {
+            if (ngx_shm_snapshot_flush(ss) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        n = ngx_min(size, (size_t) (ss->end - ss->last));
+
+        ss->last = ngx_cpymem(ss->last, p, n);
+
+        p += n;
+        size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_shm_snapshot_read(ngx_shm_snapshot_t *ss, void *data, size_t size)
+{
+    size_t    n;
+    u_char   *p;
+    ssize_t   rc;
+
+    p = data;
+
+    while (size) {
+
+        if (ss->pos == ss->last) {
+
+            rc = ngx_read_file(&ss->file, ss->start, ss->end - ss->start,
+                               ss->file.offset);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == 0) {
+
+                /* the end of the snapshot between records is expected */
+
+                if (p == data) {
+                    return NGX_DONE;
+                }
+
+                ngx_log_error(NGX_LOG_WARN, ss->file.log, 0,
+                              "shared memory snapshot \"%V\" is truncated",
+                              &ss->file.name);
+
+                return NGX_ERROR;
+            }
+
+            ss->pos = ss->start;
+            ss->last = ss->start + rc;
+        }
+
+        n = ngx_min(size, (size_t) (ss->last - ss->pos));
+
+        p = ngx_cpymem(p, ss->pos, n);
+
+        ss->pos += n;
+        size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_shm_snapshot_save_zones(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                i;
+    ngx_str_t                 name, temp;
+    ngx_pool_t               *pool;
+    ngx_list_part_t          *part;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_shm_snapshot_t        ss;
+    ngx_shm_snapshot_conf_t  *sscf;
+
+    sscf = (ngx_shm_snapshot_conf_t *)
+               ngx_get_conf(cycle->conf_ctx, ngx_shm_snapshot_module);
+
+    if (sscf == NULL || sscf->path == NULL) {
+        return;
+    }
+
+    pool = NULL;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].save == NULL) {
+            continue;
+        }
+
+        if (pool == NULL) {
+            pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+            if (pool == NULL) {
+                return;
+            }
+
+            ngx_memzero(&ss, sizeof(ngx_shm_snapshot_t));
+
+            ss.start = ngx_palloc(pool, NGX_SHM_SNAPSHOT_BUFSIZE);
+            if (ss.start == NULL) {
+                goto done;
+            }
+
+            ss.end = ss.start + NGX_SHM_SNAPSHOT_BUFSIZE;
+        }
+
+        if (ngx_shm_snapshot_file_name(pool, sscf, &shm_zone[i], &name, &temp)
+            != NGX_OK)
+        {
+            goto done;
+        }
+
+        (void) ngx_shm_snapshot_save(&shm_zone[i], &name, &temp, &ss,
+                                     cycle->log);
+    }
+
+done:
+
+    if (pool) {
+        ngx_destroy_pool(pool);
+    }
+}
+
+
+static ngx_int_t
+ngx_shm_snapshot_save(ngx_shm_zone_t *zone, ngx_str_t *name, ngx_str_t *temp,
+    ngx_shm_snapshot_t *ss, ngx_log_t *log)
+{
+    ngx_int_t                  rc;
+    ngx_shm_snapshot_header_t  header;
+
+    ss->file.name = *temp;
+    ss->file.log = log;
+    ss->file.offset = 0;
+    ss->time = ngx_time();
+    ss->pos = ss->start;
+    ss->last = ss->start;
+
+    /*
+     * the master process saves snapshots on exit in the directory owned
+     * by worker processes, so the temporary file is always created anew
+     * and never opened through a link; snapshots may also contain session
+     * secrets and ticket keys, so they are accessible by the owner only
+     */
+
+    if (ngx_delete_file(temp->data) == NGX_FILE_ERROR
+        && ngx_errno != NGX_ENOENT)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp->data);
+        return NGX_ERROR;
+    }
+
+    ss->file.fd = ngx_open_tempfile(temp->data, 1, NGX_FILE_OWNER_ACCESS);
+
+    if (ss->file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_tempfile_n " \"%s\" failed", temp->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&header, sizeof(ngx_shm_snapshot_header_t));
+
+    ngx_memcpy(header.magic, ngx_shm_snapshot_magic, 8);
+    header.version = NGX_SHM_SNAPSHOT_VERSION;
+    header.ptr_size = NGX_PTR_SIZE;
+    header.time = ss->time;
+
+    rc = ngx_shm_snapshot_write(ss, &header, sizeof(ngx_shm_snapshot_header_t));
+
+    if (rc == NGX_OK) {
+        rc = zone->save(zone, ss);
+    }
+
+    if (rc == NGX_OK) {
+        rc = ngx_shm_snapshot_flush(ss);
+    }
+
+    if (ngx_close_file(ss->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp->data);
+        rc = NGX_ERROR;
+    }
+
+    if (rc == NGX_OK && ngx_rename_file(temp->data, name->data) == NGX_OK) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "shm snapshot \"%V\": %O bytes",
+                       &zone->shm.name, ss->file.offset);
+
+        return NGX_OK;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp->data, name->data);
+    }
+
+    if (ngx_delete_file(temp->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp->data);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_shm_snapshot_flush(ngx_shm_snapshot_t *ss)
+{
+    ssize_t  n;
+
+    if (ss->last == ss->start) {
+        return NGX_OK;
+    }
+
+    n = ngx_write_file(&ss->file, ss->start, ss->last - ss->start,
+                       ss->file.offset);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ss->last = ss->start;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_shm_snapshot_file_name(ngx_pool_t *pool, ngx_shm_snapshot_conf_t *sscf,
+    ngx_shm_zone_t *zone, ngx_str_t *name, ngx_str_t *temp)
+{
+    size_t  len;
+
+    /* "path/zone" and "path/zone.pid" */
+
+    len = sscf->path->name.len + 1 + zone->shm.name.len;
+
+    name->data = ngx_pnalloc(pool, len + 1);
+    if (name->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    name->len = ngx_sprintf(name->data, "%V/%V%Z", &sscf->path->name,
+                            &zone->shm.name)
+                - name->data - 1;
+
+    if (temp == NULL) {
+        return NGX_OK;
+    }
+
+    temp->data = ngx_pnalloc(pool, len + 1 + NGX_INT64_LEN + 1);
+    if (temp->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    temp->len = ngx_sprintf(temp->data, "%V.%P%Z", name, ngx_pid)
+                - temp->data - 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_shm_snapshot_handler(ngx_event_t *ev)
+{
+    ngx_shm_snapshot_conf_t  *sscf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_shm_snapshot_save_zones((ngx_cycle_t *) ngx_cycle);
+
+    sscf = (ngx_shm_snapshot_conf_t *)
+               ngx_get_conf(ngx_cycle->conf_ctx, ngx_shm_snapshot_module);
+
+    ngx_add_timer(ev, sscf->interval);
+}
+
+
+static void *
+ngx_shm_snapshot_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_shm_snapshot_conf_t  *sscf;
+
+    sscf = ngx_pcalloc(cycle->pool, sizeof(ngx_shm_snapshot_conf_t));
+    if (sscf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     sscf->path = NULL;
+     */
+
+    sscf->interval = NGX_CONF_UNSET_MSEC;
+
+    return sscf;
+}
+
+
+static char *
+ngx_shm_snapshot_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_shm_snapshot_conf_t *sscf = conf;
+
+    ngx_conf_init_msec_value(sscf->interval, 300000);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_shm_snapshot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_shm_snapshot_conf_t *sscf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+    ngx_path_t  *path;
+
+    if (sscf->path) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    path->name = value[1];
+
+    if (path->name.data[path->name.len - 1] == '/') {
+        path->name.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    path->conf_file = cf->conf_file->file.name.data;
+    path->line = cf->conf_file->line;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            sscf->interval = ngx_parse_time(&s, 0);
+            if (sscf->interval == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    sscf->path = path;
+
+    /*
+     * the directory is created and made writable by worker processes,
+     * so the master process neither follows links in it nor truncates
+     * existing files there
+     */
+
+    if (ngx_add_path(cf, &sscf->path) == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_shm_snapshot_init_process(ngx_cycle_t *cycle)
+{
+    ngx_shm_snapshot_conf_t  *sscf;
+
+    /* periodic snapshots are saved by the first worker process only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    sscf = (ngx_shm_snapshot_conf_t *)
+               ngx_get_conf(cycle->conf_ctx, ngx_shm_snapshot_module);
+
+    if (sscf->path == NULL || sscf->interval == 0) {
+        return NGX_OK;
+    }
+
+    ngx_shm_snapshot_event.handler = ngx_shm_snapshot_handler;
+    ngx_shm_snapshot_event.data = sscf;
+    ngx_shm_snapshot_event.log = cycle->log;
+    ngx_shm_snapshot_event.cancelable = 1;
+
+    ngx_add_timer(&ngx_shm_snapshot_event, sscf->interval);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_shm_snapshot_exit_master(ngx_cycle_t *cycle)
+{
+    /* worker processes are gone, so the zones are saved consistently */
+
+    ngx_shm_snapshot_save_zones(cycle);
+}
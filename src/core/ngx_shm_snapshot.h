@@ -0,0 +1,45 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_SHM_SNAPSHOT_H_INCLUDED_
+#define _NGX_SHM_SNAPSHOT_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * save handlers copy records in batches of about this size, and write
+ * them with the zone unlocked
+ */
+
+#define NGX_SHM_SNAPSHOT_BATCH    65536
+
+
+struct ngx_shm_snapshot_s {
+    ngx_file_t                file;
+    time_t                    time;
+
+    u_char                   *start;
+    u_char                   *pos;
+    u_char                   *last;
+    u_char                   *end;
+};
+
+
+ngx_int_t ngx_shm_snapshot_restore(ngx_cycle_t *cycle, ngx_shm_zone_t *zone);
+ngx_int_t ngx_shm_snapshot_write(ngx_shm_snapshot_t *ss, void *data,
+    size_t size);
+ngx_int_t ngx_shm_snapshot_read(ngx_shm_snapshot_t *ss, void *data,
+    size_t size);
+
+
+extern ngx_module_t  ngx_shm_snapshot_module;
+
+
+#endif /* _NGX_SHM_SNAPSHOT_H_INCLUDED_ */
@@ -14,9 +14,20 @@
     + (NGX_MAXHOSTNAMELEN - 1) + 1 /* space */                                \
     + 32 /* tag */ + 2 /* colon, space */
 
+#define NGX_SYSLOG_BUFFER_SIZE  65536
+#define NGX_SYSLOG_FLUSH        1000
+#define NGX_SYSLOG_MAX_BATCH    64
+
 
 static char *ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer);
 static ngx_int_t ngx_syslog_init_peer(ngx_syslog_peer_t *peer);
+static ssize_t ngx_syslog_queue(ngx_syslog_peer_t *peer, u_char *buf,
+    size_t len);
+static void ngx_syslog_flush(ngx_syslog_peer_t *peer);
+static void ngx_syslog_flush_stream(ngx_syslog_peer_t *peer);
+static void ngx_syslog_flush_dgram(ngx_syslog_peer_t *peer);
+static void ngx_syslog_flush_handler(ngx_event_t *ev);
+static void ngx_syslog_close_peer(ngx_syslog_peer_t *peer);
 static void ngx_syslog_cleanup(void *data);
 
 
@@ -39,9 +50,12 @@ static ngx_event_t  ngx_syslog_dummy_event;
 char *
 ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
 {
+    ngx_pool_cleanup_t  *cln;
+
     peer->pool = cf->pool;
     peer->facility = NGX_CONF_UNSET_UINT;
     peer->severity = NGX_CONF_UNSET_UINT;
+    peer->flush = NGX_CONF_UNSET_MSEC;
 
     if (ngx_syslog_parse_args(cf, peer) != NGX_CONF_OK) {
         return NGX_CONF_ERROR;
@@ -65,6 +79,61 @@ ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
         ngx_str_set(&peer->tag, "nginx");
     }
 
+    if (peer->buffer_size) {
+        if (peer->flush == NGX_CONF_UNSET_MSEC) {
+            peer->flush = NGX_SYSLOG_FLUSH;
+        }
+
+    } else if (peer->flush != NGX_CONF_UNSET_MSEC) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "syslog \"flush\" requires \"buffer\"");
+        return NGX_CONF_ERROR;
+
+    } else if (peer->stream) {
+
+        /* stream transports always buffer to cope with partial writes */
+
+        peer->buffer_size = NGX_SYSLOG_BUFFER_SIZE;
+        peer->flush = 0;
+    }
+
+    if (peer->buffer_size) {
+        peer->buffer = ngx_create_temp_buf(cf->pool, peer->buffer_size);
+        if (peer->buffer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (!peer->stream) {
+            peer->sizes = ngx_palloc(cf->pool,
+                                     NGX_SYSLOG_MAX_BATCH * sizeof(size_t));
+            if (peer->sizes == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        peer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+        if (peer->event == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->event->handler = ngx_syslog_flush_handler;
+        peer->event->data = peer;
+        peer->event->log = &ngx_syslog_dummy_log;
+        peer->event->cancelable = 1;
+
+        /* buffered messages are flushed and the timer removed on cleanup */
+
+        cln = ngx_pool_cleanup_add(cf->pool, 0);
+        if (cln == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cln->data = peer;
+        cln->handler = ngx_syslog_cleanup;
+
+        peer->cleanup = 1;
+    }
+
     peer->conn.fd = (ngx_socket_t) -1;
 
     return NGX_CONF_OK;
@@ -76,7 +145,9 @@ ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
 {
     u_char      *p, *comma, c;
     size_t       len;
-    ngx_str_t   *value;
+    ssize_t      size;
+    ngx_int_t    flush;
+    ngx_str_t   *value, s;
     ngx_url_t    u;
     ngx_uint_t   i;
 
@@ -197,6 +268,39 @@ ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
         } else if (len == 10 && ngx_strncmp(p, "nohostname", 10) == 0) {
             peer->nohostname = 1;
 
+        } else if (len == 6 && ngx_strncmp(p, "stream", 6) == 0) {
+            peer->stream = 1;
+
+        } else if (ngx_strncmp(p, "buffer=", 7) == 0) {
+
+            s.len = len - 7;
+            s.data = p + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid syslog buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            peer->buffer_size = size;
+
+        } else if (ngx_strncmp(p, "flush=", 6) == 0) {
+
+            s.len = len - 6;
+            s.data = p + 6;
+
+            flush = ngx_parse_time(&s, 0);
+
+            if (flush == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid syslog flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            peer->flush = (ngx_msec_t) flush;
+
         } else {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                "unknown syslog parameter \"%s\"", p);
@@ -272,6 +376,10 @@ ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
 {
     ssize_t  n;
 
+    if (peer->buffer) {
+        return ngx_syslog_queue(peer, buf, len);
+    }
+
     if (peer->conn.fd == (ngx_socket_t) -1) {
         if (ngx_syslog_init_peer(peer) != NGX_OK) {
             return NGX_ERROR;
@@ -292,18 +400,301 @@ ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
 #if (NGX_HAVE_UNIX_DOMAIN)
 
     if (n == NGX_ERROR && peer->server.sockaddr->sa_family == AF_UNIX) {
+        ngx_syslog_close_peer(peer);
+    }
 
-        if (ngx_close_socket(peer->conn.fd) == -1) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
-                          ngx_close_socket_n " failed");
+#endif
+
+    return n;
+}
+
+
+static ssize_t
+ngx_syslog_queue(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
+{
+    size_t      size;
+    ngx_buf_t  *b;
+
+    b = peer->buffer;
+
+    size = peer->stream ? NGX_SIZE_T_LEN + 1 + len : len;
+
+    if (size > (size_t) (b->end - b->last)
+        || (!peer->stream && peer->nmsgs == NGX_SYSLOG_MAX_BATCH))
+    {
+        ngx_syslog_flush(peer);
+
+        if (b->pos != b->start) {
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+        }
+
+        if (size > (size_t) (b->end - b->last)
+            || (!peer->stream && peer->nmsgs == NGX_SYSLOG_MAX_BATCH))
+        {
+            /*
+             * the collector does not keep up or is unreachable,
+             * the message is accounted and reported on the next flush
+             */
+
+            peer->dropped++;
+            return len;
+        }
+    }
+
+    if (peer->stream) {
+        /* RFC 6587, octet counting */
+        b->last = ngx_sprintf(b->last, "%uz ", len);
+
+    } else {
+        peer->sizes[peer->nmsgs] = len;
+    }
+
+    b->last = ngx_cpymem(b->last, buf, len);
+    peer->nmsgs++;
+
+    /*
+     * timers are not available in the master process and
+     * before the event module is initialized in workers
+     */
+
+    if (peer->flush == 0 || ngx_event_timer_rbtree.root == NULL) {
+        ngx_syslog_flush(peer);
+
+    } else if (!peer->event->timer_set) {
+        ngx_add_timer(peer->event, peer->flush);
+    }
+
+    return len;
+}
+
+
+static void
+ngx_syslog_flush(ngx_syslog_peer_t *peer)
+{
+    unsigned     busy;
+    ngx_buf_t   *b;
+    ngx_uint_t   dropped;
+
+    b = peer->buffer;
+
+    /* prevents error_log recursion into this peer */
+
+    busy = peer->busy;
+    peer->busy = 1;
+
+    if (peer->conn.fd == (ngx_socket_t) -1
+        && b->pos != b->last
+        && ngx_time() >= peer->next_try)
+    {
+        if (ngx_syslog_init_peer(peer) != NGX_OK) {
+            peer->next_try = ngx_time() + 1;
+        }
+    }
+
+    if (peer->conn.fd != (ngx_socket_t) -1 && b->pos != b->last) {
+
+        if (peer->stream) {
+            ngx_syslog_flush_stream(peer);
+
+        } else {
+            ngx_syslog_flush_dgram(peer);
+        }
+    }
+
+    /* drops are aggregated and reported at most once per second */
+
+    if (peer->dropped && ngx_time() != peer->dropped_time) {
+        dropped = peer->dropped;
+        peer->dropped = 0;
+        peer->dropped_time = ngx_time();
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "%ui messages to syslog server \"%V\" dropped",
+                      dropped, &peer->server.name);
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+
+        if (peer->event->timer_set) {
+            ngx_del_timer(peer->event);
+        }
+
+    } else if (!peer->event->timer_set
+               && ngx_event_timer_rbtree.root != NULL)
+    {
+        /* retry later */
+        ngx_add_timer(peer->event, peer->flush ? peer->flush : 1000);
+    }
+
+    peer->busy = busy;
+}
+
+
+static void
+ngx_syslog_flush_stream(ngx_syslog_peer_t *peer)
+{
+    ssize_t     n;
+    ngx_err_t   err;
+    ngx_buf_t  *b;
+
+    b = peer->buffer;
+
+    while (b->pos < b->last) {
+
+        n = send(peer->conn.fd, b->pos, b->last - b->pos, 0);
+
+        if (n > 0) {
+            b->pos += n;
+            continue;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            return;
         }
 
-        peer->conn.fd = (ngx_socket_t) -1;
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                      "send() to syslog server \"%V\" failed",
+                      &peer->server.name);
+
+        /*
+         * the rest of a partially sent message cannot be
+         * framed on a new connection, so the buffer is discarded
+         */
+
+        peer->dropped += peer->nmsgs;
+        b->pos = b->last;
+
+        ngx_syslog_close_peer(peer);
+        peer->next_try = ngx_time() + 1;
+
+        break;
     }
 
+    peer->nmsgs = 0;
+}
+
+
+static void
+ngx_syslog_flush_dgram(ngx_syslog_peer_t *peer)
+{
+    u_char      *p;
+    ngx_err_t    err;
+    ngx_buf_t   *b;
+    ngx_uint_t   i, sent;
+#if (NGX_HAVE_SENDMMSG)
+    int              n;
+    struct iovec     iov[NGX_SYSLOG_MAX_BATCH];
+    struct mmsghdr   msgs[NGX_SYSLOG_MAX_BATCH];
+#else
+    ssize_t          n;
 #endif
 
-    return n;
+    b = peer->buffer;
+    p = b->pos;
+    err = 0;
+
+#if (NGX_HAVE_SENDMMSG)
+
+    ngx_memzero(msgs, peer->nmsgs * sizeof(struct mmsghdr));
+
+    for (i = 0; i < peer->nmsgs; i++) {
+        iov[i].iov_base = p;
+        iov[i].iov_len = peer->sizes[i];
+        p += peer->sizes[i];
+
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sent = 0;
+
+    while (sent < peer->nmsgs) {
+
+        n = sendmmsg(peer->conn.fd, &msgs[sent], peer->nmsgs - sent, 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        sent += n;
+    }
+
+#else
+
+    for (sent = 0, i = 0; i < peer->nmsgs; i++) {
+
+        n = send(peer->conn.fd, p, peer->sizes[i], 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                i--;
+                continue;
+            }
+
+            break;
+        }
+
+        p += peer->sizes[i];
+        sent++;
+    }
+
+#endif
+
+    if (sent < peer->nmsgs) {
+        peer->dropped += peer->nmsgs - sent;
+
+        if (err != NGX_EAGAIN) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                          "send() to syslog server \"%V\" failed",
+                          &peer->server.name);
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+            if (peer->server.sockaddr->sa_family == AF_UNIX) {
+                ngx_syslog_close_peer(peer);
+            }
+#endif
+        }
+    }
+
+    /* datagrams are not retried */
+
+    b->pos = b->last;
+    peer->nmsgs = 0;
+}
+
+
+static void
+ngx_syslog_flush_handler(ngx_event_t *ev)
+{
+    ngx_syslog_peer_t  *peer;
+
+    peer = ev->data;
+
+    if (!ev->timedout) {
+        /* cancel the flush timer for graceful shutdown */
+        return;
+    }
+
+    ev->timedout = 0;
+
+    ngx_syslog_flush(peer);
 }
 
 
@@ -318,7 +709,8 @@ ngx_syslog_init_peer(ngx_syslog_peer_t *peer)
 
     ngx_syslog_dummy_event.log = &ngx_syslog_dummy_log;
 
-    fd = ngx_socket(peer->server.sockaddr->sa_family, SOCK_DGRAM, 0);
+    fd = ngx_socket(peer->server.sockaddr->sa_family,
+                    peer->stream ? SOCK_STREAM : SOCK_DGRAM, 0);
     if (fd == (ngx_socket_t) -1) {
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
                       ngx_socket_n " failed");
@@ -332,18 +724,25 @@ ngx_syslog_init_peer(ngx_syslog_peer_t *peer)
     }
 
     if (connect(fd, peer->server.sockaddr, peer->server.socklen) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
-                      "connect() failed");
-        goto failed;
-    }
 
-    cln = ngx_pool_cleanup_add(peer->pool, 0);
-    if (cln == NULL) {
-        goto failed;
+        /* the data are buffered until a stream connection is established */
+
+        if (!peer->stream || ngx_socket_errno != NGX_EINPROGRESS) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                          "connect() failed");
+            goto failed;
+        }
     }
 
-    cln->data = peer;
-    cln->handler = ngx_syslog_cleanup;
+    if (!peer->cleanup) {
+        cln = ngx_pool_cleanup_add(peer->pool, 0);
+        if (cln == NULL) {
+            goto failed;
+        }
+
+        cln->data = peer;
+        cln->handler = ngx_syslog_cleanup;
+    }
 
     peer->conn.fd = fd;
 
@@ -363,11 +762,31 @@ failed:
 }
 
 
+static void
+ngx_syslog_close_peer(ngx_syslog_peer_t *peer)
+{
+    if (ngx_close_socket(peer->conn.fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    peer->conn.fd = (ngx_socket_t) -1;
+}
+
+
 static void
 ngx_syslog_cleanup(void *data)
 {
     ngx_syslog_peer_t  *peer = data;
 
+    if (peer->buffer && !peer->busy) {
+        ngx_syslog_flush(peer);
+
+        if (peer->event->timer_set) {
+            ngx_del_timer(peer->event);
+        }
+    }
+
     /* prevents further use of this peer */
     peer->busy = 1;
 
@@ -375,8 +794,5 @@ ngx_syslog_cleanup(void *data)
         return;
     }
 
-    if (ngx_close_socket(peer->conn.fd) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
-                      ngx_close_socket_n " failed");
-    }
+    ngx_syslog_close_peer(peer);
 }
@@ -16,8 +16,21 @@ typedef struct {
 
     ngx_addr_t        server;
     ngx_connection_t  conn;
+
+    size_t            buffer_size;
+    ngx_buf_t        *buffer;
+    size_t           *sizes;
+    ngx_uint_t        nmsgs;
+    ngx_uint_t        dropped;
+    time_t            dropped_time;
+    ngx_msec_t        flush;
+    time_t            next_try;
+    ngx_event_t      *event;
+
     unsigned          busy:1;
     unsigned          nohostname:1;
+    unsigned          stream:1;
+    unsigned          cleanup:1;
 } ngx_syslog_peer_t;
 
 
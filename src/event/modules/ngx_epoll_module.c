@@ -894,7 +894,7 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 
             if (flags & NGX_POST_EVENTS) {
                 queue = rev->accept ? &ngx_posted_accept_events
-                                    : &ngx_posted_events;
+                                    : &ngx_posted_read_events;
 
                 ngx_post_event(rev, queue);
 
@@ -925,7 +925,7 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 #endif
 
             if (flags & NGX_POST_EVENTS) {
-                ngx_post_event(wev, &ngx_posted_events);
+                ngx_post_event(wev, &ngx_posted_write_events);
 
             } else {
                 wev->handler(wev);
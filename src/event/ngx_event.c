@@ -23,6 +23,9 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_event_reuseport_cpu(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#endif
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -36,6 +39,8 @@ static char *ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf);
 
 
 static ngx_uint_t     ngx_timer_resolution;
+static ngx_uint_t     ngx_posted_events_budget;
+static ngx_msec_t     ngx_loop_lag_threshold;
 sig_atomic_t          ngx_event_timer_alarm;
 
 static ngx_uint_t     ngx_event_max_module;
@@ -73,6 +78,8 @@ ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
 ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t  *ngx_stat_waiting = &ngx_stat_waiting0;
+ngx_atomic_t   ngx_stat_pipe_memory0;
+ngx_atomic_t  *ngx_stat_pipe_memory = &ngx_stat_pipe_memory0;
 
 #endif
 
@@ -154,6 +161,45 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+    { ngx_string("accept_budget"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_event_conf_t, accept_budget),
+      NULL },
+
+    { ngx_string("posted_events_budget"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_event_conf_t, posted_events_budget),
+      NULL },
+
+    { ngx_string("loop_lag_threshold"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(ngx_event_conf_t, loop_lag_threshold),
+      NULL },
+
+    { ngx_string("pipe_memory_limit"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_event_conf_t, pipe_memory_limit),
+      NULL },
+
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+    { ngx_string("reuseport_cpu"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, reuseport_cpu),
+      NULL },
+
+#endif
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -193,8 +239,8 @@ ngx_module_t  ngx_event_core_module = {
 void
 ngx_process_events_and_timers(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  flags;
-    ngx_msec_t  timer, delta;
+    ngx_uint_t  flags, budget, reserved, n;
+    ngx_msec_t  timer, delta, lag;
 
     if (ngx_timer_resolution) {
         timer = NGX_TIMER_INFINITE;
@@ -237,12 +283,38 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
         }
     }
 
+    if (ngx_posted_events_budget) {
+
+        /*
+         * all events are posted to be handled within the budget,
+         * the events left from the previous iteration are handled
+         * after polling without waiting for new ones
+         */
+
+        flags |= NGX_POST_EVENTS;
+
+        if (!ngx_queue_empty(&ngx_posted_write_events)
+            || !ngx_queue_empty(&ngx_posted_read_events)
+            || !ngx_queue_empty(&ngx_posted_events))
+        {
+            timer = 0;
+        }
+    }
+
     delta = ngx_current_msec;
 
     (void) ngx_process_events(cycle, timer, flags);
 
     delta = ngx_current_msec - delta;
 
+    /* with "timer_resolution" the time is not updated after polling */
+
+    if (ngx_loop_lag_threshold && ngx_timer_resolution) {
+        ngx_time_update();
+    }
+
+    lag = ngx_current_msec;
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "timer delta: %M", delta);
 
@@ -256,7 +328,49 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
         ngx_event_expire_timers();
     }
 
-    ngx_event_process_posted(cycle, &ngx_posted_events);
+    /* completing writes goes before reading new data and deferred work */
+
+    if (ngx_posted_events_budget == 0) {
+        ngx_event_process_posted(cycle, &ngx_posted_write_events);
+        ngx_event_process_posted(cycle, &ngx_posted_read_events);
+        ngx_event_process_posted(cycle, &ngx_posted_events);
+
+    } else {
+
+        /*
+         * a quarter of the budget is reserved for deferred work, such as
+         * thread completions, so it is not starved by connections I/O
+         */
+
+        reserved = ngx_max(ngx_posted_events_budget / 4, 1);
+
+        budget = (ngx_posted_events_budget > reserved)
+                 ? ngx_posted_events_budget - reserved : 1;
+
+        n = ngx_event_process_posted_budget(cycle, &ngx_posted_write_events,
+                                            budget);
+        n += ngx_event_process_posted_budget(cycle, &ngx_posted_read_events,
+                                             budget - n);
+
+        budget += reserved;
+
+        n += ngx_event_process_posted_budget(cycle, &ngx_posted_events,
+                                             budget - n);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "posted events handled: %ui", n);
+    }
+
+    if (ngx_loop_lag_threshold) {
+        ngx_time_update();
+
+        lag = ngx_current_msec - lag;
+
+        if (lag >= ngx_loop_lag_threshold) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "event loop iteration took %Mms", lag);
+        }
+    }
 }
 
 
@@ -495,7 +609,8 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl;         /* ngx_stat_pipe_memory */
 
 #endif
 
@@ -543,6 +658,7 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_pipe_memory = (ngx_atomic_t *) (shared + 10 * cl);
 
 #endif
 
@@ -600,8 +716,13 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 #endif
 
     ngx_queue_init(&ngx_posted_accept_events);
+    ngx_queue_init(&ngx_posted_write_events);
+    ngx_queue_init(&ngx_posted_read_events);
     ngx_queue_init(&ngx_posted_events);
 
+    ngx_posted_events_budget = ecf->posted_events_budget;
+    ngx_loop_lag_threshold = ecf->loop_lag_threshold;
+
     if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
         return NGX_ERROR;
     }
@@ -740,6 +861,16 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+        if (ls[i].reuseport
+            && ecf->reuseport_cpu
+            && ngx_process == NGX_PROCESS_WORKER
+            && ngx_worker == 0)
+        {
+            ngx_event_reuseport_cpu(cycle, &ls[i]);
+        }
+#endif
+
         c = ngx_get_connection(ls[i].fd, cycle->log);
 
         if (c == NULL) {
@@ -819,8 +950,15 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
 #else
 
-        rev->handler = (c->type == SOCK_STREAM) ? ngx_event_accept
-                                                : ngx_event_recvmsg;
+        if (c->type == SOCK_STREAM) {
+            rev->handler = ngx_event_accept;
+
+        } else {
+            rev->handler = ngx_event_recvmsg;
+
+            ngx_rbtree_init(&ls[i].rbtree, &ls[i].sentinel,
+                            ngx_udp_rbtree_insert_value);
+        }
 
 #if (NGX_HAVE_REUSEPORT)
 
@@ -901,6 +1039,99 @@ ngx_send_lowat(ngx_connection_t *c, size_t lowat)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+ * The program selects a socket of the reuseport group by the CPU which
+ * handled the packet, so that connections are accepted by the worker
+ * bound to this CPU with worker_cpu_affinity.  Sockets of a group are
+ * indexed in the order they were bound, that is, by worker numbers.
+ * CPUs not assigned to any worker return an index out of the group
+ * range, and the kernel falls back to hashing.
+ */
+
+static void
+ngx_event_reuseport_cpu(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_int_t            worker[CPU_SETSIZE];
+    ngx_uint_t           n, cpu;
+    ngx_cpuset_t        *mask;
+    ngx_core_conf_t     *ccf;
+    struct sock_filter  *code, *p;
+    struct sock_fprog    prog;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ccf->cpu_affinity == NULL) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"reuseport_cpu\" requires \"worker_cpu_affinity\", "
+                      "ignored for %V", &ls->addr_text);
+        return;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        worker[cpu] = -1;
+    }
+
+    for (n = 0; n < (ngx_uint_t) ccf->worker_processes; n++) {
+        mask = ngx_get_cpu_affinity(n);
+
+        if (mask == NULL) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (worker[cpu] == -1 && CPU_ISSET(cpu, mask)) {
+                worker[cpu] = n;
+            }
+        }
+    }
+
+    code = ngx_alloc((2 * CPU_SETSIZE + 2) * sizeof(struct sock_filter),
+                     cycle->log);
+    if (code == NULL) {
+        return;
+    }
+
+    p = code;
+
+    *p++ = (struct sock_filter)
+           BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (worker[cpu] == -1) {
+            continue;
+        }
+
+        *p++ = (struct sock_filter) BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, cpu, 0, 1);
+        *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, worker[cpu]);
+    }
+
+    *p++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+    prog.len = p - code;
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) for %V failed, "
+                      "ignored", &ls->addr_text);
+
+    } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "reuseport cpu program for %V: %ui instructions",
+                       &ls->addr_text, (ngx_uint_t) prog.len);
+    }
+
+    ngx_free(code);
+}
+
+#endif
+
+
 static char *
 ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1187,8 +1418,16 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->multi_accept = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->accept_budget = NGX_CONF_UNSET_UINT;
+    ecf->posted_events_budget = NGX_CONF_UNSET_UINT;
+    ecf->loop_lag_threshold = NGX_CONF_UNSET_MSEC;
+    ecf->pipe_memory_limit = NGX_CONF_UNSET_SIZE;
     ecf->name = (void *) NGX_CONF_UNSET;
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    ecf->reuseport_cpu = NGX_CONF_UNSET;
+#endif
+
 #if (NGX_DEBUG)
 
     if (ngx_array_init(&ecf->debug_connection, cycle->pool, 4,
@@ -1286,6 +1525,14 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->multi_accept, 0);
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_uint_value(ecf->accept_budget, 0);
+    ngx_conf_init_uint_value(ecf->posted_events_budget, 0);
+    ngx_conf_init_msec_value(ecf->loop_lag_threshold, 0);
+    ngx_conf_init_size_value(ecf->pipe_memory_limit, 0);
+
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    ngx_conf_init_value(ecf->reuseport_cpu, 0);
+#endif
 
     return NGX_CONF_OK;
 }
@@ -446,8 +446,18 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_uint_t    accept_budget;
+    ngx_uint_t    posted_events_budget;
+    ngx_msec_t    loop_lag_threshold;
+
+    size_t        pipe_memory_limit;
+
     u_char       *name;
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    ngx_flag_t    reuseport_cpu;
+#endif
+
 #if (NGX_DEBUG)
     ngx_array_t   debug_connection;
 #endif
@@ -484,6 +494,7 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_pipe_memory;
 
 #endif
 
@@ -532,6 +543,7 @@ ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
 
 #include <ngx_event_timer.h>
 #include <ngx_event_posted.h>
+#include <ngx_event_udp.h>
 
 #if (NGX_WIN32)
 #include <ngx_iocp_module.h>
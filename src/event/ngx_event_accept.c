@@ -10,6 +10,42 @@
 #include <ngx_event.h>
 
 
+#if !(NGX_WIN32)
+
+#if (NGX_HAVE_RECVMMSG)
+#define NGX_EVENT_RECVMMSG_BATCH  32
+#else
+#define NGX_EVENT_RECVMMSG_BATCH  1
+#endif
+
+
+typedef struct {
+    struct iovec       iov;
+    ngx_sockaddr_t     sockaddr;
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+#if (NGX_HAVE_IP_RECVDSTADDR)
+    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))];
+#elif (NGX_HAVE_IP_PKTINFO)
+    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#endif
+
+#endif
+
+    u_char             buffer[65535];
+} ngx_event_recvmsg_buf_t;
+
+
+static void ngx_event_recvmsg_init(ngx_listening_t *ls, struct msghdr *msg,
+    ngx_event_recvmsg_buf_t *buf);
+
+#endif
+
 static ngx_int_t ngx_enable_accept_events(ngx_cycle_t *cycle);
 static ngx_int_t ngx_disable_accept_events(ngx_cycle_t *cycle, ngx_uint_t all);
 static void ngx_close_accepted_connection(ngx_connection_t *c);
@@ -25,7 +61,7 @@ ngx_event_accept(ngx_event_t *ev)
     socklen_t          socklen;
     ngx_err_t          err;
     ngx_log_t         *log;
-    ngx_uint_t         level;
+    ngx_uint_t         level, accepted;
     ngx_socket_t       s;
     ngx_event_t       *rev, *wev;
     ngx_sockaddr_t     sa;
@@ -57,6 +93,8 @@ ngx_event_accept(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "accept on %V, ready: %d", &ls->addr_text, ev->available);
 
+    accepted = 0;
+
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
@@ -312,6 +350,18 @@ ngx_event_accept(ngx_event_t *ev)
             ev->available--;
         }
 
+        if (++accepted == ecf->accept_budget) {
+
+            /*
+             * leave the rest of the connections for the next iterations,
+             * the listening socket will be reported again
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "accept budget of %ui exhausted", accepted);
+            return;
+        }
+
     } while (ev->available);
 }
 
@@ -321,30 +371,27 @@ ngx_event_accept(ngx_event_t *ev)
 void
 ngx_event_recvmsg(ngx_event_t *ev)
 {
-    ssize_t            n;
-    ngx_log_t         *log;
-    ngx_err_t          err;
-    ngx_event_t       *rev, *wev;
-    struct iovec       iov[1];
-    struct msghdr      msg;
-    ngx_sockaddr_t     sa;
-    ngx_listening_t   *ls;
-    ngx_event_conf_t  *ecf;
-    ngx_connection_t  *c, *lc;
-    static u_char      buffer[65535];
-
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
-
-#if (NGX_HAVE_IP_RECVDSTADDR)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))];
-#elif (NGX_HAVE_IP_PKTINFO)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-#endif
-
+    ssize_t                         n;
+    u_char                         *buffer;
+    ngx_buf_t                       b;
+    ngx_log_t                      *log;
+    ngx_err_t                       err;
+    socklen_t                       local_socklen;
+    ngx_uint_t                      accepted;
+    ngx_event_t                    *rev, *wev;
+    struct msghdr                  *msg;
+    ngx_sockaddr_t                  lsa;
+    struct sockaddr                *local_sockaddr;
+    ngx_listening_t                *ls;
+    ngx_event_conf_t               *ecf;
+    ngx_connection_t               *c, *lc;
+    static ngx_event_recvmsg_buf_t  bufs[NGX_EVENT_RECVMMSG_BATCH];
+
+#if (NGX_HAVE_RECVMMSG)
+    ngx_uint_t                      i, next, nmsgs, vlen;
+    struct mmsghdr                  msgs[NGX_EVENT_RECVMMSG_BATCH];
+#else
+    struct msghdr                   msghdr;
 #endif
 
     if (ev->timedout) {
@@ -368,39 +415,69 @@ ngx_event_recvmsg(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
 
+    accepted = 0;
+
+#if (NGX_HAVE_RECVMMSG)
+    next = 0;
+    nmsgs = 0;
+#endif
+
     do {
-        ngx_memzero(&msg, sizeof(struct msghdr));
 
-        iov[0].iov_base = (void *) buffer;
-        iov[0].iov_len = sizeof(buffer);
+#if (NGX_HAVE_RECVMMSG)
 
-        msg.msg_name = &sa;
-        msg.msg_namelen = sizeof(ngx_sockaddr_t);
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 1;
+        if (next == nmsgs) {
 
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+            /* the batch never exceeds the rest of the accept budget */
 
-        if (ls->wildcard) {
+            vlen = NGX_EVENT_RECVMMSG_BATCH;
 
-#if (NGX_HAVE_IP_RECVDSTADDR || NGX_HAVE_IP_PKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET) {
-                msg.msg_control = &msg_control;
-                msg.msg_controllen = sizeof(msg_control);
+            if (ecf->accept_budget && ecf->accept_budget - accepted < vlen) {
+                vlen = ecf->accept_budget - accepted;
             }
-#endif
 
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET6) {
-                msg.msg_control = &msg_control6;
-                msg.msg_controllen = sizeof(msg_control6);
+            for (i = 0; i < vlen; i++) {
+                ngx_event_recvmsg_init(ls, &msgs[i].msg_hdr, &bufs[i]);
             }
-#endif
+
+            n = recvmmsg(lc->fd, msgs, vlen, 0, NULL);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EAGAIN) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                                   "recvmmsg() not ready");
+                    return;
+                }
+
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "recvmmsg() failed");
+
+                return;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "recvmmsg: %z of %ui", n, vlen);
+
+            nmsgs = n;
+            next = 0;
         }
 
-#endif
+        msg = &msgs[next].msg_hdr;
+        n = msgs[next].msg_len;
+        buffer = bufs[next].buffer;
+
+        next++;
+
+#else
+
+        msg = &msghdr;
+        buffer = bufs[0].buffer;
+
+        ngx_event_recvmsg_init(ls, msg, &bufs[0]);
 
-        n = recvmsg(lc->fd, &msg, 0);
+        n = recvmsg(lc->fd, msg, 0);
 
         if (n == -1) {
             err = ngx_socket_errno;
@@ -416,65 +493,18 @@ ngx_event_recvmsg(ngx_event_t *ev)
             return;
         }
 
-#if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
 #endif
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
-        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
             ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
                           "recvmsg() truncated data");
             continue;
         }
 #endif
 
-        ngx_accept_disabled = ngx_cycle->connection_n / 8
-                              - ngx_cycle->free_connection_n;
-
-        c = ngx_get_connection(lc->fd, ev->log);
-        if (c == NULL) {
-            return;
-        }
-
-        c->shared = 1;
-        c->type = SOCK_DGRAM;
-        c->socklen = msg.msg_namelen;
-
-#if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
-#endif
-
-        c->pool = ngx_create_pool(ls->pool_size, ev->log);
-        if (c->pool == NULL) {
-            ngx_close_accepted_connection(c);
-            return;
-        }
-
-        c->sockaddr = ngx_palloc(c->pool, c->socklen);
-        if (c->sockaddr == NULL) {
-            ngx_close_accepted_connection(c);
-            return;
-        }
-
-        ngx_memcpy(c->sockaddr, msg.msg_name, c->socklen);
-
-        log = ngx_palloc(c->pool, sizeof(ngx_log_t));
-        if (log == NULL) {
-            ngx_close_accepted_connection(c);
-            return;
-        }
-
-        *log = ls->log;
-
-        c->send = ngx_udp_send;
-        c->send_chain = ngx_udp_send_chain;
-
-        c->log = log;
-        c->pool->log = log;
-
-        c->listening = ls;
-        c->local_sockaddr = ls->sockaddr;
-        c->local_socklen = ls->socklen;
+        local_sockaddr = ls->sockaddr;
+        local_socklen = ls->socklen;
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
@@ -482,18 +512,14 @@ ngx_event_recvmsg(ngx_event_t *ev)
             struct cmsghdr   *cmsg;
             struct sockaddr  *sockaddr;
 
-            sockaddr = ngx_palloc(c->pool, c->local_socklen);
-            if (sockaddr == NULL) {
-                ngx_close_accepted_connection(c);
-                return;
-            }
+            ngx_memcpy(&lsa, ls->sockaddr, ls->socklen);
 
-            ngx_memcpy(sockaddr, c->local_sockaddr, c->local_socklen);
-            c->local_sockaddr = sockaddr;
+            sockaddr = &lsa.sockaddr;
+            local_sockaddr = sockaddr;
 
-            for (cmsg = CMSG_FIRSTHDR(&msg);
+            for (cmsg = CMSG_FIRSTHDR(msg);
                  cmsg != NULL;
-                 cmsg = CMSG_NXTHDR(&msg, cmsg))
+                 cmsg = CMSG_NXTHDR(msg, cmsg))
             {
 
 #if (NGX_HAVE_IP_RECVDSTADDR)
@@ -553,6 +579,102 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
 #endif
 
+        c = ngx_lookup_udp_connection(ls, msg->msg_name, msg->msg_namelen,
+                                      local_sockaddr, local_socklen);
+
+        if (c) {
+
+            /* the datagram belongs to an existing flow */
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "*%uA recvmsg: existing flow n:%z", c->number, n);
+
+            ngx_memzero(&b, sizeof(ngx_buf_t));
+
+            b.pos = buffer;
+            b.last = buffer + n;
+
+            rev = c->read;
+
+            c->udp->buffer = &b;
+            rev->ready = 1;
+
+            rev->handler(rev);
+
+            if (c->udp) {
+                c->udp->buffer = NULL;
+            }
+
+            if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+                ev->available -= n;
+            }
+
+            continue;
+        }
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+#endif
+
+        ngx_accept_disabled = ngx_cycle->connection_n / 8
+                              - ngx_cycle->free_connection_n;
+
+        c = ngx_get_connection(lc->fd, ev->log);
+        if (c == NULL) {
+            return;
+        }
+
+        c->shared = 1;
+        c->type = SOCK_DGRAM;
+        c->socklen = msg->msg_namelen;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+        c->pool = ngx_create_pool(ls->pool_size, ev->log);
+        if (c->pool == NULL) {
+            ngx_close_accepted_connection(c);
+            return;
+        }
+
+        c->sockaddr = ngx_palloc(c->pool, c->socklen);
+        if (c->sockaddr == NULL) {
+            ngx_close_accepted_connection(c);
+            return;
+        }
+
+        ngx_memcpy(c->sockaddr, msg->msg_name, c->socklen);
+
+        log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+        if (log == NULL) {
+            ngx_close_accepted_connection(c);
+            return;
+        }
+
+        *log = ls->log;
+
+        c->recv = ngx_udp_shared_recv;
+        c->send = ngx_udp_send;
+        c->send_chain = ngx_udp_send_chain;
+
+        c->log = log;
+        c->pool->log = log;
+
+        c->listening = ls;
+        c->local_sockaddr = ls->sockaddr;
+        c->local_socklen = ls->socklen;
+
+        if (local_sockaddr == &lsa.sockaddr) {
+            c->local_sockaddr = ngx_palloc(c->pool, local_socklen);
+            if (c->local_sockaddr == NULL) {
+                ngx_close_accepted_connection(c);
+                return;
+            }
+
+            ngx_memcpy(c->local_sockaddr, local_sockaddr, local_socklen);
+        }
+
         c->buffer = ngx_create_temp_buf(c->pool, n);
         if (c->buffer == NULL) {
             ngx_close_accepted_connection(c);
@@ -629,7 +751,54 @@ ngx_event_recvmsg(ngx_event_t *ev)
             ev->available -= n;
         }
 
+        if (++accepted == ecf->accept_budget) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "accept budget of %ui exhausted", accepted);
+            return;
+        }
+
+#if (NGX_HAVE_RECVMMSG)
+    } while (ev->available || next < nmsgs);
+#else
     } while (ev->available);
+#endif
+}
+
+
+static void
+ngx_event_recvmsg_init(ngx_listening_t *ls, struct msghdr *msg,
+    ngx_event_recvmsg_buf_t *buf)
+{
+    ngx_memzero(msg, sizeof(struct msghdr));
+
+    buf->iov.iov_base = (void *) buf->buffer;
+    buf->iov.iov_len = sizeof(buf->buffer);
+
+    msg->msg_name = &buf->sockaddr;
+    msg->msg_namelen = sizeof(ngx_sockaddr_t);
+    msg->msg_iov = &buf->iov;
+    msg->msg_iovlen = 1;
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+    if (ls->wildcard) {
+
+#if (NGX_HAVE_IP_RECVDSTADDR || NGX_HAVE_IP_PKTINFO)
+        if (ls->sockaddr->sa_family == AF_INET) {
+            msg->msg_control = &buf->msg_control;
+            msg->msg_controllen = sizeof(buf->msg_control);
+        }
+#endif
+
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+        if (ls->sockaddr->sa_family == AF_INET6) {
+            msg->msg_control = &buf->msg_control6;
+            msg->msg_controllen = sizeof(buf->msg_control6);
+        }
+#endif
+    }
+
+#endif
 }
 
 #endif
@@ -11,6 +11,7 @@
 #include <ngx_event_connect.h>
 
 
+static ngx_addr_t *ngx_event_connect_get_local(ngx_peer_connection_t *pc);
 #if (NGX_HAVE_TRANSPARENT_PROXY)
 static ngx_int_t ngx_event_connect_set_transparent(ngx_peer_connection_t *pc,
     ngx_socket_t s);
@@ -26,11 +27,13 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
 #endif
     ngx_int_t          event;
     ngx_err_t          err;
-    ngx_uint_t         level;
+    ngx_uint_t         level, tries;
     ngx_socket_t       s;
     ngx_event_t       *rev, *wev;
     ngx_connection_t  *c;
 
+    pc->connecting = 0;
+
     rc = pc->get(pc, pc->data);
     if (rc != NGX_OK) {
         return rc;
@@ -38,6 +41,15 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
 
     type = (pc->type ? pc->type : SOCK_STREAM);
 
+    tries = 0;
+
+again:
+
+    if (pc->local_pool) {
+        pc->local = ngx_event_connect_get_local(pc);
+        tries++;
+    }
+
     s = ngx_socket(pc->sockaddr->sa_family, type, 0);
 
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, pc->log, 0, "%s socket %d",
@@ -73,6 +85,34 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         }
     }
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    if (pc->fastopen
+        && type == SOCK_STREAM
+        && pc->sockaddr->sa_family != AF_UNIX)
+    {
+        int  fastopen = 1;
+
+        /*
+         * connect() returns immediately, the SYN is sent along with
+         * the data of the first write if the server's cookie is known,
+         * so the peer is considered connecting until the first write
+         */
+
+        if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       (const void *) &fastopen, sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                          "setsockopt(TCP_FASTOPEN_CONNECT) failed, ignored");
+
+        } else {
+            pc->connecting = 1;
+        }
+    }
+
+#endif
+
     if (ngx_nonblocking(s) == -1) {
         ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
                       ngx_nonblocking_n " failed");
@@ -138,7 +178,23 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
 #endif
 
         if (bind(s, pc->local->sockaddr, pc->local->socklen) == -1) {
-            ngx_log_error(NGX_LOG_CRIT, pc->log, ngx_socket_errno,
+            err = ngx_socket_errno;
+
+            if ((err == NGX_EADDRINUSE || err == NGX_EADDRNOTAVAIL)
+                && pc->local_pool
+                && tries < pc->local_pool->naddrs)
+            {
+                ngx_log_error(NGX_LOG_ERR, pc->log, err,
+                              "bind(%V) failed, trying next local address",
+                              &pc->local->name);
+
+                ngx_close_connection(c);
+                pc->connection = NULL;
+
+                goto again;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, pc->log, err,
                           "bind(%V) failed", &pc->local->name);
 
             goto failed;
@@ -203,6 +259,27 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
 #endif
             )
         {
+            /*
+             * with IP_BIND_ADDRESS_NO_PORT the local port is chosen
+             * on connect(), and EADDRNOTAVAIL means that ephemeral ports
+             * for this source address are exhausted
+             */
+
+            if ((err == NGX_EADDRNOTAVAIL || err == NGX_EADDRINUSE)
+                && pc->local_pool
+                && tries < pc->local_pool->naddrs)
+            {
+                ngx_log_error(NGX_LOG_ERR, c->log, err,
+                              "connect() to %V from %V failed, "
+                              "trying next local address",
+                              pc->name, &pc->local->name);
+
+                ngx_close_connection(c);
+                pc->connection = NULL;
+
+                goto again;
+            }
+
             if (err == NGX_ECONNREFUSED
 #if (NGX_LINUX)
                 /*
@@ -234,9 +311,9 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
     }
 
     if (ngx_add_conn) {
-        if (rc == -1) {
+        if (rc == -1 || pc->connecting) {
 
-            /* NGX_EINPROGRESS */
+            /* NGX_EINPROGRESS or TCP Fast Open */
 
             return NGX_AGAIN;
         }
@@ -289,9 +366,9 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         goto failed;
     }
 
-    if (rc == -1) {
+    if (rc == -1 || pc->connecting) {
 
-        /* NGX_EINPROGRESS */
+        /* NGX_EINPROGRESS or TCP Fast Open */
 
         if (ngx_add_event(wev, NGX_WRITE_EVENT, event) != NGX_OK) {
             goto failed;
@@ -315,6 +392,33 @@ failed:
 }
 
 
+static ngx_addr_t *
+ngx_event_connect_get_local(ngx_peer_connection_t *pc)
+{
+    ngx_uint_t              i;
+    ngx_addr_t             *addr;
+    ngx_peer_local_pool_t  *pool;
+
+    pool = pc->local_pool;
+
+    /* round-robin over addresses of the peer's address family */
+
+    for (i = 0; i < pool->naddrs; i++) {
+        addr = &pool->addrs[pool->current];
+
+        pool->current = (pool->current + 1) % pool->naddrs;
+
+        if (addr->sockaddr->sa_family == pc->sockaddr->sa_family) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, pc->log, 0,
+                           "local address: %V", &addr->name);
+            return addr;
+        }
+    }
+
+    return NULL;
+}
+
+
 #if (NGX_HAVE_TRANSPARENT_PROXY)
 
 static ngx_int_t
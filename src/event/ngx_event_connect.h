@@ -33,6 +33,13 @@ typedef void (*ngx_event_save_peer_session_pt)(ngx_peer_connection_t *pc,
     void *data);
 
 
+typedef struct {
+    ngx_addr_t                      *addrs;
+    ngx_uint_t                       naddrs;
+    ngx_uint_t                       current;
+} ngx_peer_local_pool_t;
+
+
 struct ngx_peer_connection_s {
     ngx_connection_t                *connection;
 
@@ -54,6 +61,7 @@ struct ngx_peer_connection_s {
 #endif
 
     ngx_addr_t                      *local;
+    ngx_peer_local_pool_t           *local_pool;
 
     int                              type;
     int                              rcvbuf;
@@ -62,6 +70,8 @@ struct ngx_peer_connection_s {
 
     unsigned                         cached:1;
     unsigned                         transparent:1;
+    unsigned                         fastopen:1;
+    unsigned                         connecting:1;
 
                                      /* ngx_connection_log_error_e */
     unsigned                         log_error:2;
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_SSL_ASYNC)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
@@ -24,9 +28,46 @@ static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
 static void ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
     int ret);
 static void ngx_ssl_passwords_cleanup(void *data);
+#ifdef SSL_CTRL_CHAIN
+static ngx_ssl_cert_cache_node_t *ngx_ssl_cert_cache_load(ngx_connection_t *c,
+    ngx_ssl_cert_cache_t *cache, ngx_str_t *name, uint32_t hash);
+static int ngx_ssl_cert_cache_password_callback(char *buf, int size,
+    int rwflag, void *userdata);
+static void ngx_ssl_cert_cache_free(ngx_ssl_cert_cache_t *cache,
+    ngx_ssl_cert_cache_node_t *node);
+#endif
+static void ngx_ssl_cert_cache_cleanup(void *data);
+static void ngx_ssl_handshake_done(ngx_connection_t *c);
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+static ngx_int_t ngx_ssl_try_early_data(ngx_connection_t *c);
+#endif
+#if (NGX_SSL_ASYNC)
+static int ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_rsa(ngx_ssl_async_t *async, int flen,
+    const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+static void ngx_ssl_async_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_async_event_handler(ngx_event_t *ev);
+static void ngx_ssl_async_free_connection(ngx_ssl_conn_t *ssl_conn);
+static void ngx_ssl_async_info_callback(const ngx_ssl_conn_t *ssl_conn,
+    int where, int ret);
+#endif
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+static ssize_t ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf,
+    size_t size);
+#endif
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
+static size_t ngx_ssl_record_size(ngx_connection_t *c);
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
+    size_t size);
+#endif
+static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
+    size_t size);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
@@ -44,15 +85,18 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
+    ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_rbtree_node_t *ngx_ssl_session_lookup_next(ngx_rbtree_t *rbtree,
+    uint32_t hash, u_char *id, size_t len);
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc);
+static ngx_int_t ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log);
 #endif
 
 #ifndef X509_CHECK_FLAG_ALWAYS_CHECK_SUBJECT
@@ -116,6 +160,34 @@ int  ngx_ssl_certificate_name_index;
 int  ngx_ssl_stapling_index;
 
 
+#if (NGX_SSL_ASYNC)
+
+struct ngx_ssl_async_s {
+    ngx_connection_t           *connection;
+    ngx_ssl_conn_t             *ssl_conn;
+
+    int                       (*handler)(int flen, const unsigned char *from,
+                                         unsigned char *to, RSA *rsa,
+                                         int padding);
+    RSA                        *rsa;
+    int                         flen;
+    int                         padding;
+    int                         ret;
+    u_char                     *from;
+    u_char                     *to;
+
+    unsigned                    done:1;
+    unsigned                    orphan:1;
+};
+
+
+static int                ngx_ssl_async_index;
+static RSA_METHOD        *ngx_ssl_async_rsa_method;
+static ngx_connection_t  *ngx_ssl_async_connection;
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -215,6 +287,17 @@ ngx_ssl_init(ngx_log_t *log)
         return NGX_ERROR;
     }
 
+#if (NGX_SSL_ASYNC)
+
+    ngx_ssl_async_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+    if (ngx_ssl_async_index == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RSA_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
     return NGX_OK;
 }
 
@@ -613,685 +696,1456 @@ ngx_ssl_password_callback(char *buf, int size, int rwflag, void *userdata)
 }
 
 
-ngx_int_t
-ngx_ssl_ciphers(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *ciphers,
-    ngx_uint_t prefer_server_ciphers)
+ngx_ssl_cert_cache_t *
+ngx_ssl_cert_cache_init(ngx_conf_t *cf, ngx_str_t *path, ngx_uint_t max,
+    time_t valid)
 {
-    if (SSL_CTX_set_cipher_list(ssl->ctx, (char *) ciphers->data) == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set_cipher_list(\"%V\") failed",
-                      ciphers);
-        return NGX_ERROR;
+    ngx_pool_cleanup_t    *cln;
+    ngx_ssl_cert_cache_t  *cache;
+
+#ifndef SSL_CTRL_CHAIN
+    ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                  "\"ssl_certificate_directory\" ignored, not supported");
+#endif
+
+    if (ngx_conf_full_name(cf->cycle, path, 1) != NGX_OK) {
+        return NULL;
     }
 
-    if (prefer_server_ciphers) {
-        SSL_CTX_set_options(ssl->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    cache = ngx_palloc(cf->pool, sizeof(ngx_ssl_cert_cache_t));
+    if (cache == NULL) {
+        return NULL;
     }
 
-#if (OPENSSL_VERSION_NUMBER < 0x10100001L && !defined LIBRESSL_VERSION_NUMBER)
-    /* a temporary 512-bit RSA key is required for export versions of MSIE */
-    SSL_CTX_set_tmp_rsa_callback(ssl->ctx, ngx_ssl_rsa512_key_callback);
-#endif
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
 
-    return NGX_OK;
+    ngx_queue_init(&cache->expire_queue);
+    ngx_queue_init(&cache->negative_queue);
+
+    cache->path = *path;
+    cache->current = 0;
+    cache->negative = 0;
+    cache->max = max;
+    cache->valid = valid;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_ssl_cert_cache_cleanup;
+    cln->data = cache;
+
+    return cache;
 }
 
 
 ngx_int_t
-ngx_ssl_client_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
-    ngx_int_t depth)
+ngx_ssl_cert_cache_set(ngx_connection_t *c, ngx_ssl_cert_cache_t *cache,
+    ngx_str_t *name)
 {
-    STACK_OF(X509_NAME)  *list;
+#ifdef SSL_CTRL_CHAIN
 
-    SSL_CTX_set_verify(ssl->ctx, SSL_VERIFY_PEER, ngx_ssl_verify_callback);
+    uint32_t                    hash;
+    ngx_uint_t                 *n;
+    ngx_queue_t                *q, *queue;
+    ngx_ssl_cert_cache_node_t  *node;
 
-    SSL_CTX_set_verify_depth(ssl->ctx, depth);
+    hash = ngx_crc32_long(name->data, name->len);
 
-    if (cert->len == 0) {
-        return NGX_OK;
+    node = (ngx_ssl_cert_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->rbtree, name, hash);
+
+    if (node && ngx_time() - node->created >= cache->valid) {
+        ngx_ssl_cert_cache_free(cache, node);
+        node = NULL;
     }
 
-    if (ngx_conf_full_name(cf->cycle, cert, 1) != NGX_OK) {
-        return NGX_ERROR;
+    if (node == NULL) {
+
+        node = ngx_ssl_cert_cache_load(c, cache, name, hash);
+        if (node == NULL) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * negative nodes are kept in a separate queue, so unknown names
+         * cannot evict loaded certificates
+         */
+
+        if (node->cert) {
+            queue = &cache->expire_queue;
+            n = &cache->current;
+
+        } else {
+            queue = &cache->negative_queue;
+            n = &cache->negative;
+        }
+
+        if (*n >= cache->max) {
+            q = ngx_queue_last(queue);
+            ngx_ssl_cert_cache_free(cache,
+                         ngx_queue_data(q, ngx_ssl_cert_cache_node_t, queue));
+        }
+
+        (*n)++;
+
+    } else {
+        ngx_queue_remove(&node->queue);
+
+        queue = node->cert ? &cache->expire_queue : &cache->negative_queue;
     }
 
-    if (SSL_CTX_load_verify_locations(ssl->ctx, (char *) cert->data, NULL)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_load_verify_locations(\"%s\") failed",
-                      cert->data);
-        return NGX_ERROR;
+    ngx_queue_insert_head(queue, &node->queue);
+
+    if (node->cert == NULL) {
+        return NGX_DECLINED;
     }
 
-    /*
-     * SSL_CTX_load_verify_locations() may leave errors in the error queue
-     * while returning success
-     */
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl cached certificate: \"%V\"", name);
 
-    ERR_clear_error();
+    /* certificates of the server are replaced by the cached one */
 
-    list = SSL_load_client_CA_file((char *) cert->data);
+    SSL_certs_clear(c->ssl->connection);
 
-    if (list == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_load_client_CA_file(\"%s\") failed", cert->data);
+    if (SSL_use_certificate(c->ssl->connection, node->cert) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_use_certificate(\"%V\") failed", name);
         return NGX_ERROR;
     }
 
-    /*
-     * before 0.9.7h and 0.9.8 SSL_load_client_CA_file()
-     * always leaved an error in the error queue
-     */
-
-    ERR_clear_error();
+    if (SSL_set1_chain(c->ssl->connection, node->chain) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_set1_chain(\"%V\") failed", name);
+        return NGX_ERROR;
+    }
 
-    SSL_CTX_set_client_CA_list(ssl->ctx, list);
+    if (SSL_use_PrivateKey(c->ssl->connection, node->key) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_use_PrivateKey(\"%V\") failed", name);
+        return NGX_ERROR;
+    }
 
     return NGX_OK;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
 }
 
 
-ngx_int_t
-ngx_ssl_trusted_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
-    ngx_int_t depth)
+#ifdef SSL_CTRL_CHAIN
+
+static ngx_ssl_cert_cache_node_t *
+ngx_ssl_cert_cache_load(ngx_connection_t *c, ngx_ssl_cert_cache_t *cache,
+    ngx_str_t *name, uint32_t hash)
 {
-    SSL_CTX_set_verify_depth(ssl->ctx, depth);
+    BIO                        *bio;
+    X509                       *x509;
+    u_char                     *file;
+    u_long                      n;
+    ngx_ssl_cert_cache_node_t  *node;
+
+    node = ngx_calloc(sizeof(ngx_ssl_cert_cache_node_t) + name->len, c->log);
+    if (node == NULL) {
+        return NULL;
+    }
 
-    if (cert->len == 0) {
-        return NGX_OK;
+    node->sn.node.key = hash;
+    node->sn.str.len = name->len;
+    node->sn.str.data = (u_char *) node + sizeof(ngx_ssl_cert_cache_node_t);
+    ngx_memcpy(node->sn.str.data, name->data, name->len);
+
+    node->created = ngx_time();
+
+    ngx_rbtree_insert(&cache->rbtree, &node->sn.node);
+
+    /* "path/name.crt" and "path/name.key", the name is a validated host */
+
+    file = ngx_pnalloc(c->pool, cache->path.len + name->len
+                                + sizeof("/.crt"));
+    if (file == NULL) {
+        return node;
     }
 
-    if (ngx_conf_full_name(cf->cycle, cert, 1) != NGX_OK) {
-        return NGX_ERROR;
+    ngx_sprintf(file, "%V/%V.crt%Z", &cache->path, name);
+
+    bio = BIO_new_file((char *) file, "r");
+    if (bio == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ssl certificate \"%s\" not found", file);
+        ERR_clear_error();
+        return node;
     }
 
-    if (SSL_CTX_load_verify_locations(ssl->ctx, (char *) cert->data, NULL)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_load_verify_locations(\"%s\") failed",
-                      cert->data);
-        return NGX_ERROR;
+    node->cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    if (node->cert == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "PEM_read_bio_X509_AUX(\"%s\") failed", file);
+        goto failed;
     }
 
-    /*
-     * SSL_CTX_load_verify_locations() may leave errors in the error queue
-     * while returning success
-     */
+    node->chain = sk_X509_new_null();
+    if (node->chain == NULL) {
+        goto failed;
+    }
 
-    ERR_clear_error();
+    /* read rest of the chain */
 
-    return NGX_OK;
-}
+    for ( ;; ) {
 
+        x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+        if (x509 == NULL) {
+            n = ERR_peek_last_error();
 
-ngx_int_t
-ngx_ssl_crl(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *crl)
-{
-    X509_STORE   *store;
-    X509_LOOKUP  *lookup;
+            if (ERR_GET_LIB(n) == ERR_LIB_PEM
+                && ERR_GET_REASON(n) == PEM_R_NO_START_LINE)
+            {
+                /* end of file */
+                ERR_clear_error();
+                break;
+            }
 
-    if (crl->len == 0) {
-        return NGX_OK;
-    }
+            /* some real error */
 
-    if (ngx_conf_full_name(cf->cycle, crl, 1) != NGX_OK) {
-        return NGX_ERROR;
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "PEM_read_bio_X509(\"%s\") failed", file);
+            goto failed;
+        }
+
+        if (sk_X509_push(node->chain, x509) == 0) {
+            X509_free(x509);
+            goto failed;
+        }
     }
 
-    store = SSL_CTX_get_cert_store(ssl->ctx);
+    BIO_free(bio);
 
-    if (store == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_get_cert_store() failed");
-        return NGX_ERROR;
+    ngx_sprintf(file, "%V/%V.key%Z", &cache->path, name);
+
+    bio = BIO_new_file((char *) file, "r");
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "BIO_new_file(\"%s\") failed", file);
+        goto failed;
     }
 
-    lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
+    node->key = PEM_read_bio_PrivateKey(bio, NULL,
+                                        ngx_ssl_cert_cache_password_callback,
+                                        NULL);
+    if (node->key == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "PEM_read_bio_PrivateKey(\"%s\") failed", file);
+        goto failed;
+    }
 
-    if (lookup == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "X509_STORE_add_lookup() failed");
-        return NGX_ERROR;
+    BIO_free(bio);
+
+    return node;
+
+failed:
+
+    /* the node is kept as a negative one until it is expired */
+
+    if (bio) {
+        BIO_free(bio);
     }
 
-    if (X509_LOOKUP_load_file(lookup, (char *) crl->data, X509_FILETYPE_PEM)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "X509_LOOKUP_load_file(\"%s\") failed", crl->data);
-        return NGX_ERROR;
+    if (node->cert) {
+        X509_free(node->cert);
+        node->cert = NULL;
     }
 
-    X509_STORE_set_flags(store,
-                         X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL);
+    if (node->chain) {
+        sk_X509_pop_free(node->chain, X509_free);
+        node->chain = NULL;
+    }
 
-    return NGX_OK;
+    return node;
 }
 
 
 static int
-ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store)
+ngx_ssl_cert_cache_password_callback(char *buf, int size, int rwflag,
+    void *userdata)
 {
-#if (NGX_DEBUG)
-    char              *subject, *issuer;
-    int                err, depth;
-    X509              *cert;
-    X509_NAME         *sname, *iname;
-    ngx_connection_t  *c;
-    ngx_ssl_conn_t    *ssl_conn;
-
-    ssl_conn = X509_STORE_CTX_get_ex_data(x509_store,
-                                          SSL_get_ex_data_X509_STORE_CTX_idx());
+    /* encrypted keys are not supported */
 
-    c = ngx_ssl_get_connection(ssl_conn);
+    return 0;
+}
 
-    cert = X509_STORE_CTX_get_current_cert(x509_store);
-    err = X509_STORE_CTX_get_error(x509_store);
-    depth = X509_STORE_CTX_get_error_depth(x509_store);
 
-    sname = X509_get_subject_name(cert);
-    subject = sname ? X509_NAME_oneline(sname, NULL, 0) : "(none)";
+static void
+ngx_ssl_cert_cache_free(ngx_ssl_cert_cache_t *cache,
+    ngx_ssl_cert_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->rbtree, &node->sn.node);
 
-    iname = X509_get_issuer_name(cert);
-    issuer = iname ? X509_NAME_oneline(iname, NULL, 0) : "(none)";
+    if (node->cert) {
+        cache->current--;
 
-    ngx_log_debug5(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "verify:%d, error:%d, depth:%d, "
-                   "subject:\"%s\", issuer:\"%s\"",
-                   ok, err, depth, subject, issuer);
+        /* connections using the certificate hold their own references */
 
-    if (sname) {
-        OPENSSL_free(subject);
-    }
+        X509_free(node->cert);
+        sk_X509_pop_free(node->chain, X509_free);
+        EVP_PKEY_free(node->key);
 
-    if (iname) {
-        OPENSSL_free(issuer);
+    } else {
+        cache->negative--;
     }
-#endif
 
-    return 1;
+    ngx_free(node);
 }
 
+#endif
+
 
 static void
-ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where, int ret)
+ngx_ssl_cert_cache_cleanup(void *data)
 {
-    BIO               *rbio, *wbio;
-    ngx_connection_t  *c;
+#ifdef SSL_CTRL_CHAIN
 
-    if (where & SSL_CB_HANDSHAKE_START) {
-        c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl_conn);
+    ngx_ssl_cert_cache_t  *cache = data;
 
-        if (c->ssl->handshaked) {
-            c->ssl->renegotiation = 1;
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL renegotiation");
-        }
-    }
-
-    if ((where & SSL_CB_ACCEPT_LOOP) == SSL_CB_ACCEPT_LOOP) {
-        c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl_conn);
-
-        if (!c->ssl->handshake_buffer_set) {
-            /*
-             * By default OpenSSL uses 4k buffer during a handshake,
-             * which is too low for long certificate chains and might
-             * result in extra round-trips.
-             *
-             * To adjust a buffer size we detect that buffering was added
-             * to write side of the connection by comparing rbio and wbio.
-             * If they are different, we assume that it's due to buffering
-             * added to wbio, and set buffer size.
-             */
+    ngx_queue_t  *q;
 
-            rbio = SSL_get_rbio((ngx_ssl_conn_t *) ssl_conn);
-            wbio = SSL_get_wbio((ngx_ssl_conn_t *) ssl_conn);
+    while (!ngx_queue_empty(&cache->expire_queue)) {
+        q = ngx_queue_last(&cache->expire_queue);
+        ngx_ssl_cert_cache_free(cache,
+                         ngx_queue_data(q, ngx_ssl_cert_cache_node_t, queue));
+    }
 
-            if (rbio != wbio) {
-                (void) BIO_set_write_buffer_size(wbio, NGX_SSL_BUFSIZE);
-                c->ssl->handshake_buffer_set = 1;
-            }
-        }
+    while (!ngx_queue_empty(&cache->negative_queue)) {
+        q = ngx_queue_last(&cache->negative_queue);
+        ngx_ssl_cert_cache_free(cache,
+                         ngx_queue_data(q, ngx_ssl_cert_cache_node_t, queue));
     }
+
+#endif
 }
 
 
-RSA *
-ngx_ssl_rsa512_key_callback(ngx_ssl_conn_t *ssl_conn, int is_export,
-    int key_length)
+ngx_int_t
+ngx_ssl_ciphers(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *ciphers,
+    ngx_uint_t prefer_server_ciphers)
 {
-    static RSA  *key;
-
-    if (key_length != 512) {
-        return NULL;
+    if (SSL_CTX_set_cipher_list(ssl->ctx, (char *) ciphers->data) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%V\") failed",
+                      ciphers);
+        return NGX_ERROR;
     }
 
-#if (OPENSSL_VERSION_NUMBER < 0x10100003L && !defined OPENSSL_NO_DEPRECATED)
-
-    if (key == NULL) {
-        key = RSA_generate_key(512, RSA_F4, NULL, NULL);
+    if (prefer_server_ciphers) {
+        SSL_CTX_set_options(ssl->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
     }
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100001L && !defined LIBRESSL_VERSION_NUMBER)
+    /* a temporary 512-bit RSA key is required for export versions of MSIE */
+    SSL_CTX_set_tmp_rsa_callback(ssl->ctx, ngx_ssl_rsa512_key_callback);
 #endif
 
-    return key;
+    return NGX_OK;
 }
 
 
-ngx_array_t *
-ngx_ssl_read_password_file(ngx_conf_t *cf, ngx_str_t *file)
+ngx_int_t
+ngx_ssl_async(ngx_conf_t *cf, ngx_ssl_t *ssl)
 {
-    u_char              *p, *last, *end;
-    size_t               len;
-    ssize_t              n;
-    ngx_fd_t             fd;
-    ngx_str_t           *pwd;
-    ngx_array_t         *passwords;
-    ngx_pool_cleanup_t  *cln;
-    u_char               buf[NGX_SSL_PASSWORD_BUFFER_SIZE];
+#if (NGX_SSL_ASYNC)
+
+    RSA                *rsa;
+    X509               *cert;
+    EVP_PKEY           *pkey;
+    ngx_thread_pool_t  *tp;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    int                 i, n;
+    size_t              len;
+    u_char             *list, *p;
+    const char         *name;
+    const SSL_CIPHER   *cipher;
+    STACK_OF(SSL_CIPHER)  *ciphers;
+#endif
 
-    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
-        return NULL;
+    /*
+     * RSA private key operations are run in a thread pool: the handshake
+     * is run as an OpenSSL async job, which is paused while the operation
+     * is in progress and resumed from the event loop when it completes
+     */
+
+    tp = ngx_thread_pool_add(cf, NULL);
+    if (tp == NULL) {
+        return NGX_ERROR;
     }
 
-    cln = ngx_pool_cleanup_add(cf->temp_pool, 0);
-    passwords = ngx_array_create(cf->temp_pool, 4, sizeof(ngx_str_t));
+    if (ngx_ssl_async_rsa_method == NULL) {
+        ngx_ssl_async_rsa_method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
 
-    if (cln == NULL || passwords == NULL) {
-        return NULL;
+        if (ngx_ssl_async_rsa_method == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "RSA_meth_dup() failed");
+            return NGX_ERROR;
+        }
+
+        RSA_meth_set_priv_enc(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_enc);
+        RSA_meth_set_priv_dec(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_dec);
     }
 
-    cln->handler = ngx_ssl_passwords_cleanup;
-    cln->data = passwords;
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        SSL_CTX_select_current_cert(ssl->ctx, cert);
 
-    fd = ngx_open_file(file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
-    if (fd == NGX_INVALID_FILE) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
-                           ngx_open_file_n " \"%s\" failed", file->data);
-        return NULL;
-    }
+        pkey = SSL_CTX_get0_privatekey(ssl->ctx);
 
-    len = 0;
-    last = buf;
+        if (pkey == NULL || EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA) {
+            continue;
+        }
 
-    do {
-        n = ngx_read_fd(fd, last, NGX_SSL_PASSWORD_BUFFER_SIZE - len);
+        rsa = EVP_PKEY_get1_RSA(pkey);
+        if (rsa == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "EVP_PKEY_get1_RSA() failed");
+            return NGX_ERROR;
+        }
 
-        if (n == -1) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
-                               ngx_read_fd_n " \"%s\" failed", file->data);
-            passwords = NULL;
-            goto cleanup;
+        if (RSA_set_method(rsa, ngx_ssl_async_rsa_method) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "RSA_set_method() failed");
+            RSA_free(rsa);
+            return NGX_ERROR;
         }
 
-        end = last + n;
+        if (RSA_set_ex_data(rsa, ngx_ssl_async_index, tp) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "RSA_set_ex_data() failed");
+            RSA_free(rsa);
+            return NGX_ERROR;
+        }
 
-        if (len && n == 0) {
-            *end++ = LF;
+        pkey = EVP_PKEY_new();
+        if (pkey == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_new() failed");
+            RSA_free(rsa);
+            return NGX_ERROR;
         }
 
-        p = buf;
+        if (EVP_PKEY_assign_RSA(pkey, rsa) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "EVP_PKEY_assign_RSA() failed");
+            EVP_PKEY_free(pkey);
+            RSA_free(rsa);
+            return NGX_ERROR;
+        }
 
-        for ( ;; ) {
-            last = ngx_strlchr(last, end, LF);
+        if (SSL_CTX_use_PrivateKey(ssl->ctx, pkey) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_use_PrivateKey() failed");
+            EVP_PKEY_free(pkey);
+            return NGX_ERROR;
+        }
 
-            if (last == NULL) {
-                break;
-            }
+        EVP_PKEY_free(pkey);
+    }
 
-            len = last++ - p;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
 
-            if (len && p[len - 1] == CR) {
-                len--;
-            }
+    /*
+     * OpenSSL 3.0 does not support RSA key exchange with keys using
+     * a custom RSA method, so such ciphers are disabled
+     */
 
-            if (len) {
-                pwd = ngx_array_push(passwords);
-                if (pwd == NULL) {
-                    passwords = NULL;
-                    goto cleanup;
-                }
+    ciphers = SSL_CTX_get_ciphers(ssl->ctx);
+    n = sk_SSL_CIPHER_num(ciphers);
 
-                pwd->len = len;
-                pwd->data = ngx_pnalloc(cf->temp_pool, len);
+    len = 0;
 
-                if (pwd->data == NULL) {
-                    passwords->nelts--;
-                    passwords = NULL;
-                    goto cleanup;
-                }
+    for (i = 0; i < n; i++) {
+        len += ngx_strlen(SSL_CIPHER_get_name(sk_SSL_CIPHER_value(ciphers, i)))
+               + 1;
+    }
 
-                ngx_memcpy(pwd->data, p, len);
-            }
+    list = ngx_pnalloc(cf->pool, len + 1);
+    if (list == NULL) {
+        return NGX_ERROR;
+    }
 
-            p = last;
-        }
+    p = list;
 
-        len = end - p;
+    for (i = 0; i < n; i++) {
+        cipher = sk_SSL_CIPHER_value(ciphers, i);
 
-        if (len == NGX_SSL_PASSWORD_BUFFER_SIZE) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "too long line in \"%s\"", file->data);
-            passwords = NULL;
-            goto cleanup;
+        if (SSL_CIPHER_get_kx_nid(cipher) == NID_kx_rsa
+            || SSL_CIPHER_get_kx_nid(cipher) == NID_kx_any)
+        {
+            continue;
         }
 
-        ngx_memmove(buf, p, len);
-        last = buf + len;
-
-    } while (n != 0);
+        name = SSL_CIPHER_get_name(cipher);
 
-    if (passwords->nelts == 0) {
-        pwd = ngx_array_push(passwords);
-        if (pwd == NULL) {
-            passwords = NULL;
-            goto cleanup;
+        if (p != list) {
+            *p++ = ':';
         }
 
-        ngx_memzero(pwd, sizeof(ngx_str_t));
+        p = ngx_cpymem(p, name, ngx_strlen(name));
     }
 
-cleanup:
+    *p = '\0';
 
-    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
-        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
-                           ngx_close_file_n " \"%s\" failed", file->data);
+    if (p == list) {
+        ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "no ciphers without RSA key exchange "
+                      "for \"ssl_async\"");
+        return NGX_ERROR;
     }
 
-    ngx_memzero(buf, NGX_SSL_PASSWORD_BUFFER_SIZE);
+    if (SSL_CTX_set_cipher_list(ssl->ctx, (char *) list) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%s\") failed", list);
+        return NGX_ERROR;
+    }
 
-    return passwords;
+#endif
+
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ASYNC);
+
+#else
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_async\" ignored, not supported");
+
+#endif
+
+    return NGX_OK;
 }
 
 
-static void
-ngx_ssl_passwords_cleanup(void *data)
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl)
 {
-    ngx_array_t *passwords = data;
+#if (NGX_SSL_SENDFILE)
 
-    ngx_str_t   *pwd;
-    ngx_uint_t   i;
+    /*
+     * OpenSSL hands the session keys to the kernel after the handshake
+     * if the kernel supports TLS offload for the negotiated cipher
+     */
 
-    pwd = passwords->elts;
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
 
-    for (i = 0; i < passwords->nelts; i++) {
-        ngx_memzero(pwd[i].data, pwd[i].len);
-    }
+#else
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_ktls\" ignored, not supported");
+
+#endif
+
+    return NGX_OK;
 }
 
 
 ngx_int_t
-ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
+ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 {
-    DH   *dh;
-    BIO  *bio;
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    long  mode;
+#endif
 
-    if (file->len == 0) {
+    if (!enable) {
         return NGX_OK;
     }
 
-    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
-        return NGX_ERROR;
-    }
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
 
-    bio = BIO_new_file((char *) file->data, "r");
-    if (bio == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "BIO_new_file(\"%s\") failed", file->data);
-        return NGX_ERROR;
-    }
+    SSL_CTX_set_max_early_data(ssl->ctx, NGX_SSL_BUFSIZE);
 
-    dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-    if (dh == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "PEM_read_bio_DHparams(\"%s\") failed", file->data);
-        BIO_free(bio);
-        return NGX_ERROR;
+    if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index)) {
+
+        /*
+         * OpenSSL looks for replays in its internal session cache only,
+         * which is per worker process; instead, TLSv1.3 tickets are made
+         * stateful, and sessions which allow early data are removed from
+         * the shared cache once resumed, so a ticket is accepted only once
+         * by all worker processes; the internal cache is disabled, as
+         * a session found there would be resumed once more
+         */
+
+        mode = SSL_CTX_get_session_cache_mode(ssl->ctx);
+
+        if (!(mode & SSL_SESS_CACHE_NO_INTERNAL_STORE)) {
+            ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                          "builtin \"ssl_session_cache\" ignored, only "
+                          "shared cache is used with \"ssl_early_data\"");
+
+            SSL_CTX_set_session_cache_mode(ssl->ctx,
+                                           mode|SSL_SESS_CACHE_NO_INTERNAL);
+        }
+
+        if (!(SSL_CTX_get_options(ssl->ctx) & SSL_OP_NO_TICKET)) {
+            ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                          "\"ssl_session_tickets\" ignored, stateful "
+                          "tickets are used with \"ssl_early_data\"");
+        }
+
+        SSL_CTX_set_options(ssl->ctx, SSL_OP_NO_ANTI_REPLAY|SSL_OP_NO_TICKET);
+
+        /* each stateful ticket takes an entry in the shared cache */
+
+        SSL_CTX_set_num_tickets(ssl->ctx, 1);
     }
 
-    SSL_CTX_set_tmp_dh(ssl->ctx, dh);
+#else
 
-    DH_free(dh);
-    BIO_free(bio);
+    ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                  "\"ssl_early_data\" is not supported on this platform, "
+                  "ignored");
+
+#endif
 
     return NGX_OK;
 }
 
 
 ngx_int_t
-ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name)
-{
-#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
-#ifndef OPENSSL_NO_ECDH
+ngx_ssl_client_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
+    ngx_int_t depth)
+{
+    STACK_OF(X509_NAME)  *list;
 
-    /*
-     * Elliptic-Curve Diffie-Hellman parameters are either "named curves"
-     * from RFC 4492 section 5.1.1, or explicitly described curves over
-     * binary fields.  OpenSSL only supports the "named curves", which provide
-     * maximum interoperability.
-     */
+    SSL_CTX_set_verify(ssl->ctx, SSL_VERIFY_PEER, ngx_ssl_verify_callback);
 
-#ifdef SSL_CTRL_SET_CURVES_LIST
+    SSL_CTX_set_verify_depth(ssl->ctx, depth);
+
+    if (cert->len == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, cert, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_load_verify_locations(ssl->ctx, (char *) cert->data, NULL)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_load_verify_locations(\"%s\") failed",
+                      cert->data);
+        return NGX_ERROR;
+    }
 
     /*
-     * OpenSSL 1.0.2+ allows configuring a curve list instead of a single
-     * curve previously supported.  By default an internal list is used,
-     * with prime256v1 being preferred by server in OpenSSL 1.0.2b+
-     * and X25519 in OpenSSL 1.1.0+.
-     *
-     * By default a curve preferred by the client will be used for
-     * key exchange.  The SSL_OP_CIPHER_SERVER_PREFERENCE option can
-     * be used to prefer server curves instead, similar to what it
-     * does for ciphers.
+     * SSL_CTX_load_verify_locations() may leave errors in the error queue
+     * while returning success
      */
 
-    SSL_CTX_set_options(ssl->ctx, SSL_OP_SINGLE_ECDH_USE);
-
-#if SSL_CTRL_SET_ECDH_AUTO
-    /* not needed in OpenSSL 1.1.0+ */
-    SSL_CTX_set_ecdh_auto(ssl->ctx, 1);
-#endif
+    ERR_clear_error();
 
-    if (ngx_strcmp(name->data, "auto") == 0) {
-        return NGX_OK;
-    }
+    list = SSL_load_client_CA_file((char *) cert->data);
 
-    if (SSL_CTX_set1_curves_list(ssl->ctx, (char *) name->data) == 0) {
+    if (list == NULL) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set1_curves_list(\"%s\") failed", name->data);
+                      "SSL_load_client_CA_file(\"%s\") failed", cert->data);
         return NGX_ERROR;
     }
 
-#else
+    /*
+     * before 0.9.7h and 0.9.8 SSL_load_client_CA_file()
+     * always leaved an error in the error queue
+     */
 
-    int      nid;
-    char    *curve;
-    EC_KEY  *ecdh;
+    ERR_clear_error();
 
-    if (ngx_strcmp(name->data, "auto") == 0) {
-        curve = "prime256v1";
+    SSL_CTX_set_client_CA_list(ssl->ctx, list);
 
-    } else {
-        curve = (char *) name->data;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_trusted_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
+    ngx_int_t depth)
+{
+    SSL_CTX_set_verify_depth(ssl->ctx, depth);
+
+    if (cert->len == 0) {
+        return NGX_OK;
     }
 
-    nid = OBJ_sn2nid(curve);
-    if (nid == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "OBJ_sn2nid(\"%s\") failed: unknown curve", curve);
+    if (ngx_conf_full_name(cf->cycle, cert, 1) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ecdh = EC_KEY_new_by_curve_name(nid);
-    if (ecdh == NULL) {
+    if (SSL_CTX_load_verify_locations(ssl->ctx, (char *) cert->data, NULL)
+        == 0)
+    {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "EC_KEY_new_by_curve_name(\"%s\") failed", curve);
+                      "SSL_CTX_load_verify_locations(\"%s\") failed",
+                      cert->data);
         return NGX_ERROR;
     }
 
-    SSL_CTX_set_options(ssl->ctx, SSL_OP_SINGLE_ECDH_USE);
-
-    SSL_CTX_set_tmp_ecdh(ssl->ctx, ecdh);
+    /*
+     * SSL_CTX_load_verify_locations() may leave errors in the error queue
+     * while returning success
+     */
 
-    EC_KEY_free(ecdh);
-#endif
-#endif
-#endif
+    ERR_clear_error();
 
     return NGX_OK;
 }
 
 
 ngx_int_t
-ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
+ngx_ssl_crl(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *crl)
 {
-    ngx_ssl_connection_t  *sc;
+    X509_STORE   *store;
+    X509_LOOKUP  *lookup;
 
-    sc = ngx_pcalloc(c->pool, sizeof(ngx_ssl_connection_t));
-    if (sc == NULL) {
-        return NGX_ERROR;
+    if (crl->len == 0) {
+        return NGX_OK;
     }
 
-    sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
-    sc->buffer_size = ssl->buffer_size;
-
-    sc->session_ctx = ssl->ctx;
-
-    sc->connection = SSL_new(ssl->ctx);
-
-    if (sc->connection == NULL) {
-        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_new() failed");
+    if (ngx_conf_full_name(cf->cycle, crl, 1) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    if (SSL_set_fd(sc->connection, c->fd) == 0) {
-        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_fd() failed");
+    store = SSL_CTX_get_cert_store(ssl->ctx);
+
+    if (store == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_get_cert_store() failed");
         return NGX_ERROR;
     }
 
-    if (flags & NGX_SSL_CLIENT) {
-        SSL_set_connect_state(sc->connection);
+    lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
 
-    } else {
-        SSL_set_accept_state(sc->connection);
+    if (lookup == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "X509_STORE_add_lookup() failed");
+        return NGX_ERROR;
     }
 
-    if (SSL_set_ex_data(sc->connection, ngx_ssl_connection_index, c) == 0) {
-        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_ex_data() failed");
+    if (X509_LOOKUP_load_file(lookup, (char *) crl->data, X509_FILETYPE_PEM)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "X509_LOOKUP_load_file(\"%s\") failed", crl->data);
         return NGX_ERROR;
     }
 
-    c->ssl = sc;
+    X509_STORE_set_flags(store,
+                         X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL);
 
     return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_ssl_set_session(ngx_connection_t *c, ngx_ssl_session_t *session)
+static int
+ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store)
 {
-    if (session) {
-        if (SSL_set_session(c->ssl->connection, session) == 0) {
-            ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_session() failed");
-            return NGX_ERROR;
-        }
-    }
-
-    return NGX_OK;
-}
-
+#if (NGX_DEBUG)
+    char              *subject, *issuer;
+    int                err, depth;
+    X509              *cert;
+    X509_NAME         *sname, *iname;
+    ngx_connection_t  *c;
+    ngx_ssl_conn_t    *ssl_conn;
 
-ngx_int_t
-ngx_ssl_handshake(ngx_connection_t *c)
-{
-    int        n, sslerr;
-    ngx_err_t  err;
+    ssl_conn = X509_STORE_CTX_get_ex_data(x509_store,
+                                          SSL_get_ex_data_X509_STORE_CTX_idx());
 
-    ngx_ssl_clear_error(c->log);
+    c = ngx_ssl_get_connection(ssl_conn);
 
-    n = SSL_do_handshake(c->ssl->connection);
+    cert = X509_STORE_CTX_get_current_cert(x509_store);
+    err = X509_STORE_CTX_get_error(x509_store);
+    depth = X509_STORE_CTX_get_error_depth(x509_store);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
+    sname = X509_get_subject_name(cert);
+    subject = sname ? X509_NAME_oneline(sname, NULL, 0) : "(none)";
 
-    if (n == 1) {
+    iname = X509_get_issuer_name(cert);
+    issuer = iname ? X509_NAME_oneline(iname, NULL, 0) : "(none)";
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    ngx_log_debug5(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "verify:%d, error:%d, depth:%d, "
+                   "subject:\"%s\", issuer:\"%s\"",
+                   ok, err, depth, subject, issuer);
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    if (sname) {
+        OPENSSL_free(subject);
+    }
 
-#if (NGX_DEBUG)
-        {
-        char         buf[129], *s, *d;
-#if OPENSSL_VERSION_NUMBER >= 0x10000000L
-        const
+    if (iname) {
+        OPENSSL_free(issuer);
+    }
 #endif
-        SSL_CIPHER  *cipher;
 
-        cipher = SSL_get_current_cipher(c->ssl->connection);
+    return 1;
+}
 
-        if (cipher) {
-            SSL_CIPHER_description(cipher, &buf[1], 128);
 
-            for (s = &buf[1], d = buf; *s; s++) {
-                if (*s == ' ' && *d == ' ') {
-                    continue;
-                }
+static void
+ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where, int ret)
+{
+    BIO               *rbio, *wbio;
+    ngx_connection_t  *c;
 
-                if (*s == LF || *s == CR) {
-                    continue;
-                }
+    if (where & SSL_CB_HANDSHAKE_START) {
+        c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl_conn);
 
-                *++d = *s;
-            }
+        if (c->ssl->handshaked) {
+            c->ssl->renegotiation = 1;
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL renegotiation");
+        }
+    }
 
-            if (*d != ' ') {
-                d++;
-            }
+    if ((where & SSL_CB_ACCEPT_LOOP) == SSL_CB_ACCEPT_LOOP) {
+        c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl_conn);
 
-            *d = '\0';
+        if (!c->ssl->handshake_buffer_set) {
+            /*
+             * By default OpenSSL uses 4k buffer during a handshake,
+             * which is too low for long certificate chains and might
+             * result in extra round-trips.
+             *
+             * To adjust a buffer size we detect that buffering was added
+             * to write side of the connection by comparing rbio and wbio.
+             * If they are different, we assume that it's due to buffering
+             * added to wbio, and set buffer size.
+             */
 
-            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL: %s, cipher: \"%s\"",
-                           SSL_get_version(c->ssl->connection), &buf[1]);
+            rbio = SSL_get_rbio((ngx_ssl_conn_t *) ssl_conn);
+            wbio = SSL_get_wbio((ngx_ssl_conn_t *) ssl_conn);
 
-            if (SSL_session_reused(c->ssl->connection)) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "SSL reused session");
+            if (rbio != wbio) {
+                (void) BIO_set_write_buffer_size(wbio, NGX_SSL_BUFSIZE);
+                c->ssl->handshake_buffer_set = 1;
             }
-
-        } else {
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL no shared ciphers");
         }
+    }
+}
+
+
+RSA *
+ngx_ssl_rsa512_key_callback(ngx_ssl_conn_t *ssl_conn, int is_export,
+    int key_length)
+{
+    static RSA  *key;
+
+    if (key_length != 512) {
+        return NULL;
+    }
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100003L && !defined OPENSSL_NO_DEPRECATED)
+
+    if (key == NULL) {
+        key = RSA_generate_key(512, RSA_F4, NULL, NULL);
+    }
+
+#endif
+
+    return key;
+}
+
+
+ngx_array_t *
+ngx_ssl_read_password_file(ngx_conf_t *cf, ngx_str_t *file)
+{
+    u_char              *p, *last, *end;
+    size_t               len;
+    ssize_t              n;
+    ngx_fd_t             fd;
+    ngx_str_t           *pwd;
+    ngx_array_t         *passwords;
+    ngx_pool_cleanup_t  *cln;
+    u_char               buf[NGX_SSL_PASSWORD_BUFFER_SIZE];
+
+    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->temp_pool, 0);
+    passwords = ngx_array_create(cf->temp_pool, 4, sizeof(ngx_str_t));
+
+    if (cln == NULL || passwords == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_ssl_passwords_cleanup;
+    cln->data = passwords;
+
+    fd = ngx_open_file(file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", file->data);
+        return NULL;
+    }
+
+    len = 0;
+    last = buf;
+
+    do {
+        n = ngx_read_fd(fd, last, NGX_SSL_PASSWORD_BUFFER_SIZE - len);
+
+        if (n == -1) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_read_fd_n " \"%s\" failed", file->data);
+            passwords = NULL;
+            goto cleanup;
+        }
+
+        end = last + n;
+
+        if (len && n == 0) {
+            *end++ = LF;
         }
+
+        p = buf;
+
+        for ( ;; ) {
+            last = ngx_strlchr(last, end, LF);
+
+            if (last == NULL) {
+                break;
+            }
+
+            len = last++ - p;
+
+            if (len && p[len - 1] == CR) {
+                len--;
+            }
+
+            if (len) {
+                pwd = ngx_array_push(passwords);
+                if (pwd == NULL) {
+                    passwords = NULL;
+                    goto cleanup;
+                }
+
+                pwd->len = len;
+                pwd->data = ngx_pnalloc(cf->temp_pool, len);
+
+                if (pwd->data == NULL) {
+                    passwords->nelts--;
+                    passwords = NULL;
+                    goto cleanup;
+                }
+
+                ngx_memcpy(pwd->data, p, len);
+            }
+
+            p = last;
+        }
+
+        len = end - p;
+
+        if (len == NGX_SSL_PASSWORD_BUFFER_SIZE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "too long line in \"%s\"", file->data);
+            passwords = NULL;
+            goto cleanup;
+        }
+
+        ngx_memmove(buf, p, len);
+        last = buf + len;
+
+    } while (n != 0);
+
+    if (passwords->nelts == 0) {
+        pwd = ngx_array_push(passwords);
+        if (pwd == NULL) {
+            passwords = NULL;
+            goto cleanup;
+        }
+
+        ngx_memzero(pwd, sizeof(ngx_str_t));
+    }
+
+cleanup:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", file->data);
+    }
+
+    ngx_memzero(buf, NGX_SSL_PASSWORD_BUFFER_SIZE);
+
+    return passwords;
+}
+
+
+static void
+ngx_ssl_passwords_cleanup(void *data)
+{
+    ngx_array_t *passwords = data;
+
+    ngx_str_t   *pwd;
+    ngx_uint_t   i;
+
+    pwd = passwords->elts;
+
+    for (i = 0; i < passwords->nelts; i++) {
+        ngx_memzero(pwd[i].data, pwd[i].len);
+    }
+}
+
+
+ngx_int_t
+ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
+{
+    DH   *dh;
+    BIO  *bio;
+
+    if (file->len == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    bio = BIO_new_file((char *) file->data, "r");
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "BIO_new_file(\"%s\") failed", file->data);
+        return NGX_ERROR;
+    }
+
+    dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+    if (dh == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "PEM_read_bio_DHparams(\"%s\") failed", file->data);
+        BIO_free(bio);
+        return NGX_ERROR;
+    }
+
+    SSL_CTX_set_tmp_dh(ssl->ctx, dh);
+
+    DH_free(dh);
+    BIO_free(bio);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
+#ifndef OPENSSL_NO_ECDH
+
+    /*
+     * Elliptic-Curve Diffie-Hellman parameters are either "named curves"
+     * from RFC 4492 section 5.1.1, or explicitly described curves over
+     * binary fields.  OpenSSL only supports the "named curves", which provide
+     * maximum interoperability.
+     */
+
+#ifdef SSL_CTRL_SET_CURVES_LIST
+
+    /*
+     * OpenSSL 1.0.2+ allows configuring a curve list instead of a single
+     * curve previously supported.  By default an internal list is used,
+     * with prime256v1 being preferred by server in OpenSSL 1.0.2b+
+     * and X25519 in OpenSSL 1.1.0+.
+     *
+     * By default a curve preferred by the client will be used for
+     * key exchange.  The SSL_OP_CIPHER_SERVER_PREFERENCE option can
+     * be used to prefer server curves instead, similar to what it
+     * does for ciphers.
+     */
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_SINGLE_ECDH_USE);
+
+#if SSL_CTRL_SET_ECDH_AUTO
+    /* not needed in OpenSSL 1.1.0+ */
+    SSL_CTX_set_ecdh_auto(ssl->ctx, 1);
+#endif
+
+    if (ngx_strcmp(name->data, "auto") == 0) {
+        return NGX_OK;
+    }
+
+    if (SSL_CTX_set1_curves_list(ssl->ctx, (char *) name->data) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set1_curves_list(\"%s\") failed", name->data);
+        return NGX_ERROR;
+    }
+
+#else
+
+    int      nid;
+    char    *curve;
+    EC_KEY  *ecdh;
+
+    if (ngx_strcmp(name->data, "auto") == 0) {
+        curve = "prime256v1";
+
+    } else {
+        curve = (char *) name->data;
+    }
+
+    nid = OBJ_sn2nid(curve);
+    if (nid == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "OBJ_sn2nid(\"%s\") failed: unknown curve", curve);
+        return NGX_ERROR;
+    }
+
+    ecdh = EC_KEY_new_by_curve_name(nid);
+    if (ecdh == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EC_KEY_new_by_curve_name(\"%s\") failed", curve);
+        return NGX_ERROR;
+    }
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_SINGLE_ECDH_USE);
+
+    SSL_CTX_set_tmp_ecdh(ssl->ctx, ecdh);
+
+    EC_KEY_free(ecdh);
+#endif
+#endif
+#endif
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_ssl_connection_t  *sc;
+
+    sc = ngx_pcalloc(c->pool, sizeof(ngx_ssl_connection_t));
+    if (sc == NULL) {
+        return NGX_ERROR;
+    }
+
+    sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
+    sc->buffer_size = ssl->buffer_size;
+    sc->dyn_rec_timeout = ssl->dyn_rec_timeout;
+
+    sc->session_ctx = ssl->ctx;
+
+    sc->connection = SSL_new(ssl->ctx);
+
+    if (sc->connection == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (SSL_set_fd(sc->connection, c->fd) == 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_fd() failed");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_SSL_CLIENT) {
+        SSL_set_connect_state(sc->connection);
+
+    } else {
+        SSL_set_accept_state(sc->connection);
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+        if (SSL_CTX_get_max_early_data(ssl->ctx)) {
+            sc->try_early_data = 1;
+        }
+#endif
+    }
+
+    if (SSL_set_ex_data(sc->connection, ngx_ssl_connection_index, c) == 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    c->ssl = sc;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_set_session(ngx_connection_t *c, ngx_ssl_session_t *session)
+{
+    if (session) {
+        if (SSL_set_session(c->ssl->connection, session) == 0) {
+            ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_session() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_handshake(ngx_connection_t *c)
+{
+    int        n, sslerr;
+    ngx_err_t  err;
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    if (c->ssl->try_early_data) {
+        return ngx_ssl_try_early_data(c);
+    }
+#endif
+
+    ngx_ssl_clear_error(c->log);
+
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = c;
+#endif
+
+    n = SSL_do_handshake(c->ssl->connection);
+
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = NULL;
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
+
+    if (n == 1) {
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_ssl_handshake_done(c);
+
+        c->ssl->handshaked = 1;
+
+        c->recv = ngx_ssl_recv;
+        c->send = ngx_ssl_write;
+        c->recv_chain = ngx_ssl_recv_chain;
+        c->send_chain = ngx_ssl_send_chain;
+
+        return NGX_OK;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+        c->read->ready = 0;
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
+        c->write->ready = 0;
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+#if (NGX_SSL_ASYNC)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        /* the read event is posted once the operation is complete */
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->read->eof = 1;
+
+    if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+        ngx_connection_error(c, err,
+                             "peer closed connection in SSL handshake");
+
+        return NGX_ERROR;
+    }
+
+    c->read->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_ssl_handshake_done(ngx_connection_t *c)
+{
+#if (NGX_SSL_ASYNC)
+    /* async jobs are only needed for private key operations */
+    SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+#endif
+
+#if (NGX_DEBUG)
+    {
+    char         buf[129], *s, *d;
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+    const
+#endif
+    SSL_CIPHER  *cipher;
+
+    cipher = SSL_get_current_cipher(c->ssl->connection);
+
+    if (cipher) {
+        SSL_CIPHER_description(cipher, &buf[1], 128);
+
+        for (s = &buf[1], d = buf; *s; s++) {
+            if (*s == ' ' && *d == ' ') {
+                continue;
+            }
+
+            if (*s == LF || *s == CR) {
+                continue;
+            }
+
+            *++d = *s;
+        }
+
+        if (*d != ' ') {
+            d++;
+        }
+
+        *d = '\0';
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL: %s, cipher: \"%s\"",
+                       SSL_get_version(c->ssl->connection), &buf[1]);
+
+        if (SSL_session_reused(c->ssl->connection)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "SSL reused session");
+        }
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL no shared ciphers");
+    }
+    }
+#endif
+
+#if (NGX_SSL_SENDFILE)
+
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL kernel TLS send enabled");
+        c->ssl->sendfile = 1;
+    }
+
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
+
+    /* initial handshake done, disable renegotiation (CVE-2009-3555) */
+    if (c->ssl->connection->s3) {
+        c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
+    }
+
+#endif
+#endif
+}
+
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+
+static ngx_int_t
+ngx_ssl_try_early_data(ngx_connection_t *c)
+{
+    int        n, sslerr;
+    u_char     buf;
+    size_t     readbytes;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    readbytes = 0;
+
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = c;
 #endif
 
+    n = SSL_read_early_data(c->ssl->connection, &buf, 1, &readbytes);
+
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = NULL;
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_read_early_data: %d, %uz", n, readbytes);
+
+    if (n == SSL_READ_EARLY_DATA_FINISH) {
+        c->ssl->try_early_data = 0;
+        return ngx_ssl_handshake(c);
+    }
+
+    if (n == SSL_READ_EARLY_DATA_SUCCESS) {
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL: %s, early data accepted",
+                       SSL_get_version(c->ssl->connection));
+
         c->ssl->handshaked = 1;
+        c->ssl->in_early = 1;
+
+        if (readbytes) {
+            c->ssl->early_buf = buf;
+            c->ssl->early_preread = 1;
+        }
 
         c->recv = ngx_ssl_recv;
         c->send = ngx_ssl_write;
         c->recv_chain = ngx_ssl_recv_chain;
         c->send_chain = ngx_ssl_send_chain;
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-#ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
-
-        /* initial handshake done, disable renegotiation (CVE-2009-3555) */
-        if (c->ssl->connection->s3) {
-            c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
-        }
-
-#endif
-#endif
+        c->read->ready = 1;
+        c->write->ready = 1;
 
         return NGX_OK;
     }
 
+    /* SSL_READ_EARLY_DATA_ERROR */
+
     sslerr = SSL_get_error(c->ssl->connection, n);
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
@@ -1328,6 +2182,19 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_ASYNC)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        /* the read event is posted once the operation is complete */
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -1343,11 +2210,13 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     c->read->error = 1;
 
-    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_read_early_data() failed");
 
     return NGX_ERROR;
 }
 
+#endif
+
 
 static void
 ngx_ssl_handshake_handler(ngx_event_t *ev)
@@ -1372,6 +2241,222 @@ ngx_ssl_handshake_handler(ngx_event_t *ev)
 }
 
 
+#if (NGX_SSL_ASYNC)
+
+static int
+ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    ngx_ssl_async_t  async;
+
+    async.handler = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL());
+
+    return ngx_ssl_async_rsa(&async, flen, from, to, rsa, padding);
+}
+
+
+static int
+ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    ngx_ssl_async_t  async;
+
+    async.handler = RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL());
+
+    return ngx_ssl_async_rsa(&async, flen, from, to, rsa, padding);
+}
+
+
+static int
+ngx_ssl_async_rsa(ngx_ssl_async_t *op, int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    int                 ret;
+    size_t              size;
+    ngx_connection_t   *c;
+    ngx_ssl_async_t    *async;
+    ngx_thread_pool_t  *tp;
+    ngx_thread_task_t  *task;
+
+    c = ngx_ssl_async_connection;
+    tp = RSA_get_ex_data(rsa, ngx_ssl_async_index);
+
+    if (c == NULL || tp == NULL || ASYNC_get_current_job() == NULL) {
+        return op->handler(flen, from, to, rsa, padding);
+    }
+
+    size = RSA_size(rsa);
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t) + sizeof(ngx_ssl_async_t)
+                      + flen + size, c->log);
+    if (task == NULL) {
+        return op->handler(flen, from, to, rsa, padding);
+    }
+
+    /*
+     * the operation works on its own copies of the input and output
+     * buffers, so the connection may be closed while it is in progress
+     */
+
+    async = (ngx_ssl_async_t *) (task + 1);
+
+    async->connection = c;
+    async->ssl_conn = c->ssl->connection;
+    async->handler = op->handler;
+    async->rsa = rsa;
+    async->flen = flen;
+    async->padding = padding;
+    async->from = (u_char *) (async + 1);
+    async->to = async->from + flen;
+
+    ngx_memcpy(async->from, from, flen);
+
+    task->ctx = async;
+    task->handler = ngx_ssl_async_thread_handler;
+    task->event.data = async;
+    task->event.handler = ngx_ssl_async_event_handler;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        ngx_free(task);
+        return op->handler(flen, from, to, rsa, padding);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL async RSA operation, task #%ui", task->id);
+
+    c->ssl->async = async;
+
+    while (!async->done) {
+
+        /*
+         * the job may be resumed by other events on the connection
+         * before the operation is complete; ngx_ssl_handshake() sets
+         * ngx_ssl_async_connection again when it resumes the job
+         */
+
+        ngx_ssl_async_connection = NULL;
+
+        (void) ASYNC_pause_job();
+
+        if (!async->done && ngx_ssl_async_connection == NULL) {
+
+            /* pausing is blocked, leave the task to the event handler */
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "SSL async RSA operation not paused");
+
+            c->ssl->async = NULL;
+            async->connection = NULL;
+            async->orphan = 1;
+
+            return op->handler(flen, from, to, rsa, padding);
+        }
+    }
+
+    c = async->connection;
+
+    if (c) {
+        c->ssl->async = NULL;
+        ret = async->ret;
+
+    } else {
+        /* the connection was closed, fail the handshake */
+        ret = -1;
+    }
+
+    if (ret > 0) {
+        ngx_memcpy(to, async->to, ret);
+    }
+
+    ngx_free(task);
+
+    return ret;
+}
+
+
+static void
+ngx_ssl_async_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_async_t *async = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "SSL async RSA thread handler");
+
+    async->ret = async->handler(async->flen, async->from, async->to,
+                                async->rsa, async->padding);
+
+    ERR_clear_error();
+}
+
+
+static void
+ngx_ssl_async_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+    ngx_ssl_async_t   *async;
+
+    async = ev->data;
+
+    if (async->orphan) {
+        ngx_free((ngx_thread_task_t *) async - 1);
+        return;
+    }
+
+    async->done = 1;
+
+    c = async->connection;
+
+    if (c) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL async RSA operation done");
+
+        ngx_post_event(c->read, &ngx_posted_events);
+        return;
+    }
+
+    ngx_ssl_async_free_connection(async->ssl_conn);
+}
+
+
+static void
+ngx_ssl_async_free_connection(ngx_ssl_conn_t *ssl_conn)
+{
+    BIO  *bio;
+
+    /*
+     * the connection was closed while the operation was in progress:
+     * let the paused job fail without any I/O or references to
+     * the connection, and free the SSL object
+     */
+
+    bio = BIO_new(BIO_s_null());
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "BIO_new() failed");
+        return;
+    }
+
+    SSL_set_bio(ssl_conn, bio, bio);
+    SSL_set_info_callback(ssl_conn, ngx_ssl_async_info_callback);
+    SSL_set_ex_data(ssl_conn, ngx_ssl_connection_index, NULL);
+
+    (void) SSL_do_handshake(ssl_conn);
+
+    ERR_clear_error();
+
+    SSL_free(ssl_conn);
+}
+
+
+static void
+ngx_ssl_async_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
+    int ret)
+{
+    /* void */
+}
+
+#endif
+
+
 ssize_t
 ngx_ssl_recv_chain(ngx_connection_t *c, ngx_chain_t *cl, off_t limit)
 {
@@ -1436,6 +2521,12 @@ ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
 {
     int  n, bytes;
 
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    if (c->ssl->in_early) {
+        return ngx_ssl_recv_early(c, buf, size);
+    }
+#endif
+
     if (c->ssl->last == NGX_ERROR) {
         c->read->error = 1;
         return NGX_ERROR;
@@ -1458,30 +2549,153 @@ ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
 
     for ( ;; ) {
 
-        n = SSL_read(c->ssl->connection, buf, size);
+        n = SSL_read(c->ssl->connection, buf, size);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_read: %d", n);
+
+        if (n > 0) {
+            bytes += n;
+        }
+
+        c->ssl->last = ngx_ssl_handle_recv(c, n);
+
+        if (c->ssl->last == NGX_OK) {
+
+            size -= n;
+
+            if (size == 0) {
+                c->read->ready = 1;
+                return bytes;
+            }
+
+            buf += n;
+
+            continue;
+        }
+
+        if (bytes) {
+            if (c->ssl->last != NGX_AGAIN) {
+                c->read->ready = 1;
+            }
+
+            return bytes;
+        }
+
+        switch (c->ssl->last) {
+
+        case NGX_DONE:
+            c->read->ready = 0;
+            c->read->eof = 1;
+            return 0;
+
+        case NGX_ERROR:
+            c->read->error = 1;
+
+            /* fall through */
+
+        case NGX_AGAIN:
+            return c->ssl->last;
+        }
+    }
+}
+
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+
+static ssize_t
+ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    int     n, bytes;
+    size_t  readbytes;
+
+    if (c->ssl->last == NGX_ERROR) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (c->ssl->last == NGX_DONE) {
+        c->read->ready = 0;
+        c->read->eof = 1;
+        return 0;
+    }
+
+    bytes = 0;
+
+    ngx_ssl_clear_error(c->log);
+
+    if (c->ssl->early_preread) {
+
+        if (size == 0) {
+            c->read->ready = 0;
+            c->read->eof = 1;
+            return 0;
+        }
+
+        *buf = c->ssl->early_buf;
+
+        c->ssl->early_preread = 0;
+
+        bytes = 1;
+        size -= 1;
+        buf += 1;
+    }
+
+    if (c->ssl->write_blocked) {
+        return NGX_AGAIN;
+    }
+
+    /*
+     * SSL_read_early_data() may return data in parts, so try to read
+     * until SSL_read_early_data() would return no data
+     */
+
+    for ( ;; ) {
+
+        readbytes = 0;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_read: %d", n);
+        n = SSL_read_early_data(c->ssl->connection, buf, size, &readbytes);
 
-        if (n > 0) {
-            bytes += n;
-        }
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_read_early_data: %d, %uz", n, readbytes);
 
-        c->ssl->last = ngx_ssl_handle_recv(c, n);
+        if (n == SSL_READ_EARLY_DATA_SUCCESS) {
 
-        if (c->ssl->last == NGX_OK) {
+            c->ssl->last = ngx_ssl_handle_recv(c, 1);
 
-            size -= n;
+            bytes += readbytes;
+            size -= readbytes;
 
             if (size == 0) {
                 c->read->ready = 1;
                 return bytes;
             }
 
-            buf += n;
+            buf += readbytes;
 
             continue;
         }
 
+        if (n == SSL_READ_EARLY_DATA_FINISH) {
+
+            c->ssl->last = ngx_ssl_handle_recv(c, 1);
+            c->ssl->in_early = 0;
+
+            /* the handshake is completed along with the early data */
+
+            ngx_ssl_handshake_done(c);
+
+            if (bytes) {
+                c->read->ready = 1;
+                return bytes;
+            }
+
+            return ngx_ssl_recv(c, buf, size);
+        }
+
+        /* SSL_READ_EARLY_DATA_ERROR */
+
+        c->ssl->last = ngx_ssl_handle_recv(c, 0);
+
         if (bytes) {
             if (c->ssl->last != NGX_AGAIN) {
                 c->read->ready = 1;
@@ -1508,6 +2722,8 @@ ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
     }
 }
 
+#endif
+
 
 static ngx_int_t
 ngx_ssl_handle_recv(ngx_connection_t *c, int n)
@@ -1626,10 +2842,13 @@ ngx_ssl_write_handler(ngx_event_t *wev)
 ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    int          n;
-    ngx_uint_t   flush;
-    ssize_t      send, size;
-    ngx_buf_t   *buf;
+    int           n;
+    off_t         file_size;
+    u_char       *end;
+    ngx_uint_t    flush;
+    ssize_t       send, size;
+    ngx_buf_t    *buf;
+    ngx_chain_t  *cl;
 
     if (!c->ssl->buffer) {
 
@@ -1639,7 +2858,13 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
-            n = ngx_ssl_write(c, in->buf->pos, in->buf->last - in->buf->pos);
+            size = in->buf->last - in->buf->pos;
+
+            if (c->ssl->dyn_rec_timeout) {
+                size = ngx_min(size, (ssize_t) ngx_ssl_record_size(c));
+            }
+
+            n = ngx_ssl_write(c, in->buf->pos, size);
 
             if (n == NGX_ERROR) {
                 return NGX_CHAIN_ERROR;
@@ -1693,7 +2918,13 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     for ( ;; ) {
 
-        while (in && buf->last < buf->end && send < limit) {
+        end = buf->end;
+
+        if (c->ssl->dyn_rec_timeout) {
+            end = ngx_min(end, buf->start + ngx_ssl_record_size(c));
+        }
+
+        while (in && buf->last < end && send < limit) {
             if (in->buf->last_buf || in->buf->flush) {
                 flush = 1;
             }
@@ -1703,10 +2934,18 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+            if (in->buf->in_file && c->ssl->sendfile) {
+
+                /* flush the buffer, file data are sent with SSL_sendfile() */
+
+                flush = 1;
+                break;
+            }
+
             size = in->buf->last - in->buf->pos;
 
-            if (size > buf->end - buf->last) {
-                size = buf->end - buf->last;
+            if (size > end - buf->last) {
+                size = end - buf->last;
             }
 
             if (send + size > limit) {
@@ -1727,13 +2966,43 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             }
         }
 
-        if (!flush && send < limit && buf->last < buf->end) {
+        if (!flush && send < limit && buf->last < end) {
             break;
         }
 
         size = buf->last - buf->pos;
 
         if (size == 0) {
+
+            if (in && in->buf->in_file && c->ssl->sendfile && send < limit) {
+
+                /* coalesce the neighbouring file bufs */
+
+                cl = in;
+                file_size = ngx_chain_coalesce_file(&cl, limit - send);
+
+                n = ngx_ssl_sendfile(c, in->buf, (size_t) file_size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                in = ngx_chain_update_sent(in, n);
+
+                send += n;
+                flush = 0;
+
+                if (n < file_size) {
+                    break;
+                }
+
+                continue;
+            }
+
             buf->flush = 0;
             c->buffered &= ~NGX_SSL_BUFFERED;
             return in;
@@ -1778,12 +3047,49 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 }
 
 
+static size_t
+ngx_ssl_record_size(ngx_connection_t *c)
+{
+    size_t                 size;
+    ngx_ssl_connection_t  *sc;
+
+    sc = c->ssl;
+
+    if (sc->dyn_rec_records
+        && ngx_current_msec - sc->dyn_rec_last_write > sc->dyn_rec_timeout)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL dynamic records reset");
+
+        sc->dyn_rec_records = 0;
+    }
+
+    if (sc->dyn_rec_records < NGX_SSL_DYN_REC_THRESHOLD) {
+        size = NGX_SSL_DYN_REC_SIZE_LO;
+
+    } else if (sc->dyn_rec_records < 2 * NGX_SSL_DYN_REC_THRESHOLD) {
+        size = NGX_SSL_DYN_REC_SIZE_HI;
+
+    } else {
+        return sc->buffer_size;
+    }
+
+    return ngx_min(size, sc->buffer_size);
+}
+
+
 ssize_t
 ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 {
     int        n, sslerr;
     ngx_err_t  err;
 
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    if (c->ssl->in_early) {
+        return ngx_ssl_write_early(c, data, size);
+    }
+#endif
+
     ngx_ssl_clear_error(c->log);
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL to write: %uz", size);
@@ -1792,6 +3098,212 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_write: %d", n);
 
+    if (n > 0) {
+
+        c->ssl->dyn_rec_last_write = ngx_current_msec;
+        c->ssl->dyn_rec_records++;
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->sent += n;
+
+        return n;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "peer started SSL renegotiation");
+
+        c->read->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * we do not set the timer because there is already
+         * the write event timer
+         */
+
+        if (c->ssl->saved_read_handler == NULL) {
+            c->ssl->saved_read_handler = c->read->handler;
+            c->read->handler = ngx_ssl_read_handler;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_write() failed");
+
+    return NGX_ERROR;
+}
+
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+
+static ssize_t
+ngx_ssl_write_early(ngx_connection_t *c, u_char *data, size_t size)
+{
+    int        n, sslerr;
+    size_t     written;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL to write: %uz", size);
+
+    written = 0;
+
+    n = SSL_write_early_data(c->ssl->connection, data, size, &written);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_write_early_data: %d, %uz", n, written);
+
+    if (n > 0) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        if (c->ssl->write_blocked) {
+            c->ssl->write_blocked = 0;
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->sent += written;
+
+        return written;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_write_early_data: want write");
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        /*
+         * OpenSSL fails to handle SSL_read_early_data()
+         * if an SSL_write_early_data() call blocked on writing,
+         * so reading is suspended until the write completes
+         */
+
+        c->ssl->write_blocked = 1;
+
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_write_early_data: want read");
+
+        c->read->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * we do not set the timer because there is already
+         * the write event timer
+         */
+
+        if (c->ssl->saved_read_handler == NULL) {
+            c->ssl->saved_read_handler = c->read->handler;
+            c->read->handler = ngx_ssl_read_handler;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_write_early_data() failed");
+
+    return NGX_ERROR;
+}
+
+#endif
+
+
+static ssize_t
+ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file, size_t size)
+{
+#if (NGX_SSL_SENDFILE)
+
+    int            sslerr;
+    ngx_err_t      err;
+    ossl_ssize_t   n;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL to sendfile: @%O %uz", file->file_pos, size);
+
+    ngx_set_errno(0);
+
+    n = SSL_sendfile(c->ssl->connection, file->file->fd, file->file_pos,
+                     size, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_sendfile: %z", n);
+
     if (n > 0) {
 
         if (c->ssl->saved_read_handler) {
@@ -1812,8 +3324,33 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
         return n;
     }
 
+    if (n == 0) {
+
+        /*
+         * if sendfile returns zero, then someone has truncated the file,
+         * so the offset became beyond the end of the file
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_sendfile() reported that \"%s\" was truncated at %O",
+                      file->file->name.data, file->file_pos);
+
+        return NGX_ERROR;
+    }
+
     sslerr = SSL_get_error(c->ssl->connection, n);
 
+    if (sslerr == SSL_ERROR_ZERO_RETURN) {
+
+        /*
+         * OpenSSL fails to return SSL_ERROR_SYSCALL if an error
+         * happens during writing after close_notify alert from the
+         * peer, and returns SSL_ERROR_ZERO_RETURN instead
+         */
+
+        sslerr = SSL_ERROR_SYSCALL;
+    }
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
@@ -1851,7 +3388,13 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
     c->ssl->no_send_shutdown = 1;
     c->write->error = 1;
 
-    ngx_ssl_connection_error(c, sslerr, err, "SSL_write() failed");
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_sendfile() failed");
+
+#else
+
+    ngx_log_error(NGX_LOG_ALERT, c->log, 0, "SSL_sendfile() not available");
+
+#endif
 
     return NGX_ERROR;
 }
@@ -1885,6 +3428,28 @@ ngx_ssl_shutdown(ngx_connection_t *c)
     int        n, sslerr, mode;
     ngx_err_t  err;
 
+#if (NGX_SSL_ASYNC)
+
+    if (c->ssl->async) {
+
+        /*
+         * a private key operation is in progress, the SSL object
+         * is freed once it is complete
+         */
+
+        c->ssl->async->connection = NULL;
+
+        if (c->ssl->async->done) {
+            ngx_ssl_async_free_connection(c->ssl->connection);
+        }
+
+        c->ssl = NULL;
+
+        return NGX_OK;
+    }
+
+#endif
+
     if (SSL_in_init(c->ssl->connection)) {
         /*
          * OpenSSL 1.0.2f complains if SSL_shutdown() is called during
@@ -2114,293 +3679,696 @@ ngx_ssl_connection_error(ngx_connection_t *c, int sslerr, ngx_err_t err,
                 level = NGX_LOG_ERR;
                 break;
 
-            default:
-                break;
-            }
-        }
+            default:
+                break;
+            }
+        }
+    }
+
+    ngx_ssl_error(level, c->log, err, text);
+}
+
+
+static void
+ngx_ssl_clear_error(ngx_log_t *log)
+{
+    while (ERR_peek_error()) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "ignoring stale global SSL error");
+    }
+
+    ERR_clear_error();
+}
+
+
+void ngx_cdecl
+ngx_ssl_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, char *fmt, ...)
+{
+    int          flags;
+    u_long       n;
+    va_list      args;
+    u_char      *p, *last;
+    u_char       errstr[NGX_MAX_CONF_ERRSTR];
+    const char  *data;
+
+    last = errstr + NGX_MAX_CONF_ERRSTR;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(errstr, last - 1, fmt, args);
+    va_end(args);
+
+    p = ngx_cpystrn(p, (u_char *) " (SSL:", last - p);
+
+    for ( ;; ) {
+
+        n = ERR_peek_error_line_data(NULL, NULL, &data, &flags);
+
+        if (n == 0) {
+            break;
+        }
+
+        /* ERR_error_string_n() requires at least one byte */
+
+        if (p >= last - 1) {
+            goto next;
+        }
+
+        *p++ = ' ';
+
+        ERR_error_string_n(n, (char *) p, last - p);
+
+        while (p < last && *p) {
+            p++;
+        }
+
+        if (p < last && *data && (flags & ERR_TXT_STRING)) {
+            *p++ = ':';
+            p = ngx_cpystrn(p, (u_char *) data, last - p);
+        }
+
+    next:
+
+        (void) ERR_get_error();
+    }
+
+    ngx_log_error(level, log, err, "%*s)", p - errstr, errstr);
+}
+
+
+ngx_int_t
+ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
+    ssize_t builtin_session_cache, ngx_shm_zone_t *shm_zone, time_t timeout)
+{
+    long  cache_mode;
+
+    SSL_CTX_set_timeout(ssl->ctx, (long) timeout);
+
+    if (ngx_ssl_session_id_context(ssl, sess_ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (builtin_session_cache == NGX_SSL_NO_SCACHE) {
+        SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_OFF);
+        return NGX_OK;
+    }
+
+    if (builtin_session_cache == NGX_SSL_NONE_SCACHE) {
+
+        /*
+         * If the server explicitly says that it does not support
+         * session reuse (see SSL_SESS_CACHE_OFF above), then
+         * Outlook Express fails to upload a sent email to
+         * the Sent Items folder on the IMAP server via a separate IMAP
+         * connection in the background.  Therefore we have a special
+         * mode (SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL_STORE)
+         * where the server pretends that it supports session reuse,
+         * but it does not actually store any session.
+         */
+
+        SSL_CTX_set_session_cache_mode(ssl->ctx,
+                                       SSL_SESS_CACHE_SERVER
+                                       |SSL_SESS_CACHE_NO_AUTO_CLEAR
+                                       |SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+        SSL_CTX_sess_set_cache_size(ssl->ctx, 1);
+
+        return NGX_OK;
+    }
+
+    cache_mode = SSL_SESS_CACHE_SERVER;
+
+    if (shm_zone && builtin_session_cache == NGX_SSL_NO_BUILTIN_SCACHE) {
+        cache_mode |= SSL_SESS_CACHE_NO_INTERNAL;
+    }
+
+    SSL_CTX_set_session_cache_mode(ssl->ctx, cache_mode);
+
+    if (builtin_session_cache != NGX_SSL_NO_BUILTIN_SCACHE) {
+
+        if (builtin_session_cache != NGX_SSL_DFLT_BUILTIN_SCACHE) {
+            SSL_CTX_sess_set_cache_size(ssl->ctx, builtin_session_cache);
+        }
+    }
+
+    if (shm_zone) {
+        SSL_CTX_sess_set_new_cb(ssl->ctx, ngx_ssl_new_session);
+        SSL_CTX_sess_set_get_cb(ssl->ctx, ngx_ssl_get_cached_session);
+        SSL_CTX_sess_set_remove_cb(ssl->ctx, ngx_ssl_remove_session);
+
+        if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_cache_index, shm_zone)
+            == 0)
+        {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_set_ex_data() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
+{
+    int                   n, i;
+    X509                 *cert;
+    X509_NAME            *name;
+    EVP_MD_CTX           *md;
+    unsigned int          len;
+    STACK_OF(X509_NAME)  *list;
+    u_char                buf[EVP_MAX_MD_SIZE];
+
+    /*
+     * Session ID context is set based on the string provided,
+     * the server certificates, and the client CA list.
+     */
+
+    md = EVP_MD_CTX_create();
+    if (md == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (EVP_DigestInit_ex(md, EVP_sha1(), NULL) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EVP_DigestInit_ex() failed");
+        goto failed;
+    }
+
+    if (EVP_DigestUpdate(md, sess_ctx->data, sess_ctx->len) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EVP_DigestUpdate() failed");
+        goto failed;
+    }
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        if (X509_digest(cert, EVP_sha1(), buf, &len) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "X509_digest() failed");
+            goto failed;
+        }
+
+        if (EVP_DigestUpdate(md, buf, len) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "EVP_DigestUpdate() failed");
+            goto failed;
+        }
+    }
+
+    list = SSL_CTX_get_client_CA_list(ssl->ctx);
+
+    if (list != NULL) {
+        n = sk_X509_NAME_num(list);
+
+        for (i = 0; i < n; i++) {
+            name = sk_X509_NAME_value(list, i);
+
+            if (X509_NAME_digest(name, EVP_sha1(), buf, &len) == 0) {
+                ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                              "X509_NAME_digest() failed");
+                goto failed;
+            }
+
+            if (EVP_DigestUpdate(md, buf, len) == 0) {
+                ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                              "EVP_DigestUpdate() failed");
+                goto failed;
+            }
+        }
+    }
+
+    if (EVP_DigestFinal_ex(md, buf, &len) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EVP_DigestUpdate() failed");
+        goto failed;
+    }
+
+    EVP_MD_CTX_destroy(md);
+
+    if (SSL_CTX_set_session_id_context(ssl->ctx, buf, len) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_session_id_context() failed");
+        return NGX_ERROR;
     }
 
-    ngx_ssl_error(level, c->log, err, text);
+    return NGX_OK;
+
+failed:
+
+    EVP_MD_CTX_destroy(md);
+
+    return NGX_ERROR;
 }
 
 
-static void
-ngx_ssl_clear_error(ngx_log_t *log)
+ngx_int_t
+ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    while (ERR_peek_error()) {
-        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "ignoring stale global SSL error");
+    size_t                    len, size;
+    ngx_uint_t                i, n;
+    ngx_slab_pool_t          *shpool, *sp;
+    ngx_ssl_session_shard_t  *shard;
+    ngx_ssl_session_cache_t  *cache;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
     }
 
-    ERR_clear_error();
-}
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
 
-void ngx_cdecl
-ngx_ssl_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, char *fmt, ...)
-{
-    int          flags;
-    u_long       n;
-    va_list      args;
-    u_char      *p, *last;
-    u_char       errstr[NGX_MAX_CONF_ERRSTR];
-    const char  *data;
+    cache = ngx_slab_calloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
 
-    last = errstr + NGX_MAX_CONF_ERRSTR;
+    shpool->data = cache;
+    shm_zone->data = cache;
 
-    va_start(args, fmt);
-    p = ngx_vslprintf(errstr, last - 1, fmt, args);
-    va_end(args);
+    len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
-    p = ngx_cpystrn(p, (u_char *) " (SSL:", last - p);
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-    for ( ;; ) {
+    ngx_sprintf(shpool->log_ctx, " in SSL session shared cache \"%V\"%Z",
+                &shm_zone->shm.name);
 
-        n = ERR_peek_error_line_data(NULL, NULL, &data, &flags);
+    shpool->log_nomem = 0;
 
-        if (n == 0) {
-            break;
-        }
+    /*
+     * the zone is split into shards selected by a session id hash,
+     * each shard is a separate slab pool with its own mutex, rbtree,
+     * and expire queue; without atomic operations a mutex needs a lock
+     * file, so the zone's own pool is used as the only shard
+     */
 
-        /* ERR_error_string_n() requires at least one byte */
+#if (NGX_HAVE_ATOMIC_OPS)
+    n = NGX_SSL_SESSION_CACHE_SHARDS;
+#else
+    n = 1;
+#endif
 
-        if (p >= last - 1) {
-            goto next;
-        }
+    while (n > 1 && shpool->pfree / n < NGX_SSL_SESSION_SHARD_PAGES) {
+        n /= 2;
+    }
 
-        *p++ = ' ';
+    cache->shards = ngx_slab_calloc(shpool,
+                                    n * sizeof(ngx_ssl_session_shard_t));
+    if (cache->shards == NULL) {
+        return NGX_ERROR;
+    }
 
-        ERR_error_string_n(n, (char *) p, last - p);
+    cache->nshards = n;
 
-        while (p < last && *p) {
-            p++;
-        }
+    size = (shpool->pfree / n) * ngx_pagesize;
 
-        if (p < last && *data && (flags & ERR_TXT_STRING)) {
-            *p++ = ':';
-            p = ngx_cpystrn(p, (u_char *) data, last - p);
+    for (i = 0; i < n; i++) {
+        shard = &cache->shards[i];
+
+        if (n == 1) {
+            sp = shpool;
+
+        } else {
+            sp = ngx_slab_alloc(shpool, size);
+            if (sp == NULL) {
+                return NGX_ERROR;
+            }
+
+            sp->end = (u_char *) sp + size;
+            sp->min_shift = 3;
+            sp->addr = sp;
+
+            if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_slab_init(sp);
+
+            sp->log_ctx = shpool->log_ctx;
+            sp->log_nomem = 0;
         }
 
-    next:
+        shard->shpool = sp;
 
-        (void) ERR_get_error();
+        ngx_rbtree_init(&shard->session_rbtree, &shard->sentinel,
+                        ngx_ssl_session_rbtree_insert_value);
+
+        ngx_queue_init(&shard->expire_queue);
     }
 
-    ngx_log_error(level, log, err, "%*s)", p - errstr, errstr);
+    return NGX_OK;
 }
 
 
+/*
+ * a snapshot of the session cache consists of an identification string,
+ * the shared ticket keys, and the sessions of all shards in the order of
+ * the trees, each saved as ngx_ssl_session_record_t followed by the
+ * session id and the external ASN1 representation; sessions which allow
+ * early data are not saved, as a session used after the snapshot would
+ * otherwise be restored and could be used again to replay early data
+ */
+
+typedef struct {
+    time_t                    expire;
+    uint32_t                  len;
+    uint32_t                  id_len;
+} ngx_ssl_session_record_t;
+
+
+static u_char  ngx_ssl_session_snapshot_id[] = "ssl_session_cache 2";
+
+
 ngx_int_t
-ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
-    ssize_t builtin_session_cache, ngx_shm_zone_t *shm_zone, time_t timeout)
+ngx_ssl_session_cache_save(ngx_shm_zone_t *shm_zone, ngx_shm_snapshot_t *ss)
 {
-    long  cache_mode;
+    u_char                        *buf, *p;
+    time_t                         now;
+    size_t                         len;
+    uint32_t                       n, hash;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_slab_pool_t               *shpool;
+    ngx_rbtree_node_t             *node;
+    ngx_ssl_sess_id_t             *sess_id;
+    ngx_ssl_session_shard_t       *shard;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_record_t       rec;
+    u_char                         sid[32];
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    ngx_ssl_session_ticket_key_t   keys[3];
+#endif
 
-    SSL_CTX_set_timeout(ssl->ctx, (long) timeout);
+    cache = shm_zone->data;
 
-    if (ngx_ssl_session_id_context(ssl, sess_ctx) != NGX_OK) {
+    if (ngx_shm_snapshot_write(ss, ngx_ssl_session_snapshot_id,
+                               sizeof(ngx_ssl_session_snapshot_id))
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    if (builtin_session_cache == NGX_SSL_NO_SCACHE) {
-        SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_OFF);
-        return NGX_OK;
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_memcpy(keys, cache->ticket_keys, sizeof(keys));
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    n = sizeof(keys);
+
+    rc = ngx_shm_snapshot_write(ss, &n, sizeof(uint32_t));
+
+    if (rc == NGX_OK) {
+        rc = ngx_shm_snapshot_write(ss, keys, sizeof(keys));
     }
 
-    if (builtin_session_cache == NGX_SSL_NONE_SCACHE) {
+    ngx_memzero(keys, sizeof(keys));
 
-        /*
-         * If the server explicitly says that it does not support
-         * session reuse (see SSL_SESS_CACHE_OFF above), then
-         * Outlook Express fails to upload a sent email to
-         * the Sent Items folder on the IMAP server via a separate IMAP
-         * connection in the background.  Therefore we have a special
-         * mode (SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL_STORE)
-         * where the server pretends that it supports session reuse,
-         * but it does not actually store any session.
-         */
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        SSL_CTX_set_session_cache_mode(ssl->ctx,
-                                       SSL_SESS_CACHE_SERVER
-                                       |SSL_SESS_CACHE_NO_AUTO_CLEAR
-                                       |SSL_SESS_CACHE_NO_INTERNAL_STORE);
+#else
 
-        SSL_CTX_sess_set_cache_size(ssl->ctx, 1);
+    n = 0;
 
-        return NGX_OK;
+    if (ngx_shm_snapshot_write(ss, &n, sizeof(uint32_t)) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    cache_mode = SSL_SESS_CACHE_SERVER;
+#endif
 
-    if (shm_zone && builtin_session_cache == NGX_SSL_NO_BUILTIN_SCACHE) {
-        cache_mode |= SSL_SESS_CACHE_NO_INTERNAL;
+    /*
+     * the sessions are copied in batches, each followed by the space for
+     * the largest record, and the id of the last session copied is kept
+     * to continue with the next session once the batch is written
+     */
+
+    buf = ngx_alloc(NGX_SHM_SNAPSHOT_BATCH + sizeof(ngx_ssl_session_record_t)
+                    + sizeof(sid) + NGX_SSL_MAX_SESSION_SIZE,
+                    ss->file.log);
+    if (buf == NULL) {
+        return NGX_ERROR;
     }
 
-    SSL_CTX_set_session_cache_mode(ssl->ctx, cache_mode);
+    now = ngx_time();
+    rc = NGX_OK;
 
-    if (builtin_session_cache != NGX_SSL_NO_BUILTIN_SCACHE) {
+    ngx_memzero(&rec, sizeof(ngx_ssl_session_record_t));
 
-        if (builtin_session_cache != NGX_SSL_DFLT_BUILTIN_SCACHE) {
-            SSL_CTX_sess_set_cache_size(ssl->ctx, builtin_session_cache);
-        }
+    for (i = 0; i < cache->nshards && rc == NGX_OK; i++) {
+        shard = &cache->shards[i];
+        shpool = shard->shpool;
+
+        /* ids are never empty, so the first session is greater than this */
+
+        hash = 0;
+        len = 0;
+
+        do {
+            p = buf;
+
+            ngx_shmtx_lock(&shpool->mutex);
+
+            node = ngx_ssl_session_lookup_next(&shard->session_rbtree, hash,
+                                               sid, len);
+
+            while (node && p - buf < NGX_SHM_SNAPSHOT_BATCH) {
+
+                sess_id = (ngx_ssl_sess_id_t *) node;
+
+                hash = (uint32_t) node->key;
+                len = node->data;
+
+                if (sess_id->expire > now && !sess_id->single_use) {
+                    rec.expire = sess_id->expire;
+                    rec.len = sess_id->len;
+                    rec.id_len = len;
+
+                    p = ngx_cpymem(p, &rec, sizeof(ngx_ssl_session_record_t));
+                    p = ngx_cpymem(p, sess_id->id, rec.id_len);
+                    p = ngx_cpymem(p, sess_id->session, rec.len);
+                }
+
+                node = ngx_rbtree_next(&shard->session_rbtree, node);
+
+                if (node == NULL || p - buf >= NGX_SHM_SNAPSHOT_BATCH) {
+                    ngx_memcpy(sid, sess_id->id, len);
+                }
+            }
+
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            rc = ngx_shm_snapshot_write(ss, buf, p - buf);
+
+        } while (rc == NGX_OK && node);
     }
 
-    if (shm_zone) {
-        SSL_CTX_sess_set_new_cb(ssl->ctx, ngx_ssl_new_session);
-        SSL_CTX_sess_set_get_cb(ssl->ctx, ngx_ssl_get_cached_session);
-        SSL_CTX_sess_set_remove_cb(ssl->ctx, ngx_ssl_remove_session);
+    ngx_free(buf);
 
-        if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_cache_index, shm_zone)
-            == 0)
-        {
-            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                          "SSL_CTX_set_ex_data() failed");
-            return NGX_ERROR;
+    return rc;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_ssl_session_lookup_next(ngx_rbtree_t *rbtree, uint32_t hash, u_char *id,
+    size_t len)
+{
+    ngx_int_t           rc;
+    ngx_rbtree_node_t  *node, *sentinel, *next;
+    ngx_ssl_sess_id_t  *sess_id;
+
+    /* the first session greater than the given one */
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+    next = NULL;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            next = node;
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sess_id = (ngx_ssl_sess_id_t *) node;
+
+        rc = ngx_memn2cmp(id, sess_id->id, len, (size_t) node->data);
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+            continue;
         }
+
+        node = node->right;
     }
 
-    return NGX_OK;
+    return next;
 }
 
 
-static ngx_int_t
-ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
+ngx_int_t
+ngx_ssl_session_cache_restore(ngx_shm_zone_t *shm_zone, ngx_shm_snapshot_t *ss)
 {
-    int                   n, i;
-    X509                 *cert;
-    X509_NAME            *name;
-    EVP_MD_CTX           *md;
-    unsigned int          len;
-    STACK_OF(X509_NAME)  *list;
-    u_char                buf[EVP_MAX_MD_SIZE];
+    u_char                        *id, *cached_sess;
+    time_t                         now;
+    uint32_t                       n, hash;
+    ngx_int_t                      rc;
+    ngx_uint_t                     restored, dropped;
+    ngx_slab_pool_t               *shpool;
+    ngx_ssl_sess_id_t             *sess_id;
+    ngx_ssl_session_shard_t       *shard;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_record_t       rec;
+    u_char                         sid[32];
+    u_char                         buf[NGX_SSL_MAX_SESSION_SIZE];
 
-    /*
-     * Session ID context is set based on the string provided,
-     * the server certificates, and the client CA list.
-     */
+    cache = shm_zone->data;
 
-    md = EVP_MD_CTX_create();
-    if (md == NULL) {
+    if (ngx_shm_snapshot_read(ss, buf, sizeof(ngx_ssl_session_snapshot_id))
+        != NGX_OK
+        || ngx_memcmp(buf, ngx_ssl_session_snapshot_id,
+                      sizeof(ngx_ssl_session_snapshot_id))
+           != 0)
+    {
         return NGX_ERROR;
     }
 
-    if (EVP_DigestInit_ex(md, EVP_sha1(), NULL) == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "EVP_DigestInit_ex() failed");
-        goto failed;
+    if (ngx_shm_snapshot_read(ss, &n, sizeof(uint32_t)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+
+    if (n == sizeof(cache->ticket_keys)) {
+        rc = ngx_shm_snapshot_read(ss, cache->ticket_keys, n);
+        n = 0;
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
-    if (EVP_DigestUpdate(md, sess_ctx->data, sess_ctx->len) == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "EVP_DigestUpdate() failed");
-        goto failed;
+#endif
+
+    if (n) {
+        /* ticket keys of a different layout */
+        return NGX_ERROR;
     }
 
-    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
-         cert;
-         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
-    {
-        if (X509_digest(cert, EVP_sha1(), buf, &len) == 0) {
-            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                          "X509_digest() failed");
-            goto failed;
-        }
+    now = ngx_time();
+    restored = 0;
+    dropped = 0;
 
-        if (EVP_DigestUpdate(md, buf, len) == 0) {
-            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                          "EVP_DigestUpdate() failed");
-            goto failed;
-        }
-    }
+    for ( ;; ) {
 
-    list = SSL_CTX_get_client_CA_list(ssl->ctx);
+        rc = ngx_shm_snapshot_read(ss, &rec, sizeof(ngx_ssl_session_record_t));
 
-    if (list != NULL) {
-        n = sk_X509_NAME_num(list);
+        if (rc == NGX_DONE) {
+            break;
+        }
 
-        for (i = 0; i < n; i++) {
-            name = sk_X509_NAME_value(list, i);
+        if (rc != NGX_OK
+            || rec.id_len == 0
+            || rec.id_len > sizeof(sid)
+            || rec.len > NGX_SSL_MAX_SESSION_SIZE)
+        {
+            return NGX_ERROR;
+        }
 
-            if (X509_NAME_digest(name, EVP_sha1(), buf, &len) == 0) {
-                ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                              "X509_NAME_digest() failed");
-                goto failed;
-            }
+        if (ngx_shm_snapshot_read(ss, sid, rec.id_len) != NGX_OK
+            || ngx_shm_snapshot_read(ss, buf, rec.len) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
 
-            if (EVP_DigestUpdate(md, buf, len) == 0) {
-                ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                              "EVP_DigestUpdate() failed");
-                goto failed;
-            }
+        if (rec.expire <= now) {
+            continue;
         }
-    }
 
-    if (EVP_DigestFinal_ex(md, buf, &len) == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "EVP_DigestUpdate() failed");
-        goto failed;
-    }
+        hash = ngx_crc32_short(sid, rec.id_len);
 
-    EVP_MD_CTX_destroy(md);
+        shard = &cache->shards[hash % cache->nshards];
+        shpool = shard->shpool;
 
-    if (SSL_CTX_set_session_id_context(ssl->ctx, buf, len) == 0) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set_session_id_context() failed");
-        return NGX_ERROR;
-    }
+        ngx_shmtx_lock(&shpool->mutex);
 
-    return NGX_OK;
+        cached_sess = ngx_slab_alloc_locked(shpool, rec.len);
+        sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
 
-failed:
+#if (NGX_PTR_SIZE == 8)
+        id = sess_id ? sess_id->sess_id : NULL;
+#else
+        id = ngx_slab_alloc_locked(shpool, rec.id_len);
+#endif
 
-    EVP_MD_CTX_destroy(md);
+        if (cached_sess == NULL || sess_id == NULL || id == NULL) {
 
-    return NGX_ERROR;
-}
+            /* the shard is full, the zone is probably smaller now */
 
+            if (cached_sess) {
+                ngx_slab_free_locked(shpool, cached_sess);
+            }
 
-ngx_int_t
-ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
-{
-    size_t                    len;
-    ngx_slab_pool_t          *shpool;
-    ngx_ssl_session_cache_t  *cache;
+            if (sess_id) {
+                ngx_slab_free_locked(shpool, sess_id);
+            }
 
-    if (data) {
-        shm_zone->data = data;
-        return NGX_OK;
-    }
+#if (NGX_PTR_SIZE == 4)
+            if (id) {
+                ngx_slab_free_locked(shpool, id);
+            }
+#endif
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+            ngx_shmtx_unlock(&shpool->mutex);
 
-    if (shm_zone->shm.exists) {
-        shm_zone->data = shpool->data;
-        return NGX_OK;
-    }
+            dropped++;
+            continue;
+        }
 
-    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
-    if (cache == NULL) {
-        return NGX_ERROR;
-    }
+        ngx_memcpy(cached_sess, buf, rec.len);
+        ngx_memcpy(id, sid, rec.id_len);
 
-    shpool->data = cache;
-    shm_zone->data = cache;
+        sess_id->node.key = hash;
+        sess_id->node.data = (u_char) rec.id_len;
+        sess_id->id = id;
+        sess_id->len = rec.len;
+        sess_id->session = cached_sess;
+        sess_id->expire = rec.expire;
+        sess_id->single_use = 0;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
+        ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
 
-    ngx_queue_init(&cache->expire_queue);
+        ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
-    len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
+        ngx_shmtx_unlock(&shpool->mutex);
 
-    shpool->log_ctx = ngx_slab_alloc(shpool, len);
-    if (shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+        restored++;
     }
 
-    ngx_sprintf(shpool->log_ctx, " in SSL session shared cache \"%V\"%Z",
-                &shm_zone->shm.name);
-
-    shpool->log_nomem = 0;
+    ngx_log_error(NGX_LOG_INFO, ss->file.log, 0,
+                  "%ui SSL sessions restored, %ui dropped in \"%V\"",
+                  restored, dropped, &shm_zone->shm.name);
 
     return NGX_OK;
 }
@@ -2420,7 +4388,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * and an ASN1 representation, they take accordingly 128 and 128 bytes.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
- * so they are outside the code locked by shared pool mutex
+ * so they are outside the code locked by shard pool mutex
  */
 
 static int
@@ -2435,6 +4403,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -2455,12 +4424,27 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
+
+    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+
+#else
+
+    session_id = sess->session_id;
+    session_id_length = sess->session_id_length;
+
+#endif
+
+    hash = ngx_crc32_short(session_id, session_id_length);
+
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
     /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    ngx_ssl_expire_sessions(shard, 1);
 
     cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2468,7 +4452,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2484,7 +4468,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
 
@@ -2493,17 +4477,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
         }
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
-
-    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
-
-#else
-
-    session_id = sess->session_id;
-    session_id_length = sess->session_id_length;
-
-#endif
-
 #if (NGX_PTR_SIZE == 8)
 
     id = sess_id->sess_id;
@@ -2516,7 +4489,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         id = ngx_slab_alloc_locked(shpool, session_id_length);
 
@@ -2531,8 +4504,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_memcpy(id, session_id, session_id_length);
 
-    hash = ngx_crc32_short(session_id, session_id_length);
-
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "ssl new session: %08XD:%ud:%d",
                    hash, session_id_length, len);
@@ -2545,9 +4516,16 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    sess_id->single_use = (SSL_version(ssl_conn) == TLS1_3_VERSION
+                           && SSL_get_max_early_data(ssl_conn) > 0);
+#else
+    sess_id->single_use = 0;
+#endif
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
+
+    ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -2590,6 +4568,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
     ngx_connection_t         *c;
@@ -2609,12 +4588,13 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
     sess = NULL;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2639,10 +4619,38 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
             if (sess_id->expire > ngx_time()) {
                 ngx_memcpy(buf, sess_id->session, sess_id->len);
+                p = buf;
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+
+                /*
+                 * a TLSv1.3 session which allows early data is used
+                 * only once: it is removed from the cache under the same
+                 * lock, so concurrent replays of a ticket in different
+                 * worker processes cannot both resume the session
+                 */
+
+                if (SSL_version(ssl_conn) == TLS1_3_VERSION
+                    && SSL_get_max_early_data(ssl_conn) > 0)
+                {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                                   "ssl get session: single use");
+
+                    ngx_queue_remove(&sess_id->queue);
+
+                    ngx_rbtree_delete(&shard->session_rbtree, node);
+
+                    ngx_slab_free_locked(shpool, sess_id->session);
+#if (NGX_PTR_SIZE == 4)
+                    ngx_slab_free_locked(shpool, sess_id->id);
+#endif
+                    ngx_slab_free_locked(shpool, sess_id);
+                }
+
+#endif
 
                 ngx_shmtx_unlock(&shpool->mutex);
 
-                p = buf;
                 sess = d2i_SSL_SESSION(NULL, &p, sess_id->len);
 
                 return sess;
@@ -2650,7 +4658,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2694,6 +4702,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_slab_pool_t          *shpool;
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -2720,12 +4729,13 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%ud", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2749,7 +4759,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2770,22 +4780,23 @@ done:
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard, ngx_uint_t n)
 {
     time_t              now;
     ngx_queue_t        *q;
+    ngx_slab_pool_t    *shpool;
     ngx_ssl_sess_id_t  *sess_id;
 
     now = ngx_time();
+    shpool = shard->shpool;
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&shard->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&shard->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
@@ -2798,7 +4809,7 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
         ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                        "expire session: %08Xi", sess_id->node.key);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        ngx_rbtree_delete(&shard->session_rbtree, &sess_id->node);
 
         ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2866,7 +4877,36 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
     ngx_ssl_session_ticket_key_t  *key;
 
     if (paths == NULL) {
-        return NGX_OK;
+
+        if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index) == NULL
+            || (SSL_CTX_get_options(ssl->ctx) & SSL_OP_NO_TICKET))
+        {
+            return NGX_OK;
+        }
+
+        /*
+         * with a shared session cache, keys are generated and rotated
+         * automatically in shared memory, see ngx_ssl_rotate_ticket_keys();
+         * the current and the previous keys are used by workers
+         */
+
+        keys = ngx_array_create(cf->pool, 2,
+                                sizeof(ngx_ssl_session_ticket_key_t));
+        if (keys == NULL) {
+            return NGX_ERROR;
+        }
+
+        key = ngx_array_push_n(keys, 2);
+        if (key == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(key, 2 * sizeof(ngx_ssl_session_ticket_key_t));
+
+        key[0].shared = 1;
+        key[1].shared = 1;
+
+        goto done;
     }
 
     keys = ngx_array_create(cf->pool, paths->nelts,
@@ -2925,6 +4965,8 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
             goto failed;
         }
 
+        ngx_memzero(key, sizeof(ngx_ssl_session_ticket_key_t));
+
         ngx_memcpy(key->name, buf, 16);
         ngx_memcpy(key->aes_key, buf + 16, 16);
         ngx_memcpy(key->hmac_key, buf + 32, 16);
@@ -2935,6 +4977,8 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
         }
     }
 
+done:
+
     if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_ticket_keys_index, keys)
         == 0)
     {
@@ -2993,6 +5037,10 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     digest = EVP_sha256();
 #endif
 
+    if (ngx_ssl_rotate_ticket_keys(ssl_ctx, c->log) != NGX_OK) {
+        return -1;
+    }
+
     keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
     if (keys == NULL) {
         return -1;
@@ -3073,6 +5121,130 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     }
 }
 
+
+static ngx_int_t
+ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
+{
+    time_t                         now, expire;
+    u_char                         buf[48];
+    ngx_array_t                   *keys;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_slab_pool_t               *shpool;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_ticket_key_t  *key;
+#if (NGX_DEBUG)
+    u_char                         dump[32];
+#endif
+
+    keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
+    if (keys == NULL) {
+        return NGX_OK;
+    }
+
+    key = keys->elts;
+
+    if (!key[0].shared) {
+        return NGX_OK;
+    }
+
+    /*
+     * shared memory is only synced if the current key expiration needs
+     * to be updated or the previous key is no longer needed; in the worst
+     * case another worker switches to the next key, and this worker is
+     * still able to decrypt tickets encrypted with it, as it is the
+     * current key here
+     */
+
+    now = ngx_time();
+    expire = now + SSL_CTX_get_timeout(ssl_ctx);
+
+    if (key[0].expire >= expire && key[1].expire >= now) {
+        return NGX_OK;
+    }
+
+    shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    key = cache->ticket_keys;
+
+    if (key[0].expire == 0) {
+
+        /* initialize the current key */
+
+        if (RAND_bytes(buf, 48) != 1) {
+            ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+            ngx_shmtx_unlock(&shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        key[0].shared = 1;
+        key[0].expire = expire;
+
+        ngx_memcpy(key[0].name, buf, 16);
+        ngx_memcpy(key[0].aes_key, buf + 16, 16);
+        ngx_memcpy(key[0].hmac_key, buf + 32, 16);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl ticket key: \"%*s\"",
+                       ngx_hex_dump(dump, key[0].name, 16) - dump, dump);
+
+        /*
+         * copy the current key to the next key, as initialization of
+         * the previous key below replaces the current key with the next one
+         */
+
+        key[2] = key[0];
+    }
+
+    if (key[1].expire < now) {
+
+        /*
+         * if the previous key is no longer needed (or not initialized),
+         * replace it with the current key, replace the current key with
+         * the next key, and generate a new next key
+         */
+
+        key[1] = key[0];
+        key[0] = key[2];
+
+        if (RAND_bytes(buf, 48) != 1) {
+            ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+            ngx_shmtx_unlock(&shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        key[2].shared = 1;
+        key[2].expire = 0;
+
+        ngx_memcpy(key[2].name, buf, 16);
+        ngx_memcpy(key[2].aes_key, buf + 16, 16);
+        ngx_memcpy(key[2].hmac_key, buf + 32, 16);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl ticket key: \"%*s\"",
+                       ngx_hex_dump(dump, key[2].name, 16) - dump, dump);
+    }
+
+    /* update the current key expiration */
+
+    key[0].expire = expire;
+
+    /* sync the current and the previous keys to the worker memory */
+
+    ngx_memcpy(keys->elts, cache->ticket_keys,
+               2 * sizeof(ngx_ssl_session_ticket_key_t));
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_memzero(buf, 48);
+
+    return NGX_OK;
+}
+
 #else
 
 ngx_int_t
@@ -3495,6 +5667,21 @@ ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    s->len = 0;
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    if (!SSL_is_init_finished(c->ssl->connection)) {
+        ngx_str_set(s, "1");
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
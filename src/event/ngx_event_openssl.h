@@ -54,10 +54,52 @@
 #define ngx_ssl_conn_t          SSL
 
 
+#if (NGX_THREADS && defined SSL_MODE_ASYNC)
+#include <openssl/async.h>
+#define NGX_SSL_ASYNC  1
+#endif
+
+
+typedef struct ngx_ssl_async_s  ngx_ssl_async_t;
+
+
+typedef struct {
+    ngx_str_t                   path;
+
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+    ngx_queue_t                 negative_queue;
+
+    ngx_uint_t                  current;
+    ngx_uint_t                  negative;
+    ngx_uint_t                  max;
+    time_t                      valid;
+} ngx_ssl_cert_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_queue_t                 queue;
+
+    X509                       *cert;
+    STACK_OF(X509)             *chain;
+    EVP_PKEY                   *key;
+
+    time_t                      created;
+} ngx_ssl_cert_cache_node_t;
+
+
+#if (defined BIO_get_ktls_send && !NGX_WIN32)
+#define NGX_SSL_SENDFILE  1
+#endif
+
+
 struct ngx_ssl_s {
     SSL_CTX                    *ctx;
     ngx_log_t                  *log;
     size_t                      buffer_size;
+    ngx_msec_t                  dyn_rec_timeout;
 };
 
 
@@ -69,17 +111,32 @@ struct ngx_ssl_connection_s {
     ngx_buf_t                  *buf;
     size_t                      buffer_size;
 
+    ngx_msec_t                  dyn_rec_timeout;
+    ngx_msec_t                  dyn_rec_last_write;
+    ngx_uint_t                  dyn_rec_records;
+
     ngx_connection_handler_pt   handler;
 
     ngx_event_handler_pt        saved_read_handler;
     ngx_event_handler_pt        saved_write_handler;
 
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_t            *async;
+#endif
+
+    u_char                      early_buf;
+
     unsigned                    handshaked:1;
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    handshake_buffer_set:1;
+    unsigned                    sendfile:1;
+    unsigned                    try_early_data:1;
+    unsigned                    in_early:1;
+    unsigned                    early_preread:1;
+    unsigned                    write_blocked:1;
 };
 
 
@@ -100,18 +157,23 @@ struct ngx_ssl_sess_id_s {
     u_char                     *session;
     ngx_queue_t                 queue;
     time_t                      expire;
+    ngx_uint_t                  single_use;  /* unsigned  single_use:1; */
 #if (NGX_PTR_SIZE == 8)
-    void                       *stub;
     u_char                      sess_id[32];
 #endif
 };
 
 
+#define NGX_SSL_SESSION_CACHE_SHARDS  16
+#define NGX_SSL_SESSION_SHARD_PAGES   64
+
+
 typedef struct {
+    ngx_slab_pool_t            *shpool;
     ngx_rbtree_t                session_rbtree;
     ngx_rbtree_node_t           sentinel;
     ngx_queue_t                 expire_queue;
-} ngx_ssl_session_cache_t;
+} ngx_ssl_session_shard_t;
 
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
@@ -120,11 +182,22 @@ typedef struct {
     u_char                      name[16];
     u_char                      aes_key[16];
     u_char                      hmac_key[16];
+    time_t                      expire;
+    unsigned                    shared:1;
 } ngx_ssl_session_ticket_key_t;
 
 #endif
 
 
+typedef struct {
+    ngx_uint_t                  nshards;
+    ngx_ssl_session_shard_t    *shards;
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    ngx_ssl_session_ticket_key_t  ticket_keys[3];
+#endif
+} ngx_ssl_session_cache_t;
+
+
 #define NGX_SSL_SSLv2    0x0002
 #define NGX_SSL_SSLv3    0x0004
 #define NGX_SSL_TLSv1    0x0008
@@ -137,6 +210,16 @@ typedef struct {
 
 #define NGX_SSL_BUFSIZE  16384
 
+/*
+ * dynamic record sizing: the first records fit into a single TCP segment,
+ * the next ones into a few segments, and then records of ssl_buffer_size
+ * are used until the connection is idle for the dynamic records timeout
+ */
+
+#define NGX_SSL_DYN_REC_SIZE_LO    1369
+#define NGX_SSL_DYN_REC_SIZE_HI    4229
+#define NGX_SSL_DYN_REC_THRESHOLD  40
+
 
 ngx_int_t ngx_ssl_init(ngx_log_t *log);
 ngx_int_t ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data);
@@ -146,6 +229,14 @@ ngx_int_t ngx_ssl_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords);
 ngx_int_t ngx_ssl_ciphers(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *ciphers,
     ngx_uint_t prefer_server_ciphers);
+ngx_ssl_cert_cache_t *ngx_ssl_cert_cache_init(ngx_conf_t *cf, ngx_str_t *path,
+    ngx_uint_t max, time_t valid);
+ngx_int_t ngx_ssl_cert_cache_set(ngx_connection_t *c,
+    ngx_ssl_cert_cache_t *cache, ngx_str_t *name);
+ngx_int_t ngx_ssl_async(ngx_conf_t *cf, ngx_ssl_t *ssl);
+ngx_int_t ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl);
+ngx_int_t ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_uint_t enable);
 ngx_int_t ngx_ssl_client_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *cert, ngx_int_t depth);
 ngx_int_t ngx_ssl_trusted_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl,
@@ -155,6 +246,9 @@ ngx_int_t ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *file, ngx_str_t *responder, ngx_uint_t verify);
 ngx_int_t ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_resolver_t *resolver, ngx_msec_t resolver_timeout);
+ngx_int_t ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_str_t *name, size_t size);
+ngx_int_t ngx_ssl_stapling_init_worker(ngx_cycle_t *cycle);
 RSA *ngx_ssl_rsa512_key_callback(ngx_ssl_conn_t *ssl_conn, int is_export,
     int key_length);
 ngx_array_t *ngx_ssl_read_password_file(ngx_conf_t *cf, ngx_str_t *file);
@@ -165,6 +259,10 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_ssl_session_cache_save(ngx_shm_zone_t *shm_zone,
+    ngx_shm_snapshot_t *ss);
+ngx_int_t ngx_ssl_session_cache_restore(ngx_shm_zone_t *shm_zone,
+    ngx_shm_snapshot_t *ss);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
 
@@ -199,6 +297,8 @@ ngx_int_t ngx_ssl_get_session_id(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
 ngx_int_t ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_raw_certificate(ngx_connection_t *c, ngx_pool_t *pool,
@@ -14,6 +14,44 @@
 #if (!defined OPENSSL_NO_OCSP && defined SSL_CTRL_SET_TLSEXT_STATUS_REQ_CB)
 
 
+#define NGX_SSL_STAPLING_ID_LEN      20
+#define NGX_SSL_STAPLING_INTERVAL    1000
+#define NGX_SSL_STAPLING_CONCURRENCY 32
+#define NGX_SSL_STAPLING_EXPIRE      3600
+#define NGX_SSL_STAPLING_SWEEP       60
+
+
+typedef struct {
+    ngx_rbtree_node_t            node;
+    ngx_queue_t                  queue;
+    u_char                       id[NGX_SSL_STAPLING_ID_LEN];
+    time_t                       valid;
+    time_t                       refresh;
+    time_t                       expire;
+    size_t                       len;
+    u_char                      *data;
+} ngx_ssl_stapling_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_ssl_stapling_cache_sh_t;
+
+
+typedef struct {
+    ngx_ssl_stapling_cache_sh_t *sh;
+    ngx_slab_pool_t             *shpool;
+
+    ngx_array_t                  staples;
+    ngx_uint_t                   loading;
+    time_t                       sweep;
+
+    ngx_event_t                  event;
+} ngx_ssl_stapling_cache_t;
+
+
 typedef struct {
     ngx_str_t                    staple;
     ngx_msec_t                   timeout;
@@ -33,6 +71,10 @@ typedef struct {
 
     u_char                      *name;
 
+    ngx_ssl_stapling_cache_t    *cache;
+    uint32_t                     hash;
+    u_char                       id[NGX_SSL_STAPLING_ID_LEN];
+
     time_t                       valid;
     time_t                       refresh;
 
@@ -98,9 +140,25 @@ static ngx_int_t ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
 
 static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
     void *data);
+static int ngx_ssl_stapling_cached_status(ngx_connection_t *c,
+    ngx_ssl_conn_t *ssl_conn, ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx);
 
+static ngx_int_t ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_ssl_stapling_node_t *ngx_ssl_stapling_cache_lookup(
+    ngx_ssl_stapling_cache_t *cache, ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_cache_touch(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_cache_expire(ngx_ssl_stapling_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple,
+    u_char *data, size_t len, ngx_log_t *log);
+static void ngx_ssl_stapling_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static void ngx_ssl_stapling_refresh_handler(ngx_event_t *ev);
+
 static time_t ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time);
 
 static void ngx_ssl_stapling_cleanup(void *data);
@@ -494,6 +552,133 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+static ngx_uint_t  ngx_ssl_stapling_cache_tag;
+
+
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name,
+    size_t size)
+{
+    X509                      *cert;
+    u_char                     md[EVP_MAX_MD_SIZE];
+    unsigned int               len;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_ssl_stapling_t        *staple, **sp;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size,
+                                     &ngx_ssl_stapling_cache_tag);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache = shm_zone->data;
+
+    if (cache == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_stapling_cache_t));
+        if (cache == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_array_init(&cache->staples, cf->pool, 4,
+                           sizeof(ngx_ssl_stapling_t *))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        shm_zone->init = ngx_ssl_stapling_cache_init;
+        shm_zone->data = cache;
+    }
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+        if (staple == NULL || staple->host.len == 0) {
+            /* no responder or OCSP response from the file */
+            continue;
+        }
+
+        if (X509_digest(cert, EVP_sha1(), md, &len) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "X509_digest() failed");
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(staple->id, md, NGX_SSL_STAPLING_ID_LEN);
+
+        staple->hash = ngx_crc32_short(staple->id, NGX_SSL_STAPLING_ID_LEN);
+        staple->cache = cache;
+
+        sp = ngx_array_push(&cache->staples);
+        if (sp == NULL) {
+            return NGX_ERROR;
+        }
+
+        *sp = staple;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_list_part_t           *part;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    /* responses are fetched by the first worker process only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_ssl_stapling_cache_tag) {
+            continue;
+        }
+
+        cache = shm_zone[i].data;
+
+        if (cache->staples.nelts == 0 || cache->event.timer_set) {
+            continue;
+        }
+
+        cache->event.handler = ngx_ssl_stapling_refresh_handler;
+        cache->event.data = cache;
+        cache->event.log = cycle->log;
+        cache->event.cancelable = 1;
+
+        ngx_add_timer(&cache->event, 1);
+    }
+
+    return NGX_OK;
+}
+
+
 static int
 ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 {
@@ -517,6 +702,10 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         return rc;
     }
 
+    if (staple->cache) {
+        return ngx_ssl_stapling_cached_status(c, ssl_conn, staple);
+    }
+
     if (staple->staple.len
         && staple->valid >= ngx_time())
     {
@@ -541,6 +730,50 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 }
 
 
+static int
+ngx_ssl_stapling_cached_status(ngx_connection_t *c, ngx_ssl_conn_t *ssl_conn,
+    ngx_ssl_stapling_t *staple)
+{
+    u_char                   *p;
+    size_t                    len;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    shpool = staple->cache->shpool;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_lookup(staple->cache, staple);
+
+    if (node == NULL || node->data == NULL || node->valid < ngx_time()) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    len = node->len;
+
+    /* we have to copy ocsp response as OpenSSL will free it by itself */
+
+    p = OPENSSL_malloc(len);
+    if (p == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "OPENSSL_malloc() failed");
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    ngx_memcpy(p, node->data, len);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL cached certificate status: %uz", len);
+
+    SSL_set_tlsext_status_ocsp_resp(ssl_conn, p, len);
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
 static void
 ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
 {
@@ -559,6 +792,10 @@ ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
         return;
     }
 
+    if (staple->cache) {
+        staple->cache->loading++;
+    }
+
     ctx->cert = staple->cert;
     ctx->issuer = staple->issuer;
     ctx->name = staple->name;
@@ -715,6 +952,25 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
     basic = NULL;
     ocsp = NULL;
 
+    if (staple->cache) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ctx->log, 0,
+                       "ssl ocsp response, %s, %uz, cached",
+                       OCSP_cert_status_str(n), len);
+
+        staple->valid = valid;
+        staple->refresh = ngx_max(ngx_min(valid - 300, now + 3600),
+                                  now + 300);
+
+        ngx_ssl_stapling_cache_store(staple, ctx->response->pos, len,
+                                     ctx->log);
+
+        staple->loading = 0;
+        staple->cache->loading--;
+
+        ngx_ssl_ocsp_done(ctx);
+        return;
+    }
+
     /* copy the response to memory not in ctx->pool */
 
     response.len = len;
@@ -753,6 +1009,11 @@ error:
     staple->loading = 0;
     staple->refresh = now + 300;
 
+    if (staple->cache) {
+        staple->cache->loading--;
+        ngx_ssl_stapling_cache_touch(staple);
+    }
+
     if (id) {
         OCSP_CERTID_free(id);
     }
@@ -769,6 +1030,330 @@ error:
 }
 
 
+static ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_ssl_stapling_cache_t  *ocache = data;
+
+    size_t                     len;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_ssl_stapling_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_ssl_stapling_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in OCSP stapling cache \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in OCSP stapling cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_ssl_stapling_node_t *
+ngx_ssl_stapling_cache_lookup(ngx_ssl_stapling_cache_t *cache,
+    ngx_ssl_stapling_t *staple)
+{
+    ngx_int_t                 rc;
+    ngx_rbtree_node_t        *node, *sentinel;
+    ngx_ssl_stapling_node_t  *sn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (staple->hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (staple->hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* staple->hash == node->key */
+
+        sn = (ngx_ssl_stapling_node_t *) node;
+
+        rc = ngx_memcmp(staple->id, sn->id, NGX_SSL_STAPLING_ID_LEN);
+
+        if (rc == 0) {
+            return sn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple, u_char *data,
+    size_t len, ngx_log_t *log)
+{
+    u_char                   *p;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    shpool = staple->cache->shpool;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_lookup(staple->cache, staple);
+
+    if (node == NULL) {
+        node = ngx_slab_calloc_locked(shpool,
+                                      sizeof(ngx_ssl_stapling_node_t));
+        if (node == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(node->id, staple->id, NGX_SSL_STAPLING_ID_LEN);
+        node->node.key = staple->hash;
+
+        ngx_rbtree_insert(&staple->cache->sh->rbtree, &node->node);
+        ngx_queue_insert_head(&staple->cache->sh->queue, &node->queue);
+    }
+
+    if (node->data == NULL || node->len != len) {
+        p = ngx_slab_alloc_locked(shpool, len);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        if (node->data) {
+            ngx_slab_free_locked(shpool, node->data);
+        }
+
+        node->data = p;
+        node->len = len;
+    }
+
+    ngx_memcpy(node->data, data, len);
+
+    node->valid = staple->valid;
+    node->refresh = staple->refresh;
+    node->expire = staple->refresh + NGX_SSL_STAPLING_EXPIRE;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                  "could not allocate OCSP response%s", shpool->log_ctx);
+}
+
+
+static void
+ngx_ssl_stapling_cache_touch(ngx_ssl_stapling_t *staple)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    /*
+     * a response which failed to refresh is kept as long as
+     * the certificate is configured, it may be still valid
+     */
+
+    shpool = staple->cache->shpool;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_lookup(staple->cache, staple);
+
+    if (node) {
+        node->expire = staple->refresh + NGX_SSL_STAPLING_EXPIRE;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static void
+ngx_ssl_stapling_cache_expire(ngx_ssl_stapling_cache_t *cache,
+    ngx_log_t *log)
+{
+    time_t                    now;
+    ngx_queue_t              *q, *next;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    /*
+     * responses are not refreshed if their certificates are no longer
+     * configured, such responses are removed an hour after the refresh
+     * time has passed
+     */
+
+    now = ngx_time();
+    shpool = cache->shpool;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (q = ngx_queue_head(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        node = ngx_queue_data(q, ngx_ssl_stapling_node_t, queue);
+
+        if (node->expire >= now) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl stapling cache expire: %T", node->expire);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+
+        if (node->data) {
+            ngx_slab_free_locked(shpool, node->data);
+        }
+
+        ngx_slab_free_locked(shpool, node);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static void
+ngx_ssl_stapling_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t        **p;
+    ngx_ssl_stapling_node_t   *sn, *snt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            sn = (ngx_ssl_stapling_node_t *) node;
+            snt = (ngx_ssl_stapling_node_t *) temp;
+
+            p = (ngx_memcmp(sn->id, snt->id, NGX_SSL_STAPLING_ID_LEN) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_ssl_stapling_refresh_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                 i;
+    ngx_ssl_stapling_t        *staple, **staples;
+    ngx_ssl_stapling_node_t   *node;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    cache = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "ssl stapling refresh, loading: %ui", cache->loading);
+
+    staples = cache->staples.elts;
+
+    for (i = 0; i < cache->staples.nelts; i++) {
+
+        if (cache->loading >= NGX_SSL_STAPLING_CONCURRENCY) {
+            break;
+        }
+
+        staple = staples[i];
+
+        if (staple->loading) {
+            continue;
+        }
+
+        if (staple->refresh == 0) {
+
+            /*
+             * a response may be already cached by the previous
+             * worker process, or for the same certificate elsewhere
+             */
+
+            ngx_shmtx_lock(&cache->shpool->mutex);
+
+            node = ngx_ssl_stapling_cache_lookup(cache, staple);
+
+            if (node && node->data) {
+                staple->valid = node->valid;
+                staple->refresh = node->refresh;
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+        }
+
+        ngx_ssl_stapling_update(staple);
+    }
+
+    if (cache->sweep <= ngx_time()) {
+        ngx_ssl_stapling_cache_expire(cache, ev->log);
+        cache->sweep = ngx_time() + NGX_SSL_STAPLING_SWEEP;
+    }
+
+    ngx_add_timer(ev, NGX_SSL_STAPLING_INTERVAL);
+}
+
+
 static time_t
 ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time)
 {
@@ -1889,4 +2474,19 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name,
+    size_t size)
+{
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_init_worker(ngx_cycle_t *cycle)
+{
+    return NGX_OK;
+}
+
+
 #endif
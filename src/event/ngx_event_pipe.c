@@ -17,6 +17,11 @@ static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
+static ngx_int_t ngx_event_pipe_bufs_limit(ngx_event_pipe_t *p);
+static void ngx_event_pipe_cleanup(void *data);
+
+
+size_t  ngx_event_pipe_memory;
 
 
 ngx_int_t
@@ -212,10 +217,22 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
                     p->free_raw_bufs = NULL;
                 }
 
-            } else if (p->allocated < p->bufs.num) {
+            } else if (p->allocated < ngx_event_pipe_bufs_limit(p)) {
 
                 /* allocate a new buf if it's still allowed */
 
+                if (p->allocated == 0) {
+                    ngx_pool_cleanup_t  *cln;
+
+                    cln = ngx_pool_cleanup_add(p->pool, 0);
+                    if (cln == NULL) {
+                        return NGX_ABORT;
+                    }
+
+                    cln->handler = ngx_event_pipe_cleanup;
+                    cln->data = p;
+                }
+
                 b = ngx_create_temp_buf(p->pool, p->bufs.size);
                 if (b == NULL) {
                     return NGX_ABORT;
@@ -223,6 +240,18 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
                 p->allocated++;
 
+                ngx_event_pipe_memory += p->bufs.size;
+
+#if (NGX_STAT_STUB)
+                (void) ngx_atomic_fetch_add(ngx_stat_pipe_memory,
+                                            p->bufs.size);
+#endif
+
+                ngx_log_debug3(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                               "pipe buf allocated: %i of %i, memory: %uz",
+                               p->allocated, p->bufs.num,
+                               ngx_event_pipe_memory);
+
                 chain = ngx_alloc_chain_link(p->pool);
                 if (chain == NULL) {
                     return NGX_ABORT;
@@ -1095,3 +1124,75 @@ ngx_event_pipe_drain_chains(ngx_event_pipe_t *p)
         }
     }
 }
+
+
+static ngx_int_t
+ngx_event_pipe_bufs_limit(ngx_event_pipe_t *p)
+{
+    size_t             limit;
+    ngx_int_t          n;
+    ngx_event_conf_t  *ecf;
+
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
+
+    limit = ecf->pipe_memory_limit;
+
+    if (limit == 0) {
+        return p->bufs.num;
+    }
+
+    /*
+     * the number of bufs allowed for a request is not limited while
+     * the worker uses less than a half of the limit, then it decreases
+     * linearly down to a single buf when the limit is reached, so slow
+     * clients are switched to temporary files earlier
+     */
+
+    if (ngx_event_pipe_memory <= limit / 2) {
+        n = p->bufs.num;
+
+    } else if (ngx_event_pipe_memory >= limit) {
+        n = 1;
+
+    } else {
+        n = (ngx_int_t) ((off_t) p->bufs.num * (limit - ngx_event_pipe_memory)
+                         / (limit - limit / 2));
+    }
+
+    /*
+     * a client ready to receive data does not need many bufs,
+     * the bufs are written to it instead
+     */
+
+    if (!p->cacheable
+        && p->downstream->data == p->output_ctx
+        && p->downstream->write->ready
+        && !p->downstream->write->delayed)
+    {
+        n /= 2;
+    }
+
+    return ngx_max(n, 1);
+}
+
+
+static void
+ngx_event_pipe_cleanup(void *data)
+{
+    ngx_event_pipe_t  *p = data;
+
+    size_t  size;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe cleanup: %i bufs, memory: %uz",
+                   p->allocated, ngx_event_pipe_memory);
+
+    size = p->allocated * p->bufs.size;
+
+    ngx_event_pipe_memory -= size;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_pipe_memory,
+                                - (ngx_atomic_int_t) size);
+#endif
+}
@@ -104,4 +104,7 @@ ngx_int_t ngx_event_pipe_copy_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
 ngx_int_t ngx_event_pipe_add_free_buf(ngx_event_pipe_t *p, ngx_buf_t *b);
 
 
+extern size_t  ngx_event_pipe_memory;
+
+
 #endif /* _NGX_EVENT_PIPE_H_INCLUDED_ */
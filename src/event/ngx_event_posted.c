@@ -11,6 +11,8 @@
 
 
 ngx_queue_t  ngx_posted_accept_events;
+ngx_queue_t  ngx_posted_write_events;
+ngx_queue_t  ngx_posted_read_events;
 ngx_queue_t  ngx_posted_events;
 
 
@@ -33,3 +35,28 @@ ngx_event_process_posted(ngx_cycle_t *cycle, ngx_queue_t *posted)
         ev->handler(ev);
     }
 }
+
+
+ngx_uint_t
+ngx_event_process_posted_budget(ngx_cycle_t *cycle, ngx_queue_t *posted,
+    ngx_uint_t budget)
+{
+    ngx_uint_t    n;
+    ngx_queue_t  *q;
+    ngx_event_t  *ev;
+
+    for (n = 0; n < budget && !ngx_queue_empty(posted); n++) {
+
+        q = ngx_queue_head(posted);
+        ev = ngx_queue_data(q, ngx_event_t, queue);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                      "posted event %p", ev);
+
+        ngx_delete_posted_event(ev);
+
+        ev->handler(ev);
+    }
+
+    return n;
+}
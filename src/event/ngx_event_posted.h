@@ -39,9 +39,13 @@
 
 
 void ngx_event_process_posted(ngx_cycle_t *cycle, ngx_queue_t *posted);
+ngx_uint_t ngx_event_process_posted_budget(ngx_cycle_t *cycle,
+    ngx_queue_t *posted, ngx_uint_t budget);
 
 
 extern ngx_queue_t  ngx_posted_accept_events;
+extern ngx_queue_t  ngx_posted_write_events;
+extern ngx_queue_t  ngx_posted_read_events;
 extern ngx_queue_t  ngx_posted_events;
 
 
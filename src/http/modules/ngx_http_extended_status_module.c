@@ -0,0 +1,999 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * request time buckets are powers of two milliseconds from 1ms to 16384ms,
+ * the last bucket counts requests processed in 16384ms or more
+ */
+
+#define NGX_HTTP_EXTENDED_STATUS_BUCKETS  16
+
+
+#define NGX_HTTP_EXTENDED_STATUS_JSON        0
+#define NGX_HTTP_EXTENDED_STATUS_PROMETHEUS  1
+
+
+/*
+ * counters are 64-bit: they are updated atomically where atomic operations
+ * are 64-bit, and under the zone mutex otherwise, so that the counters read
+ * are always consistent
+ */
+
+#if (NGX_HAVE_ATOMIC_OPS && NGX_PTR_SIZE == 8)
+
+#define NGX_HTTP_EXTENDED_STATUS_ATOMIC      1
+
+typedef ngx_atomic_t  ngx_http_extended_status_counter_t;
+
+#else
+
+#define NGX_HTTP_EXTENDED_STATUS_ATOMIC      0
+
+typedef uint64_t  ngx_http_extended_status_counter_t;
+
+#endif
+
+
+typedef struct {
+    ngx_http_extended_status_counter_t  requests;
+    ngx_http_extended_status_counter_t  bytes_in;
+    ngx_http_extended_status_counter_t  bytes_out;
+    ngx_http_extended_status_counter_t  responses[5];
+    ngx_http_extended_status_counter_t  request_time;
+    ngx_http_extended_status_counter_t
+                                buckets[NGX_HTTP_EXTENDED_STATUS_BUCKETS];
+} ngx_http_extended_status_counters_t;
+
+
+/* the sums of the counters of all workers, in the same order */
+
+typedef struct {
+    uint64_t                    requests;
+    uint64_t                    bytes_in;
+    uint64_t                    bytes_out;
+    uint64_t                    responses[5];
+    uint64_t                    request_time;
+    uint64_t                    buckets[NGX_HTTP_EXTENDED_STATUS_BUCKETS];
+} ngx_http_extended_status_totals_t;
+
+
+/*
+ * the zone holds a counters slot for each server and listening address
+ * per worker process, so workers do not contend for the same counters
+ */
+
+typedef struct {
+    uint32_t                    layout;
+    ngx_http_extended_status_counters_t  counters[1];
+} ngx_http_extended_status_shctx_t;
+
+
+typedef struct {
+    ngx_flag_t                  enable;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_http_extended_status_shctx_t  *sh;
+    ngx_slab_pool_t            *shpool;
+    ngx_uint_t                  nworkers;
+    ngx_uint_t                  nentries;
+    ngx_uint_t                  max_listens;
+    ngx_array_t                 servers;     /* array of ngx_str_t */
+    ngx_array_t                 listens;     /* array of ngx_str_t */
+    ngx_int_t                  *listening;
+    ngx_uint_t                  nlistening;
+} ngx_http_extended_status_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                  index;
+} ngx_http_extended_status_srv_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                  format;
+} ngx_http_extended_status_loc_conf_t;
+
+
+static ngx_int_t ngx_http_extended_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_extended_status_json(u_char *p,
+    ngx_http_extended_status_main_conf_t *esmcf,
+    ngx_http_extended_status_totals_t *totals);
+static u_char *ngx_http_extended_status_json_entries(u_char *p,
+    ngx_array_t *names, ngx_http_extended_status_totals_t *totals);
+static u_char *ngx_http_extended_status_prometheus(u_char *p,
+    ngx_array_t *names, ngx_http_extended_status_totals_t *totals,
+    char *kind);
+static u_char *ngx_http_extended_status_name(u_char *p, ngx_str_t *name);
+static ngx_int_t ngx_http_extended_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_extended_status_add(
+    ngx_http_extended_status_counter_t *counter, uint64_t n);
+static ngx_int_t ngx_http_extended_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_extended_status_init_module(ngx_cycle_t *cycle);
+static void *ngx_http_extended_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_extended_status_create_srv_conf(ngx_conf_t *cf);
+static void *ngx_http_extended_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_extended_status_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_set_extended_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_extended_status_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_extended_status_commands[] = {
+
+    { ngx_string("extended_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_set_extended_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_extended_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_extended_status_init,         /* postconfiguration */
+
+    ngx_http_extended_status_create_main_conf, /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_extended_status_create_srv_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_extended_status_create_loc_conf, /* create location conf */
+    ngx_http_extended_status_merge_loc_conf /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_extended_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_extended_status_module_ctx,  /* module context */
+    ngx_http_extended_status_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_extended_status_init_module,  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_extended_status_zone_name =
+    ngx_string("extended_status");
+
+static ngx_str_t  ngx_http_extended_status_unnamed = ngx_string("_");
+
+
+static ngx_int_t
+ngx_http_extended_status_handler(ngx_http_request_t *r)
+{
+    size_t                                 size;
+    ngx_int_t                              rc;
+    ngx_buf_t                             *b;
+    ngx_str_t                             *name;
+    ngx_uint_t                             i, n, w;
+    uint64_t                              *dst;
+    ngx_chain_t                            out;
+    ngx_http_extended_status_counter_t    *src;
+    ngx_http_extended_status_totals_t     *totals;
+    ngx_http_extended_status_counters_t   *counters;
+    ngx_http_extended_status_loc_conf_t   *eslcf;
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    eslcf = ngx_http_get_module_loc_conf(r, ngx_http_extended_status_module);
+
+    if (eslcf->format == NGX_HTTP_EXTENDED_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    esmcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+
+    size = esmcf->nentries * sizeof(ngx_http_extended_status_totals_t);
+
+    totals = ngx_pcalloc(r->pool, size);
+    if (totals == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* sum the slots of all workers */
+
+    n = sizeof(ngx_http_extended_status_totals_t) / sizeof(uint64_t);
+
+#if !(NGX_HTTP_EXTENDED_STATUS_ATOMIC)
+    ngx_shmtx_lock(&esmcf->shpool->mutex);
+#endif
+
+    for (w = 0; w < esmcf->nworkers; w++) {
+        counters = &esmcf->sh->counters[w * esmcf->nentries];
+
+        for (i = 0; i < esmcf->nentries * n; i++) {
+            src = (ngx_http_extended_status_counter_t *) counters + i;
+            dst = (uint64_t *) totals + i;
+
+            *dst += *src;
+        }
+    }
+
+#if !(NGX_HTTP_EXTENDED_STATUS_ATOMIC)
+    ngx_shmtx_unlock(&esmcf->shpool->mutex);
+#endif
+
+    size = sizeof("{\"servers\":{},\"listens\":{}}\n")
+           + 2 * 13 * sizeof("# HELP nginx_server_request_duration_seconds "
+                             "Request processing time.\n");
+
+    name = esmcf->servers.elts;
+    for (i = 0; i < esmcf->servers.nelts; i++) {
+        size += (NGX_HTTP_EXTENDED_STATUS_BUCKETS + 12)
+                * (128 + name[i].len
+                   + ngx_escape_json(NULL, name[i].data, name[i].len));
+    }
+
+    name = esmcf->listens.elts;
+    for (i = 0; i < esmcf->listens.nelts; i++) {
+        size += (NGX_HTTP_EXTENDED_STATUS_BUCKETS + 12)
+                * (128 + name[i].len
+                   + ngx_escape_json(NULL, name[i].data, name[i].len));
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    if (eslcf->format == NGX_HTTP_EXTENDED_STATUS_PROMETHEUS) {
+        b->last = ngx_http_extended_status_prometheus(b->last, &esmcf->servers,
+                                                      totals, "server");
+        b->last = ngx_http_extended_status_prometheus(b->last, &esmcf->listens,
+                                                      totals
+                                                      + esmcf->servers.nelts,
+                                                      "listen");
+
+    } else {
+        b->last = ngx_http_extended_status_json(b->last, esmcf, totals);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_extended_status_json(u_char *p,
+    ngx_http_extended_status_main_conf_t *esmcf,
+    ngx_http_extended_status_totals_t *totals)
+{
+    p = ngx_cpymem(p, "{\"servers\":{", sizeof("{\"servers\":{") - 1);
+    p = ngx_http_extended_status_json_entries(p, &esmcf->servers, totals);
+
+    p = ngx_cpymem(p, "},\"listens\":{", sizeof("},\"listens\":{") - 1);
+    p = ngx_http_extended_status_json_entries(p, &esmcf->listens,
+                                              totals + esmcf->servers.nelts);
+
+    return ngx_cpymem(p, "}}\n", sizeof("}}\n") - 1);
+}
+
+
+static u_char *
+ngx_http_extended_status_json_entries(u_char *p, ngx_array_t *names,
+    ngx_http_extended_status_totals_t *totals)
+{
+    ngx_str_t                          *name;
+    ngx_uint_t                          i, n;
+    ngx_http_extended_status_totals_t  *c;
+
+    name = names->elts;
+
+    for (i = 0; i < names->nelts; i++) {
+        c = &totals[i];
+
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = ngx_http_extended_status_name(p, &name[i]);
+
+        p = ngx_sprintf(p, "\":{\"requests\":%uL,\"bytes_in\":%uL,"
+                        "\"bytes_out\":%uL,\"responses\":{\"1xx\":%uL,"
+                        "\"2xx\":%uL,\"3xx\":%uL,\"4xx\":%uL,\"5xx\":%uL},"
+                        "\"request_time\":{\"sum\":%uL.%03uL,\"buckets\":{",
+                        c->requests, c->bytes_in, c->bytes_out,
+                        c->responses[0], c->responses[1], c->responses[2],
+                        c->responses[3], c->responses[4],
+                        c->request_time / 1000, c->request_time % 1000);
+
+        for (n = 0; n < NGX_HTTP_EXTENDED_STATUS_BUCKETS - 1; n++) {
+            p = ngx_sprintf(p, "\"%ui\":%uL,",
+                            (ngx_uint_t) 1 << n, c->buckets[n]);
+        }
+
+        p = ngx_sprintf(p, "\"inf\":%uL}}}", c->buckets[n]);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_extended_status_prometheus(u_char *p, ngx_array_t *names,
+    ngx_http_extended_status_totals_t *totals, char *kind)
+{
+    uint64_t                            count;
+    ngx_str_t                          *name;
+    ngx_uint_t                          i, n;
+    ngx_http_extended_status_totals_t  *c;
+
+    name = names->elts;
+
+    p = ngx_sprintf(p, "# HELP nginx_%s_requests_total "
+                       "Total number of requests.\n"
+                       "# TYPE nginx_%s_requests_total counter\n", kind, kind);
+
+    for (i = 0; i < names->nelts; i++) {
+        p = ngx_sprintf(p, "nginx_%s_requests_total{%s=\"", kind, kind);
+        p = ngx_http_extended_status_name(p, &name[i]);
+        p = ngx_sprintf(p, "\"} %uL\n", totals[i].requests);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginx_%s_received_bytes_total "
+                       "Bytes received from clients.\n"
+                       "# TYPE nginx_%s_received_bytes_total counter\n",
+                    kind, kind);
+
+    for (i = 0; i < names->nelts; i++) {
+        p = ngx_sprintf(p, "nginx_%s_received_bytes_total{%s=\"", kind, kind);
+        p = ngx_http_extended_status_name(p, &name[i]);
+        p = ngx_sprintf(p, "\"} %uL\n", totals[i].bytes_in);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginx_%s_sent_bytes_total "
+                       "Bytes sent to clients.\n"
+                       "# TYPE nginx_%s_sent_bytes_total counter\n",
+                    kind, kind);
+
+    for (i = 0; i < names->nelts; i++) {
+        p = ngx_sprintf(p, "nginx_%s_sent_bytes_total{%s=\"", kind, kind);
+        p = ngx_http_extended_status_name(p, &name[i]);
+        p = ngx_sprintf(p, "\"} %uL\n", totals[i].bytes_out);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginx_%s_responses_total "
+                       "Responses by status class.\n"
+                       "# TYPE nginx_%s_responses_total counter\n",
+                    kind, kind);
+
+    for (i = 0; i < names->nelts; i++) {
+        for (n = 0; n < 5; n++) {
+            p = ngx_sprintf(p, "nginx_%s_responses_total{%s=\"", kind, kind);
+            p = ngx_http_extended_status_name(p, &name[i]);
+            p = ngx_sprintf(p, "\",code=\"%uixx\"} %uL\n",
+                            n + 1, totals[i].responses[n]);
+        }
+    }
+
+    p = ngx_sprintf(p, "# HELP nginx_%s_request_duration_seconds "
+                       "Request processing time.\n"
+                       "# TYPE nginx_%s_request_duration_seconds histogram\n",
+                    kind, kind);
+
+    for (i = 0; i < names->nelts; i++) {
+        c = &totals[i];
+        count = 0;
+
+        for (n = 0; n < NGX_HTTP_EXTENDED_STATUS_BUCKETS; n++) {
+            count += c->buckets[n];
+
+            p = ngx_sprintf(p, "nginx_%s_request_duration_seconds_bucket"
+                               "{%s=\"", kind, kind);
+            p = ngx_http_extended_status_name(p, &name[i]);
+
+            if (n < NGX_HTTP_EXTENDED_STATUS_BUCKETS - 1) {
+                p = ngx_sprintf(p, "\",le=\"%ui.%03ui\"} %uL\n",
+                                ((ngx_uint_t) 1 << n) / 1000,
+                                ((ngx_uint_t) 1 << n) % 1000, count);
+
+            } else {
+                p = ngx_sprintf(p, "\",le=\"+Inf\"} %uL\n", count);
+            }
+        }
+
+        p = ngx_sprintf(p, "nginx_%s_request_duration_seconds_sum{%s=\"",
+                        kind, kind);
+        p = ngx_http_extended_status_name(p, &name[i]);
+        p = ngx_sprintf(p, "\"} %uL.%03uL\n",
+                        c->request_time / 1000, c->request_time % 1000);
+
+        p = ngx_sprintf(p, "nginx_%s_request_duration_seconds_count{%s=\"",
+                        kind, kind);
+        p = ngx_http_extended_status_name(p, &name[i]);
+        p = ngx_sprintf(p, "\"} %uL\n", count);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_extended_status_name(u_char *p, ngx_str_t *name)
+{
+    /*
+     * server names and listening addresses do not contain control
+     * characters, so JSON escaping suits Prometheus labels as well
+     */
+
+    return (u_char *) ngx_escape_json(p, name->data, name->len);
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_log_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                              index;
+    ngx_uint_t                             status, bucket, slot, i;
+    ngx_time_t                            *tp;
+    ngx_msec_int_t                         ms;
+    ngx_listening_t                       *ls;
+    ngx_http_extended_status_counters_t   *c[2];
+    ngx_http_extended_status_srv_conf_t   *esscf;
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    esmcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+
+    if (esmcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    esscf = ngx_http_get_module_srv_conf(r, ngx_http_extended_status_module);
+
+    /*
+     * slots are shared with workers of the previous configuration until
+     * they exit, and with other workers if "worker_processes" follows
+     * the "http" block, so counters are never updated by plain increments
+     */
+
+    slot = ngx_worker % esmcf->nworkers;
+
+    c[0] = &esmcf->sh->counters[slot * esmcf->nentries + esscf->index];
+    c[1] = NULL;
+
+    ls = r->connection->listening;
+
+    if (ls) {
+        index = ls - (ngx_listening_t *) ngx_cycle->listening.elts;
+
+        if (index >= 0
+            && (ngx_uint_t) index < esmcf->nlistening
+            && esmcf->listening[index] != NGX_ERROR)
+        {
+            c[1] = &esmcf->sh->counters[slot * esmcf->nentries
+                                       + esmcf->listening[index]];
+        }
+    }
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else if (r->headers_out.status) {
+        status = r->headers_out.status;
+
+    } else if (r->http_version == NGX_HTTP_VERSION_9) {
+        status = 200;
+
+    } else {
+        status = 0;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    for (bucket = 0; bucket < NGX_HTTP_EXTENDED_STATUS_BUCKETS - 1; bucket++) {
+        if ((ngx_msec_t) ms < ((ngx_msec_t) 1 << bucket)) {
+            break;
+        }
+    }
+
+#if !(NGX_HTTP_EXTENDED_STATUS_ATOMIC)
+    ngx_shmtx_lock(&esmcf->shpool->mutex);
+#endif
+
+    for (i = 0; i < 2 && c[i]; i++) {
+
+        ngx_http_extended_status_add(&c[i]->requests, 1);
+        ngx_http_extended_status_add(&c[i]->bytes_in, r->request_length);
+        ngx_http_extended_status_add(&c[i]->bytes_out, r->connection->sent);
+        ngx_http_extended_status_add(&c[i]->request_time, ms);
+        ngx_http_extended_status_add(&c[i]->buckets[bucket], 1);
+
+        if (status >= 100 && status < 600) {
+            ngx_http_extended_status_add(&c[i]->responses[status / 100 - 1], 1);
+        }
+    }
+
+#if !(NGX_HTTP_EXTENDED_STATUS_ATOMIC)
+    ngx_shmtx_unlock(&esmcf->shpool->mutex);
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_extended_status_add(ngx_http_extended_status_counter_t *counter,
+    uint64_t n)
+{
+#if (NGX_HTTP_EXTENDED_STATUS_ATOMIC)
+    (void) ngx_atomic_fetch_add(counter, n);
+#else
+    *counter += n;
+#endif
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_extended_status_main_conf_t  *oesmcf = data;
+
+    size_t                                 size;
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    esmcf = shm_zone->data;
+
+    /*
+     * a zone with a different number of slots is not reused,
+     * see ngx_http_extended_status_init()
+     */
+
+    if (oesmcf
+        && oesmcf->nworkers == esmcf->nworkers
+        && oesmcf->nentries == esmcf->nentries)
+    {
+        esmcf->sh = oesmcf->sh;
+        esmcf->shpool = oesmcf->shpool;
+
+        return NGX_OK;
+    }
+
+    esmcf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        esmcf->sh = esmcf->shpool->data;
+
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_extended_status_shctx_t)
+           + (esmcf->nworkers * esmcf->nentries - 1)
+             * sizeof(ngx_http_extended_status_counters_t);
+
+    esmcf->sh = ngx_slab_calloc(esmcf->shpool, size);
+    if (esmcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    esmcf->shpool->data = esmcf->sh;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init_module(ngx_cycle_t *cycle)
+{
+    size_t                                 size;
+    uint32_t                               layout;
+    ngx_str_t                             *name;
+    ngx_uint_t                             i, n;
+    ngx_core_conf_t                       *ccf;
+    ngx_listening_t                       *ls;
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    esmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                             ngx_http_extended_status_module);
+
+    if (esmcf == NULL || esmcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if ((ngx_uint_t) ccf->worker_processes > esmcf->nworkers) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "extended_status has %ui worker slots "
+                      "for %i worker processes, \"worker_processes\" "
+                      "should be specified before the \"http\" block",
+                      esmcf->nworkers, ccf->worker_processes);
+    }
+
+    /* map the http listening sockets to their counters */
+
+    esmcf->nlistening = cycle->listening.nelts;
+
+    esmcf->listening = ngx_palloc(cycle->pool,
+                                 esmcf->nlistening * sizeof(ngx_int_t));
+    if (esmcf->listening == NULL) {
+        return NGX_ERROR;
+    }
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        esmcf->listening[i] = NGX_ERROR;
+
+        if (ls[i].handler != ngx_http_init_connection) {
+            continue;
+        }
+
+        name = esmcf->listens.elts;
+
+        for (n = 0; n < esmcf->listens.nelts; n++) {
+            if (name[n].len == ls[i].addr_text.len
+                && ngx_strncmp(name[n].data, ls[i].addr_text.data,
+                               name[n].len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (n == esmcf->listens.nelts) {
+            if (n == esmcf->max_listens) {
+                continue;
+            }
+
+            name = ngx_array_push(&esmcf->listens);
+            if (name == NULL) {
+                return NGX_ERROR;
+            }
+
+            *name = ls[i].addr_text;
+        }
+
+        esmcf->listening[i] = esmcf->servers.nelts + n;
+    }
+
+    /*
+     * counters of a zone kept across reconfiguration are only valid
+     * if the zone still describes the same servers and addresses
+     */
+
+    ngx_crc32_init(layout);
+
+    ngx_crc32_update(&layout, (u_char *) &esmcf->nworkers, sizeof(ngx_uint_t));
+
+    name = esmcf->servers.elts;
+    for (i = 0; i < esmcf->servers.nelts; i++) {
+        ngx_crc32_update(&layout, name[i].data, name[i].len);
+        ngx_crc32_update(&layout, (u_char *) "", 1);
+    }
+
+    name = esmcf->listens.elts;
+    for (i = 0; i < esmcf->listens.nelts; i++) {
+        ngx_crc32_update(&layout, name[i].data, name[i].len);
+        ngx_crc32_update(&layout, (u_char *) "", 1);
+    }
+
+    ngx_crc32_final(layout);
+
+    if (esmcf->sh->layout != layout) {
+        size = esmcf->nworkers * esmcf->nentries
+               * sizeof(ngx_http_extended_status_counters_t);
+
+        ngx_memzero(esmcf->sh->counters, size);
+
+        esmcf->sh->layout = layout;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_extended_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    esmcf = ngx_pcalloc(cf->pool,
+                        sizeof(ngx_http_extended_status_main_conf_t));
+    if (esmcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     esmcf->enable = 0;
+     *     esmcf->shm_zone = NULL;
+     *     esmcf->sh = NULL;
+     *     esmcf->listening = NULL;
+     */
+
+    return esmcf;
+}
+
+
+static void *
+ngx_http_extended_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_srv_conf_t  *esscf;
+
+    esscf = ngx_pcalloc(cf->pool, sizeof(ngx_http_extended_status_srv_conf_t));
+    if (esscf == NULL) {
+        return NULL;
+    }
+
+    return esscf;
+}
+
+
+static void *
+ngx_http_extended_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_loc_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_extended_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->format = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_extended_status_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_extended_status_loc_conf_t *prev = parent;
+    ngx_http_extended_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_HTTP_EXTENDED_STATUS_JSON);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_set_extended_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_extended_status_loc_conf_t *eslcf = conf;
+
+    ngx_str_t                             *value;
+    ngx_http_core_loc_conf_t              *clcf;
+    ngx_http_extended_status_main_conf_t  *esmcf;
+
+    if (eslcf->format != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    eslcf->format = NGX_HTTP_EXTENDED_STATUS_JSON;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+            eslcf->format = NGX_HTTP_EXTENDED_STATUS_PROMETHEUS;
+
+        } else if (ngx_strcmp(value[1].data, "json") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid format \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    esmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_extended_status_module);
+    esmcf->enable = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_extended_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init(ngx_conf_t *cf)
+{
+    size_t                                 size;
+    ngx_str_t                             *name, *server_name;
+    ngx_uint_t                             s, i, p;
+    ngx_core_conf_t                       *ccf;
+    ngx_http_handler_pt                   *h;
+    ngx_http_conf_ctx_t                   *ctx;
+    ngx_http_conf_port_t                  *port;
+    ngx_http_core_srv_conf_t             **cscfp;
+    ngx_http_core_main_conf_t             *cmcf;
+    ngx_http_extended_status_srv_conf_t   *esscf;
+    ngx_http_extended_status_main_conf_t  *esmcf, *oesmcf;
+
+    esmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_extended_status_module);
+
+    if (!esmcf->enable) {
+        return NGX_OK;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    /* servers are accounted by their first name */
+
+    if (ngx_array_init(&esmcf->servers, cf->pool, cmcf->servers.nelts,
+                       sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    cscfp = cmcf->servers.elts;
+
+    for (s = 0; s < cmcf->servers.nelts; s++) {
+
+        server_name = &cscfp[s]->server_name;
+
+        if (server_name->len == 0) {
+            server_name = &ngx_http_extended_status_unnamed;
+        }
+
+        name = esmcf->servers.elts;
+
+        for (i = 0; i < esmcf->servers.nelts; i++) {
+            if (name[i].len == server_name->len
+                && ngx_strncmp(name[i].data, server_name->data,
+                               server_name->len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == esmcf->servers.nelts) {
+            name = ngx_array_push(&esmcf->servers);
+            if (name == NULL) {
+                return NGX_ERROR;
+            }
+
+            *name = *server_name;
+        }
+
+        ctx = cscfp[s]->ctx;
+        esscf = ctx->srv_conf[ngx_http_extended_status_module.ctx_index];
+        esscf->index = i;
+    }
+
+    /*
+     * listening sockets are not created yet, the number of addresses
+     * configured is the upper bound of the number of http sockets
+     */
+
+    esmcf->max_listens = 0;
+
+    if (cmcf->ports) {
+        port = cmcf->ports->elts;
+
+        for (p = 0; p < cmcf->ports->nelts; p++) {
+            esmcf->max_listens += port[p].addrs.nelts;
+        }
+    }
+
+    if (ngx_array_init(&esmcf->listens, cf->pool, esmcf->max_listens + 1,
+                       sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    esmcf->nworkers = (ccf->worker_processes == NGX_CONF_UNSET)
+                     ? 1 : (ngx_uint_t) ccf->worker_processes;
+
+    esmcf->nentries = esmcf->servers.nelts + esmcf->max_listens;
+
+    size = sizeof(ngx_http_extended_status_shctx_t)
+           + esmcf->nworkers * esmcf->nentries
+             * sizeof(ngx_http_extended_status_counters_t);
+
+    size = 8 * ngx_pagesize + ngx_align(size, ngx_pagesize);
+
+    esmcf->shm_zone = ngx_shared_memory_add(cf,
+                                           &ngx_http_extended_status_zone_name,
+                                           size,
+                                           &ngx_http_extended_status_module);
+    if (esmcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    esmcf->shm_zone->init = ngx_http_extended_status_init_zone;
+    esmcf->shm_zone->data = esmcf;
+
+    /*
+     * the zone of the previous configuration with a different number
+     * of slots is not reused, as it may be too small, and its workers
+     * keep updating the old slots until they exit
+     */
+
+    if (!ngx_is_init_cycle(cf->cycle->old_cycle)) {
+        oesmcf = ngx_http_cycle_get_module_main_conf(cf->cycle->old_cycle,
+                                             ngx_http_extended_status_module);
+
+        if (oesmcf
+            && (oesmcf->nworkers != esmcf->nworkers
+                || oesmcf->nentries != esmcf->nentries))
+        {
+            esmcf->shm_zone->noreuse = 1;
+        }
+    }
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_extended_status_log_handler;
+
+    return NGX_OK;
+}
@@ -63,6 +63,12 @@ static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
     ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_save_zone(ngx_shm_zone_t *shm_zone,
+    ngx_shm_snapshot_t *ss);
+static ngx_rbtree_node_t *ngx_http_limit_req_lookup_next(ngx_rbtree_t *rbtree,
+    uint32_t hash, u_char *data, size_t len);
+static ngx_int_t ngx_http_limit_req_restore_zone(ngx_shm_zone_t *shm_zone,
+    ngx_shm_snapshot_t *ss);
 
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
@@ -672,6 +678,256 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+/*
+ * a snapshot of the zone consists of the key the zone is used with,
+ * and the nodes in the order of the tree, each saved as
+ * ngx_http_limit_req_record_t followed by the key value
+ */
+
+typedef struct {
+    ngx_msec_t                   last;
+    ngx_uint_t                   excess;
+    uint32_t                     len;
+} ngx_http_limit_req_record_t;
+
+
+static ngx_int_t
+ngx_http_limit_req_save_zone(ngx_shm_zone_t *shm_zone, ngx_shm_snapshot_t *ss)
+{
+    u_char                       *buf, *p, *key;
+    uint32_t                      len, hash;
+    ngx_int_t                     rc;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req_ctx_t     *ctx;
+    ngx_http_limit_req_node_t    *lr;
+    ngx_http_limit_req_record_t   rec;
+
+    ctx = shm_zone->data;
+
+    len = ctx->key.value.len;
+
+    if (ngx_shm_snapshot_write(ss, &len, sizeof(uint32_t)) != NGX_OK
+        || ngx_shm_snapshot_write(ss, ctx->key.value.data, len) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the nodes are copied in batches, each followed by the space for
+     * the largest record, and the key of the last node copied is kept
+     * to continue with the next node once the batch is written
+     */
+
+    buf = ngx_alloc(NGX_SHM_SNAPSHOT_BATCH
+                    + sizeof(ngx_http_limit_req_record_t) + 2 * 65536,
+                    ss->file.log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    key = buf + NGX_SHM_SNAPSHOT_BATCH
+          + sizeof(ngx_http_limit_req_record_t) + 65536;
+
+    /* keys are never empty, so the first node is greater than this one */
+
+    hash = 0;
+    len = 0;
+
+    ngx_memzero(&rec, sizeof(ngx_http_limit_req_record_t));
+
+    for ( ;; ) {
+
+        p = buf;
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        node = ngx_http_limit_req_lookup_next(&ctx->sh->rbtree, hash, key,
+                                              len);
+
+        while (node && p - buf < NGX_SHM_SNAPSHOT_BATCH) {
+
+            lr = (ngx_http_limit_req_node_t *) &node->color;
+
+            rec.last = lr->last;
+            rec.excess = lr->excess;
+            rec.len = lr->len;
+
+            p = ngx_cpymem(p, &rec, sizeof(ngx_http_limit_req_record_t));
+            p = ngx_cpymem(p, lr->data, rec.len);
+
+            hash = (uint32_t) node->key;
+            len = rec.len;
+
+            node = ngx_rbtree_next(&ctx->sh->rbtree, node);
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (node) {
+            ngx_memcpy(key, p - len, len);
+        }
+
+        rc = ngx_shm_snapshot_write(ss, buf, p - buf);
+
+        if (rc != NGX_OK || node == NULL) {
+            break;
+        }
+    }
+
+    ngx_free(buf);
+
+    return rc;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_limit_req_lookup_next(ngx_rbtree_t *rbtree, uint32_t hash,
+    u_char *data, size_t len)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel, *next;
+    ngx_http_limit_req_node_t  *lr;
+
+    /* the first node greater than the given one */
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+    next = NULL;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            next = node;
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lr->data, len, (size_t) lr->len);
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+            continue;
+        }
+
+        node = node->right;
+    }
+
+    return next;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_restore_zone(ngx_shm_zone_t *shm_zone,
+    ngx_shm_snapshot_t *ss)
+{
+    size_t                        size;
+    u_char                       *key;
+    uint32_t                      len;
+    ngx_int_t                     rc;
+    ngx_uint_t                    restored, dropped;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req_ctx_t     *ctx;
+    ngx_http_limit_req_node_t    *lr;
+    ngx_http_limit_req_record_t   rec;
+
+    ctx = shm_zone->data;
+
+    key = ngx_alloc(65536, ss->file.log);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_shm_snapshot_read(ss, &len, sizeof(uint32_t));
+
+    if (rc != NGX_OK
+        || len != ctx->key.value.len
+        || ngx_shm_snapshot_read(ss, key, len) != NGX_OK
+        || ngx_strncmp(key, ctx->key.value.data, len) != 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, ss->file.log, 0,
+                      "limit_req \"%V\" snapshot is of a different key",
+                      &shm_zone->shm.name);
+        ngx_free(key);
+        return NGX_ERROR;
+    }
+
+    restored = 0;
+    dropped = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for ( ;; ) {
+
+        rc = ngx_shm_snapshot_read(ss, &rec,
+                                   sizeof(ngx_http_limit_req_record_t));
+
+        if (rc == NGX_DONE) {
+            rc = NGX_OK;
+            break;
+        }
+
+        if (rc != NGX_OK || rec.len > 65535) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        rc = ngx_shm_snapshot_read(ss, key, rec.len);
+
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_limit_req_node_t, data)
+               + rec.len;
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+        if (node == NULL) {
+            dropped++;
+            continue;
+        }
+
+        node->key = ngx_crc32_short(key, rec.len);
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        lr->len = (u_short) rec.len;
+        lr->last = rec.last;
+        lr->excess = rec.excess;
+        lr->count = 0;
+
+        ngx_memcpy(lr->data, key, rec.len);
+
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+        ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+
+        restored++;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_free(key);
+
+    ngx_log_error(NGX_LOG_INFO, ss->file.log, 0,
+                  "%ui limit_req states restored, %ui dropped in \"%V\"",
+                  restored, dropped, &shm_zone->shm.name);
+
+    return rc;
+}
+
+
 static void *
 ngx_http_limit_req_create_conf(ngx_conf_t *cf)
 {
@@ -843,6 +1099,8 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     shm_zone->init = ngx_http_limit_req_init_zone;
+    shm_zone->save = ngx_http_limit_req_save_zone;
+    shm_zone->restore = ngx_http_limit_req_restore_zone;
     shm_zone->data = ctx;
 
     return NGX_CONF_OK;
@@ -40,10 +40,93 @@ typedef struct {
 
 typedef struct {
     ngx_array_t                 formats;    /* array of ngx_http_log_fmt_t */
+    ngx_array_t                 aggregates; /* array of ngx_shm_zone_t * */
     ngx_uint_t                  combined_used; /* unsigned  combined_used:1 */
 } ngx_http_log_main_conf_t;
 
 
+#define NGX_HTTP_LOG_AGGREGATE_BUCKETS  24
+
+
+typedef struct {
+    u_char                      color;
+    u_char                      dummy;
+    u_short                     len;
+    ngx_uint_t                  requests;
+    off_t                       bytes;
+    ngx_msec_t                  time;
+    ngx_msec_t                  max;
+
+    /* request times, bucket n holds times below 2^n ms */
+    ngx_uint_t                  buckets[NGX_HTTP_LOG_AGGREGATE_BUCKETS];
+
+    u_char                      data[1];
+} ngx_http_log_aggregate_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    time_t                      next;
+    ngx_uint_t                  dropped;
+} ngx_http_log_aggregate_shctx_t;
+
+
+typedef struct {
+    ngx_http_log_aggregate_shctx_t  *sh;
+    ngx_slab_pool_t                 *shpool;
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_open_file_t                 *file;
+    time_t                           interval;
+    ngx_event_t                      event;
+} ngx_http_log_aggregate_ctx_t;
+
+
+typedef struct {
+    ngx_shm_zone_t             *shm_zone;
+    ngx_http_complex_value_t    key;
+} ngx_http_log_aggregate_t;
+
+
+#if (NGX_THREADS)
+
+#define NGX_HTTP_LOG_THREAD_BUFS  4
+
+
+typedef struct ngx_http_log_chunk_s  ngx_http_log_chunk_t;
+
+struct ngx_http_log_chunk_s {
+    u_char                     *start;
+    size_t                      len;
+    ngx_fd_t                    fd;
+    ngx_uint_t                  large;      /* unsigned  large:1 */
+    ngx_http_log_chunk_t       *next;
+};
+
+
+typedef struct {
+    ngx_thread_pool_t          *thread_pool;
+    ngx_open_file_t            *file;
+
+    /* the queue and the free list are shared with the thread */
+
+    ngx_thread_mutex_t          mutex;
+    ngx_http_log_chunk_t       *queue;
+    ngx_http_log_chunk_t      **last;
+    ngx_http_log_chunk_t       *free;
+    ngx_uint_t                  running;    /* unsigned  running:1 */
+
+    ngx_http_log_chunk_t       *chunk;
+    ngx_uint_t                  nchunks;
+    ngx_uint_t                  dropped;
+    ngx_int_t                   gzip;
+
+    time_t                      error_log_time;
+} ngx_http_log_thread_t;
+
+#endif
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -52,6 +135,10 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_http_log_thread_t      *thread;
+#endif
 } ngx_http_log_buf_t;
 
 
@@ -75,6 +162,8 @@ typedef struct {
 typedef struct {
     ngx_array_t                *logs;       /* array of ngx_http_log_t */
 
+    ngx_http_log_aggregate_t   *aggregate;
+
     ngx_open_file_cache_t      *open_file_cache;
     time_t                      open_file_cache_valid;
     ngx_uint_t                  open_file_cache_min_uses;
@@ -106,6 +195,19 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_log_thread_line(ngx_http_request_t *r,
+    ngx_http_log_t *log, size_t len);
+static void ngx_http_log_thread_queue(ngx_http_log_thread_t *lt,
+    ngx_http_log_chunk_t *chunk, size_t len, ngx_log_t *log);
+static ngx_int_t ngx_http_log_thread_flush(ngx_open_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_log_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_thread_event_handler(ngx_event_t *ev);
+static char *ngx_http_log_thread_init(ngx_conf_t *cf, ngx_open_file_t *file,
+    ngx_str_t *name);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -150,8 +252,25 @@ static char *ngx_http_log_compile_format(ngx_conf_t *cf,
     ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_log_aggregate(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
 
+static void ngx_http_log_aggregate_request(ngx_http_request_t *r,
+    ngx_http_log_aggregate_t *aggregate);
+static ngx_http_log_aggregate_node_t *ngx_http_log_aggregate_lookup(
+    ngx_http_log_aggregate_ctx_t *ctx, ngx_str_t *key, uint32_t hash);
+static void ngx_http_log_aggregate_handler(ngx_event_t *ev);
+static void ngx_http_log_aggregate_flush(ngx_http_log_aggregate_ctx_t *ctx,
+    ngx_log_t *log);
+static u_char *ngx_http_log_aggregate_percentile(u_char *buf,
+    ngx_http_log_aggregate_node_t *lan, ngx_uint_t percent);
+static ngx_int_t ngx_http_log_aggregate_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_log_aggregate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_log_init_process(ngx_cycle_t *cycle);
+
 
 static ngx_command_t  ngx_http_log_commands[] = {
 
@@ -177,6 +296,13 @@ static ngx_command_t  ngx_http_log_commands[] = {
       0,
       NULL },
 
+    { ngx_string("log_aggregate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_log_aggregate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -203,7 +329,7 @@ ngx_module_t  ngx_http_log_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_log_init_process,             /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -259,6 +385,10 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
     lcf = ngx_http_get_module_loc_conf(r, ngx_http_log_module);
 
+    if (lcf->aggregate) {
+        ngx_http_log_aggregate_request(r, lcf->aggregate);
+    }
+
     if (lcf->off) {
         return NGX_OK;
     }
@@ -318,12 +448,24 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
+#if (NGX_THREADS)
+                if (buffer->thread) {
+                    (void) ngx_http_log_thread_flush(log[l].file,
+                                                     r->connection->log);
+                    goto buffered;
+                }
+#endif
+
                 ngx_http_log_write(r, &log[l], buffer->start,
                                    buffer->pos - buffer->start);
 
                 buffer->pos = buffer->start;
             }
 
+#if (NGX_THREADS)
+        buffered:
+#endif
+
             if (len <= (size_t) (buffer->last - buffer->pos)) {
 
                 p = buffer->pos;
@@ -343,6 +485,44 @@ ngx_http_log_handler(ngx_http_request_t *r)
                 continue;
             }
 
+#if (NGX_THREADS)
+
+            /*
+             * the line cannot be written directly without breaking
+             * the order of lines being written by the thread
+             */
+
+            if (buffer->thread) {
+
+                if (buffer->pos == buffer->start) {
+
+                    /* the line is longer than the buffer */
+
+                    if (ngx_http_log_thread_line(r, &log[l], len) != NGX_OK) {
+                        return NGX_ERROR;
+                    }
+
+                    continue;
+                }
+
+                buffer->thread->dropped++;
+
+                if (ngx_time() - log[l].error_log_time > 59) {
+                    ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                                  "%ui lines to \"%s\" dropped, "
+                                  "all buffers are busy",
+                                  buffer->thread->dropped,
+                                  log[l].file->name.data);
+
+                    buffer->thread->dropped = 0;
+                    log[l].error_log_time = ngx_time();
+                }
+
+                continue;
+            }
+
+#endif
+
             if (buffer->event && buffer->event->timer_set) {
                 ngx_del_timer(buffer->event);
             }
@@ -716,82 +896,756 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
         return;
     }
 
-#if (NGX_ZLIB)
-    if (buffer->gzip) {
-        n = ngx_http_log_gzip(file->fd, buffer->start, len, buffer->gzip, log);
-    } else {
-        n = ngx_write_fd(file->fd, buffer->start, len);
+#if (NGX_THREADS)
+    if (buffer->thread) {
+        (void) ngx_http_log_thread_flush(file, log);
+        return;
+    }
+#endif
+
+#if (NGX_ZLIB)
+    if (buffer->gzip) {
+        n = ngx_http_log_gzip(file->fd, buffer->start, len, buffer->gzip, log);
+    } else {
+        n = ngx_write_fd(file->fd, buffer->start, len);
+    }
+#else
+    n = ngx_write_fd(file->fd, buffer->start, len);
+#endif
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      file->name.data);
+
+    } else if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, n, len);
+    }
+
+    buffer->pos = buffer->start;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+
+static void
+ngx_http_log_flush_handler(ngx_event_t *ev)
+{
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "http log buffer flush handler");
+
+    if (ev->timedout) {
+        ngx_http_log_flush(ev->data, ev->log);
+        return;
+    }
+
+    /* cancel the flush timer for graceful shutdown */
+
+    file = ev->data;
+    buffer = file->data;
+
+    buffer->event = NULL;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_log_thread_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t     *buffer;
+    ngx_http_log_chunk_t   *chunk;
+    ngx_http_log_thread_t  *lt;
+
+    buffer = file->data;
+    lt = buffer->thread;
+
+    if (buffer->pos == buffer->start) {
+        return NGX_OK;
+    }
+
+    /* a spare buffer to continue logging into */
+
+    (void) ngx_thread_mutex_lock(&lt->mutex, log);
+
+    chunk = lt->free;
+
+    if (chunk) {
+        lt->free = chunk->next;
+    }
+
+    (void) ngx_thread_mutex_unlock(&lt->mutex, log);
+
+    if (chunk == NULL) {
+
+        if (lt->nchunks == NGX_HTTP_LOG_THREAD_BUFS) {
+            return NGX_BUSY;
+        }
+
+        chunk = ngx_alloc(sizeof(ngx_http_log_chunk_t)
+                          + (buffer->last - buffer->start), log);
+        if (chunk == NULL) {
+            return NGX_ERROR;
+        }
+
+        chunk->start = (u_char *) chunk + sizeof(ngx_http_log_chunk_t);
+        chunk->large = 0;
+
+        lt->nchunks++;
+    }
+
+    ngx_http_log_thread_queue(lt, lt->chunk, buffer->pos - buffer->start,
+                              log);
+
+    lt->chunk = chunk;
+
+    buffer->last = chunk->start + (buffer->last - buffer->start);
+    buffer->start = chunk->start;
+    buffer->pos = chunk->start;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_thread_line(ngx_http_request_t *r, ngx_http_log_t *log,
+    size_t len)
+{
+    u_char                *p;
+    ngx_uint_t             i;
+    ngx_http_log_op_t     *op;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_chunk_t  *chunk;
+
+    /*
+     * a line which does not fit into the buffer is queued on its own,
+     * it is only called when all preceding lines are queued already
+     */
+
+    buffer = log->file->data;
+
+    chunk = ngx_alloc(sizeof(ngx_http_log_chunk_t) + len, r->connection->log);
+    if (chunk == NULL) {
+        return NGX_ERROR;
+    }
+
+    chunk->start = (u_char *) chunk + sizeof(ngx_http_log_chunk_t);
+    chunk->large = 1;
+
+    p = chunk->start;
+
+    op = log->format->ops->elts;
+    for (i = 0; i < log->format->ops->nelts; i++) {
+        p = op[i].run(r, p, &op[i]);
+    }
+
+    ngx_linefeed(p);
+
+    ngx_http_log_thread_queue(buffer->thread, chunk, p - chunk->start,
+                              r->connection->log);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_thread_queue(ngx_http_log_thread_t *lt,
+    ngx_http_log_chunk_t *chunk, size_t len, ngx_log_t *log)
+{
+    ngx_fd_t            fd;
+    ngx_uint_t          post;
+    ngx_thread_task_t  *task;
+
+    /*
+     * the descriptor is duplicated as the file may be reopened
+     * and the original descriptor closed before the thread writes
+     */
+
+    fd = dup(lt->file->fd);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "dup() of \"%s\" failed", lt->file->name.data);
+
+        /* simulate successful logging */
+
+        chunk->len = 0;
+        chunk->fd = NGX_INVALID_FILE;
+
+    } else {
+        chunk->len = len;
+        chunk->fd = fd;
+    }
+
+    chunk->next = NULL;
+
+    (void) ngx_thread_mutex_lock(&lt->mutex, log);
+
+    *lt->last = chunk;
+    lt->last = &chunk->next;
+
+    post = !lt->running;
+    lt->running = 1;
+
+    (void) ngx_thread_mutex_unlock(&lt->mutex, log);
+
+    if (!post) {
+        return;
+    }
+
+    /*
+     * a task is allocated for each run of the thread as a previous one
+     * may still wait for its completion to be handled
+     */
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t), log);
+    if (task == NULL) {
+        goto failed;
+    }
+
+    task->ctx = lt;
+    task->handler = ngx_http_log_thread_handler;
+    task->event.data = task;
+    task->event.handler = ngx_http_log_thread_event_handler;
+    task->event.log = log;
+
+    if (ngx_thread_task_post(lt->thread_pool, task) != NGX_OK) {
+        ngx_free(task);
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    /* write the data in the main thread */
+
+    ngx_http_log_thread_handler(lt, log);
+}
+
+
+static void
+ngx_http_log_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_log_thread_t *lt = data;
+
+    time_t                 now;
+    ssize_t                n;
+    ngx_err_t              err;
+    ngx_http_log_chunk_t  *chunk;
+
+    for ( ;; ) {
+
+        (void) ngx_thread_mutex_lock(&lt->mutex, log);
+
+        chunk = lt->queue;
+
+        if (chunk == NULL) {
+            lt->running = 0;
+            (void) ngx_thread_mutex_unlock(&lt->mutex, log);
+            return;
+        }
+
+        lt->queue = chunk->next;
+
+        if (lt->queue == NULL) {
+            lt->last = &lt->queue;
+        }
+
+        (void) ngx_thread_mutex_unlock(&lt->mutex, log);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http log thread write: %uz to #%d",
+                       chunk->len, chunk->fd);
+
+        if (chunk->len) {
+
+#if (NGX_ZLIB)
+            if (lt->gzip) {
+                n = ngx_http_log_gzip(chunk->fd, chunk->start, chunk->len,
+                                      lt->gzip, log);
+            } else {
+                n = ngx_write_fd(chunk->fd, chunk->start, chunk->len);
+            }
+#else
+            n = ngx_write_fd(chunk->fd, chunk->start, chunk->len);
+#endif
+
+            now = ngx_time();
+
+            if (n != (ssize_t) chunk->len && now - lt->error_log_time > 59) {
+                err = (n == -1) ? ngx_errno : 0;
+
+                if (n == -1) {
+                    ngx_log_error(NGX_LOG_ALERT, log, err,
+                                  ngx_write_fd_n " to \"%s\" failed",
+                                  lt->file->name.data);
+
+                } else {
+                    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                                  ngx_write_fd_n " to \"%s\" was incomplete: "
+                                  "%z of %uz",
+                                  lt->file->name.data, n, chunk->len);
+                }
+
+                lt->error_log_time = now;
+            }
+        }
+
+        if (chunk->fd != NGX_INVALID_FILE) {
+            (void) ngx_close_file(chunk->fd);
+        }
+
+        if (chunk->large) {
+            ngx_free(chunk);
+            continue;
+        }
+
+        (void) ngx_thread_mutex_lock(&lt->mutex, log);
+
+        chunk->next = lt->free;
+        lt->free = chunk;
+
+        (void) ngx_thread_mutex_unlock(&lt->mutex, log);
+    }
+}
+
+
+static void
+ngx_http_log_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log thread done");
+
+    ngx_free(ev->data);
+}
+
+
+static char *
+ngx_http_log_thread_init(ngx_conf_t *cf, ngx_open_file_t *file,
+    ngx_str_t *name)
+{
+    ngx_http_log_buf_t     *buffer;
+    ngx_http_log_thread_t  *lt;
+
+    buffer = file->data;
+
+    lt = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_thread_t));
+    if (lt == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lt->thread_pool = ngx_thread_pool_add(cf, name->len ? name : NULL);
+    if (lt->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_thread_mutex_create(&lt->mutex, cf->log) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    lt->chunk = ngx_palloc(cf->pool, sizeof(ngx_http_log_chunk_t));
+    if (lt->chunk == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lt->chunk->start = buffer->start;
+    lt->chunk->large = 0;
+    lt->nchunks = 1;
+
+    lt->file = file;
+    lt->last = &lt->queue;
+    lt->gzip = buffer->gzip;
+
+    buffer->thread = lt;
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+
+static u_char *
+ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    size_t     len;
+    uintptr_t  data;
+
+    len = op->len;
+    data = op->data;
+
+    while (len--) {
+        *buf++ = (u_char) (data & 0xff);
+        data >>= 8;
+    }
+
+    return buf;
+}
+
+
+static u_char *
+ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static void
+ngx_http_log_aggregate_request(ngx_http_request_t *r,
+    ngx_http_log_aggregate_t *aggregate)
+{
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    ngx_uint_t                      n;
+    ngx_time_t                     *tp;
+    ngx_msec_int_t                  ms;
+    ngx_rbtree_node_t              *node;
+    ngx_http_log_aggregate_ctx_t   *ctx;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    if (ngx_http_complex_value(r, &aggregate->key, &key) != NGX_OK) {
+        return;
+    }
+
+    if (key.len == 0) {
+        return;
+    }
+
+    if (key.len > 65535) {
+        key.len = 65535;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    for (n = 0; n < NGX_HTTP_LOG_AGGREGATE_BUCKETS - 1; n++) {
+        if ((ngx_msec_t) ms < ((ngx_msec_t) 1 << n)) {
+            break;
+        }
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = aggregate->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    lan = ngx_http_log_aggregate_lookup(ctx, &key, hash);
+
+    if (lan == NULL) {
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_log_aggregate_node_t, data)
+               + key.len;
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+        if (node == NULL) {
+            ctx->sh->dropped++;
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return;
+        }
+
+        lan = (ngx_http_log_aggregate_node_t *) &node->color;
+
+        ngx_memzero(lan, offsetof(ngx_http_log_aggregate_node_t, data));
+
+        node->key = hash;
+        lan->len = (u_short) key.len;
+        ngx_memcpy(lan->data, key.data, key.len);
+
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    }
+
+    lan->requests++;
+    lan->bytes += r->connection->sent;
+    lan->time += ms;
+    lan->buckets[n]++;
+
+    if ((ngx_msec_t) ms > lan->max) {
+        lan->max = ms;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static void
+ngx_http_log_aggregate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_log_aggregate_node_t   *lan, *lant;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lan = (ngx_http_log_aggregate_node_t *) &node->color;
+            lant = (ngx_http_log_aggregate_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lan->data, lant->data, lan->len, lant->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_log_aggregate_node_t *
+ngx_http_log_aggregate_lookup(ngx_http_log_aggregate_ctx_t *ctx,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                       rc;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lan = (ngx_http_log_aggregate_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lan->data, key->len, (size_t) lan->len);
+
+        if (rc == 0) {
+            return lan;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_log_aggregate_handler(ngx_event_t *ev)
+{
+    if (!ev->timedout) {
+        /* cancelled on graceful shutdown */
+        return;
+    }
+
+    ev->timedout = 0;
+
+    ngx_http_log_aggregate_flush(ev->data, ev->log);
+
+    ngx_add_timer(ev, 1000);
+}
+
+
+static void
+ngx_http_log_aggregate_flush(ngx_http_log_aggregate_ctx_t *ctx,
+    ngx_log_t *log)
+{
+    u_char                         *buf, *p;
+    size_t                          size;
+    time_t                          now;
+    ssize_t                         n;
+    ngx_str_t                      *line;
+    ngx_uint_t                      i, dropped;
+    ngx_msec_t                      avg;
+    ngx_pool_t                     *pool;
+    ngx_array_t                     lines;
+    ngx_rbtree_node_t              *node, *root, *sentinel;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    now = ngx_time();
+
+    if (now < ctx->sh->next) {
+        return;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    if (ngx_array_init(&lines, pool, 64, sizeof(ngx_str_t)) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    size = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    if (now < ctx->sh->next) {
+        /* flushed by another worker process */
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    ctx->sh->next = now - now % ctx->interval + ctx->interval;
+
+    dropped = ctx->sh->dropped;
+    ctx->sh->dropped = 0;
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    for ( ;; ) {
+        root = ctx->sh->rbtree.root;
+
+        if (root == sentinel) {
+            break;
+        }
+
+        node = ngx_rbtree_min(root, sentinel);
+        lan = (ngx_http_log_aggregate_node_t *) &node->color;
+
+        line = ngx_array_push(&lines);
+        if (line == NULL) {
+            break;
+        }
+
+        line->data = ngx_pnalloc(pool, ngx_cached_http_log_iso8601.len
+                                       + 1 + lan->len
+                                       + sizeof(" requests= bytes=") - 1
+                                       + NGX_ATOMIC_T_LEN + NGX_OFF_T_LEN
+                                       + 5 * (sizeof(" time=.000") - 1
+                                              + NGX_TIME_T_LEN)
+                                       + NGX_LINEFEED_SIZE);
+        if (line->data == NULL) {
+            break;
+        }
+
+        avg = lan->time / lan->requests;
+
+        p = ngx_sprintf(line->data, "%V %*s requests=%ui bytes=%O",
+                        &ngx_cached_http_log_iso8601, (size_t) lan->len,
+                        lan->data, lan->requests, lan->bytes);
+
+        p = ngx_sprintf(p, " avg=%T.%03M", (time_t) avg / 1000, avg % 1000);
+        p = ngx_http_log_aggregate_percentile(p, lan, 50);
+        p = ngx_http_log_aggregate_percentile(p, lan, 90);
+        p = ngx_http_log_aggregate_percentile(p, lan, 99);
+        p = ngx_sprintf(p, " max=%T.%03M",
+                        (time_t) lan->max / 1000, lan->max % 1000);
+
+        ngx_linefeed(p);
+
+        line->len = p - line->data;
+        size += line->len;
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_slab_free_locked(ctx->shpool, node);
     }
-#else
-    n = ngx_write_fd(file->fd, buffer->start, len);
-#endif
 
-    if (n == -1) {
-        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                      ngx_write_fd_n " to \"%s\" failed",
-                      file->name.data);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    } else if ((size_t) n != len) {
-        ngx_log_error(NGX_LOG_ALERT, log, 0,
-                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
-                      file->name.data, n, len);
+    if (dropped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%ui requests were not aggregated "
+                      "in log aggregate zone \"%V\"",
+                      dropped, &ctx->shm_zone->shm.name);
     }
 
-    buffer->pos = buffer->start;
-
-    if (buffer->event && buffer->event->timer_set) {
-        ngx_del_timer(buffer->event);
+    if (size == 0) {
+        ngx_destroy_pool(pool);
+        return;
     }
-}
 
+    buf = ngx_pnalloc(pool, size);
 
-static void
-ngx_http_log_flush_handler(ngx_event_t *ev)
-{
-    ngx_open_file_t     *file;
-    ngx_http_log_buf_t  *buffer;
+    if (buf != NULL) {
+        p = buf;
+        line = lines.elts;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
-                   "http log buffer flush handler");
+        for (i = 0; i < lines.nelts; i++) {
+            p = ngx_cpymem(p, line[i].data, line[i].len);
+        }
 
-    if (ev->timedout) {
-        ngx_http_log_flush(ev->data, ev->log);
-        return;
-    }
+        n = ngx_write_fd(ctx->file->fd, buf, size);
 
-    /* cancel the flush timer for graceful shutdown */
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_write_fd_n " to \"%s\" failed",
+                          ctx->file->name.data);
 
-    file = ev->data;
-    buffer = file->data;
+        } else if ((size_t) n != size) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                          ctx->file->name.data, n, size);
+        }
+    }
 
-    buffer->event = NULL;
+    ngx_destroy_pool(pool);
 }
 
 
 static u_char *
-ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
+ngx_http_log_aggregate_percentile(u_char *buf,
+    ngx_http_log_aggregate_node_t *lan, ngx_uint_t percent)
 {
-    size_t     len;
-    uintptr_t  data;
+    ngx_uint_t  n, count, rank;
+    ngx_msec_t  ms;
 
-    len = op->len;
-    data = op->data;
+    /* the upper bound of the bucket the percentile falls into */
 
-    while (len--) {
-        *buf++ = (u_char) (data & 0xff);
-        data >>= 8;
-    }
+    rank = (lan->requests * percent + 99) / 100;
 
-    return buf;
-}
+    for (n = 0, count = 0; n < NGX_HTTP_LOG_AGGREGATE_BUCKETS - 1; n++) {
+        count += lan->buckets[n];
+
+        if (count >= rank) {
+            break;
+        }
+    }
 
+    ms = ngx_min(((ngx_msec_t) 1 << n) - 1, lan->max);
 
-static u_char *
-ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+    return ngx_sprintf(buf, " p%ui=%T.%03M", percent,
+                       (time_t) ms / 1000, ms % 1000);
 }
 
 
@@ -1099,6 +1953,13 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    if (ngx_array_init(&conf->aggregates, cf->pool, 1,
+                       sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
     fmt = ngx_array_push(&conf->formats);
     if (fmt == NULL) {
         return NULL;
@@ -1127,6 +1988,7 @@ ngx_http_log_create_loc_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    conf->aggregate = NGX_CONF_UNSET_PTR;
     conf->open_file_cache = NGX_CONF_UNSET_PTR;
 
     return conf;
@@ -1143,6 +2005,8 @@ ngx_http_log_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_log_fmt_t        *fmt;
     ngx_http_log_main_conf_t  *lmcf;
 
+    ngx_conf_merge_ptr_value(conf->aggregate, prev->aggregate, NULL);
+
     if (conf->open_file_cache == NGX_CONF_UNSET_PTR) {
 
         conf->open_file_cache = prev->open_file_cache;
@@ -1203,6 +2067,10 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_uint_t                         i, n;
     ngx_msec_t                         flush;
     ngx_str_t                         *value, name, s;
+#if (NGX_THREADS)
+    ngx_str_t                          thread_pool;
+    ngx_uint_t                         threads;
+#endif
     ngx_http_log_t                    *log;
     ngx_syslog_peer_t                 *peer;
     ngx_http_log_buf_t                *buffer;
@@ -1323,6 +2191,10 @@ process_formats:
     size = 0;
     flush = 0;
     gzip = 0;
+#if (NGX_THREADS)
+    threads = 0;
+    ngx_str_null(&thread_pool);
+#endif
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1389,6 +2261,30 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "threads", 7) == 0
+            && (value[i].len == 7 || value[i].data[7] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            threads = 1;
+
+            if (value[i].len > 8) {
+                thread_pool.len = value[i].len - 8;
+                thread_pool.data = value[i].data + 8;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1443,7 +2339,11 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+#if (NGX_THREADS)
+                || (buffer->thread != NULL) != threads
+#endif
+               )
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1486,6 +2386,12 @@ process_formats:
 
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
+
+#if (NGX_THREADS)
+        if (threads) {
+            return ngx_http_log_thread_init(cf, log->file, &thread_pool);
+        }
+#endif
     }
 
     return NGX_CONF_OK;
@@ -1820,6 +2726,253 @@ ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_log_aggregate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_loc_conf_t *llcf = conf;
+
+    u_char                            *p;
+    ssize_t                            size;
+    time_t                             interval;
+    ngx_str_t                         *value, name, s;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *shm_zone, **zone;
+    ngx_open_file_t                   *file;
+    ngx_http_log_aggregate_t          *aggregate;
+    ngx_http_log_main_conf_t          *lmcf;
+    ngx_http_log_aggregate_ctx_t      *ctx;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (llcf->aggregate != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        llcf->aggregate = NULL;
+        return NGX_CONF_OK;
+    }
+
+    aggregate = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_aggregate_t));
+    if (aggregate == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&name);
+    size = 0;
+    interval = 60;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p) {
+                *p = '\0';
+
+                name.len = p - name.data;
+
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
+
+                size = ngx_parse_size(&s);
+
+                if (size == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid zone size \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (size < (ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "zone \"%V\" is too small", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+            } else {
+                name.len = value[i].len - 5;
+            }
+
+            if (name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone name \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &s;
+            ccv.complex_value = &aggregate->key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 1);
+
+            if (interval == (time_t) NGX_ERROR || interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (aggregate->key.value.data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"key\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_log_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = shm_zone->data;
+
+    if (ctx) {
+        if (ctx->file != file || ctx->interval != interval) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "log aggregate zone \"%V\" is already used "
+                               "with other file or interval", &name);
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+        ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_aggregate_ctx_t));
+        if (ctx == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->file = file;
+        ctx->interval = interval;
+        ctx->shm_zone = shm_zone;
+
+        shm_zone->init = ngx_http_log_aggregate_init_zone;
+        shm_zone->data = ctx;
+
+        lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_module);
+
+        zone = ngx_array_push(&lmcf->aggregates);
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *zone = shm_zone;
+    }
+
+    aggregate->shm_zone = shm_zone;
+    llcf->aggregate = aggregate;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_aggregate_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_log_aggregate_ctx_t  *octx = data;
+
+    size_t                         len;
+    time_t                         now;
+    ngx_http_log_aggregate_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        if (octx->interval != ctx->interval) {
+            now = ngx_time();
+
+            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ctx->sh->next = now - now % ctx->interval + ctx->interval;
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        }
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_http_log_aggregate_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_log_aggregate_rbtree_insert_value);
+
+    now = ngx_time();
+    ctx->sh->next = now - now % ctx->interval + ctx->interval;
+
+    len = sizeof(" in log aggregate zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in log aggregate zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_log_init(ngx_conf_t *cf)
 {
@@ -1863,3 +3016,34 @@ ngx_http_log_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_log_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                     i;
+    ngx_shm_zone_t               **zone;
+    ngx_http_log_main_conf_t      *lmcf;
+    ngx_http_log_aggregate_ctx_t  *ctx;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_log_module);
+
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    zone = lmcf->aggregates.elts;
+
+    for (i = 0; i < lmcf->aggregates.nelts; i++) {
+        ctx = zone[i]->data;
+
+        ctx->event.handler = ngx_http_log_aggregate_handler;
+        ctx->event.data = ctx;
+        ctx->event.log = cycle->log;
+        ctx->event.cancelable = 1;
+
+        ngx_add_timer(&ctx->event, 1000);
+    }
+
+    return NGX_OK;
+}
@@ -20,6 +20,8 @@ typedef struct {
     ngx_ssl_t                       ssl;
 
     ngx_flag_t                      prefer_server_ciphers;
+    ngx_flag_t                      async;
+    ngx_flag_t                      ktls;
 
     ngx_uint_t                      protocols;
 
@@ -28,6 +30,11 @@ typedef struct {
 
     size_t                          buffer_size;
 
+    ngx_flag_t                      dynamic_records;
+    ngx_msec_t                      dynamic_records_timeout;
+
+    ngx_flag_t                      early_data;
+
     ssize_t                         builtin_session_cache;
 
     time_t                          session_timeout;
@@ -35,6 +42,8 @@ typedef struct {
     ngx_array_t                    *certificates;
     ngx_array_t                    *certificate_keys;
 
+    ngx_ssl_cert_cache_t           *cert_cache;
+
     ngx_str_t                       dhparam;
     ngx_str_t                       ecdh_curve;
     ngx_str_t                       client_certificate;
@@ -54,6 +63,8 @@ typedef struct {
     ngx_flag_t                      stapling_verify;
     ngx_str_t                       stapling_file;
     ngx_str_t                       stapling_responder;
+    ngx_str_t                       stapling_cache;
+    size_t                          stapling_cache_size;
 
     u_char                         *file;
     ngx_uint_t                      line;
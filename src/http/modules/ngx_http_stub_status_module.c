@@ -76,6 +76,9 @@ static ngx_http_variable_t  ngx_http_stub_status_vars[] = {
     { ngx_string("connections_waiting"), NULL, ngx_http_stub_status_variable,
       3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("pipe_memory"), NULL, ngx_http_stub_status_variable,
+      4, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
@@ -189,6 +192,10 @@ ngx_http_stub_status_variable(ngx_http_request_t *r,
         value = *ngx_stat_waiting;
         break;
 
+    case 4:
+        value = *ngx_stat_pipe_memory;
+        break;
+
     /* suppress warning */
     default:
         value = 0;
@@ -575,7 +575,7 @@ ngx_http_create_request(ngx_connection_t *c)
     }
 
 #if (NGX_HTTP_SSL)
-    if (c->ssl) {
+    if (c->ssl && !c->ssl->sendfile) {
         r->main_filter_need_in_memory = 1;
     }
 #endif
@@ -825,6 +825,7 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
 int
 ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 {
+    ngx_int_t                  rc;
     ngx_str_t                  host;
     const char                *servername;
     ngx_connection_t          *c;
@@ -862,10 +863,23 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 
     hc = c->data;
 
-    if (ngx_http_find_virtual_server(c, hc->addr_conf->virtual_names, &host,
-                                     NULL, &cscf)
-        != NGX_OK)
-    {
+    rc = ngx_http_find_virtual_server(c, hc->addr_conf->virtual_names, &host,
+                                      NULL, &cscf);
+
+    if (rc == NGX_DECLINED) {
+
+        /* the default server may still have a certificate for the name */
+
+        sscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_ssl_module);
+
+        if (sscf->cert_cache) {
+            (void) ngx_ssl_cert_cache_set(c, sscf->cert_cache, &host);
+        }
+
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    if (rc != NGX_OK) {
         return SSL_TLSEXT_ERR_NOACK;
     }
 
@@ -906,6 +920,12 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
         SSL_set_options(ssl_conn, SSL_CTX_get_options(sscf->ssl.ctx));
     }
 
+    if (sscf->cert_cache
+        && ngx_ssl_cert_cache_set(c, sscf->cert_cache, &host) == NGX_ERROR)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
     return SSL_TLSEXT_ERR_OK;
 }
 
@@ -51,6 +51,8 @@ static ngx_int_t ngx_http_upstream_test_next(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_intercept_errors(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_test_fastopen(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_event_t *ev);
 static ngx_int_t ngx_http_upstream_process_headers(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
@@ -78,6 +80,15 @@ static void
 static ngx_int_t ngx_http_upstream_non_buffered_filter_init(void *data);
 static ngx_int_t ngx_http_upstream_non_buffered_filter(void *data,
     ssize_t bytes);
+#if (NGX_HAVE_SPLICE)
+static ngx_uint_t ngx_http_upstream_splice_allowed(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_splice_upgraded(ngx_http_request_t *r,
+    ngx_buf_t *b, ngx_connection_t *src, ngx_connection_t *dst,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+static ngx_int_t ngx_http_upstream_splice_non_buffered(ngx_http_request_t *r,
+    ngx_uint_t do_write);
+#endif
 #if (NGX_THREADS)
 static ngx_int_t ngx_http_upstream_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
@@ -599,6 +610,10 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
         return;
     }
 
+    if (u->conf->fastopen == 1) {
+        u->peer.fastopen = 1;
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     u->output.alignment = clcf->directio_alignment;
@@ -1174,6 +1189,14 @@ ngx_http_upstream_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http upstream request: \"%V?%V\"", &r->uri, &r->args);
 
+    if (u->peer.connecting
+        && u->request_sent
+        && ngx_http_upstream_test_fastopen(r, u, ev) != NGX_OK)
+    {
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
     if (ev->write) {
         u->write_event_handler(r, u);
 
@@ -1655,6 +1678,8 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
             u->peer.save_session(&u->peer, u->peer.data);
         }
 
+        u->peer.connecting = 0;
+
         c->write->handler = ngx_http_upstream_handler;
         c->read->handler = ngx_http_upstream_handler;
 
@@ -1894,7 +1919,9 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     if (rc == NGX_AGAIN) {
         if (!c->write->ready) {
-            ngx_add_timer(c->write, u->conf->send_timeout);
+            ngx_add_timer(c->write, u->peer.connecting
+                                    ? u->conf->connect_timeout
+                                    : u->conf->send_timeout);
 
         } else if (c->write->timer_set) {
             ngx_del_timer(c->write);
@@ -1913,7 +1940,7 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     u->request_body_sent = 1;
 
-    if (c->write->timer_set) {
+    if (c->write->timer_set && !u->peer.connecting) {
         ngx_del_timer(c->write);
     }
 
@@ -2526,6 +2553,49 @@ ngx_http_upstream_test_connect(ngx_connection_t *c)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_test_fastopen(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    /*
+     * with TCP Fast Open the handshake is started by the first write,
+     * and the next event on the connection reports its result; until
+     * then the request is retried as if it was not sent
+     */
+
+    c = u->peer.connection;
+
+    if (ev->timedout) {
+
+        if (c->sent) {
+            /* the request might have reached the server along with SYN */
+            u->peer.connecting = 0;
+        }
+
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream fastopen connected");
+
+    u->peer.connecting = 0;
+
+    if (u->request_body_sent && c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -2818,6 +2888,7 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
             u->input_filter = ngx_http_upstream_non_buffered_filter;
             u->input_filter_ctx = r;
+            u->splice = 1;
         }
 
         u->read_event_handler = ngx_http_upstream_process_non_buffered_upstream;
@@ -2831,6 +2902,30 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        /*
+         * the body is spliced only if the input filter passes it as is
+         * and no output filter needs to see or change it
+         */
+
+        if (u->splice
+            && (r->chunked
+                || r->main_filter_need_in_memory
+                || r->filter_need_in_memory
+                || r->filter_need_temporary
+                || !ngx_http_upstream_splice_allowed(r, u)))
+        {
+            u->splice = 0;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream splice:%d", u->splice);
+
+#else
+        u->splice = 0;
+#endif
+
         if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
@@ -3156,6 +3251,12 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         }
     }
 
+#if (NGX_HAVE_SPLICE)
+    u->splice = ngx_http_upstream_splice_allowed(r, u);
+#else
+    u->splice = 0;
+#endif
+
     if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
         return;
@@ -3210,9 +3311,13 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     size_t                     size;
     ssize_t                    n;
     ngx_buf_t                 *b;
+    ngx_uint_t                 upstream_pending, client_pending;
     ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
     ngx_http_upstream_t       *u;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HAVE_SPLICE)
+    ngx_int_t                  rc;
+#endif
 
     c = r->connection;
     u = r->upstream;
@@ -3269,6 +3374,22 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        rc = ngx_http_upstream_splice_upgraded(r, b, src, dst, from_upstream,
+                                               do_write);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        if (rc == NGX_OK) {
+            break;
+        }
+
+#endif
+
         if (do_write) {
 
             size = b->last - b->pos;
@@ -3322,8 +3443,23 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         break;
     }
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+    upstream_pending = (u->buffer.pos != u->buffer.last);
+    client_pending = (u->from_client.pos != u->from_client.last);
+
+#if (NGX_HAVE_SPLICE)
+
+    if (u->splice_from_upstream && u->splice_from_upstream->size) {
+        upstream_pending = 1;
+    }
+
+    if (u->splice_from_client && u->splice_from_client->size) {
+        client_pending = 1;
+    }
+
+#endif
+
+    if ((upstream->read->eof && !upstream_pending)
+        || (downstream->read->eof && !client_pending)
         || (downstream->read->eof && upstream->read->eof))
     {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -3453,6 +3589,22 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice) {
+            rc = ngx_http_upstream_splice_non_buffered(r, do_write);
+
+            if (rc == NGX_DONE) {
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                break;
+            }
+        }
+
+#endif
+
         if (do_write) {
 
             if (u->out_bufs || u->busy_bufs) {
@@ -3605,6 +3757,259 @@ ngx_http_upstream_non_buffered_filter(void *data, ssize_t bytes)
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_uint_t
+ngx_http_upstream_splice_allowed(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    if (!u->conf->splice || r != r->main) {
+        return 0;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (r->connection->ssl || u->peer.connection->ssl) {
+        return 0;
+    }
+
+#endif
+
+#if (NGX_HTTP_V2)
+
+    if (r->stream) {
+        return 0;
+    }
+
+#endif
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_upgraded(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_connection_t *src, ngx_connection_t *dst, ngx_uint_t from_upstream,
+    ngx_uint_t do_write)
+{
+    size_t                size;
+    ssize_t               n;
+    ngx_splice_pipe_t    *p;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    p = from_upstream ? u->splice_from_upstream : u->splice_from_client;
+
+    if (p == NULL || p->size == 0) {
+
+        /* data already read into the buffer must be sent first */
+
+        if (!u->splice || b->pos != b->last) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (p == NULL) {
+        p = ngx_linux_splice_pipe(r->pool, r->connection->log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (from_upstream) {
+            u->splice_from_upstream = p;
+
+        } else {
+            u->splice_from_client = p;
+        }
+    }
+
+    for ( ;; ) {
+
+        if (do_write && p->size && dst->write->ready) {
+
+            n = ngx_linux_splice_send(dst, p, p->size);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        size = (u->splice && p->size < p->capacity) ? p->capacity - p->size
+                                                     : 0;
+
+        if (size && src->read->ready) {
+
+            n = ngx_linux_splice_recv(src, p, size);
+
+            if (n == NGX_AGAIN) {
+
+                if (p->size && dst->write->ready) {
+                    do_write = 1;
+                    continue;
+                }
+
+                break;
+            }
+
+            if (n == NGX_DECLINED) {
+                u->splice = 0;
+                return NGX_DECLINED;
+            }
+
+            if (n > 0) {
+                do_write = 1;
+
+                if (from_upstream) {
+                    u->state->bytes_received += n;
+                }
+
+                continue;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+            }
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_non_buffered(ngx_http_request_t *r,
+    ngx_uint_t do_write)
+{
+    size_t                size;
+    ssize_t               n;
+    ngx_connection_t     *downstream, *upstream;
+    ngx_splice_pipe_t    *p;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    p = u->splice_from_upstream;
+
+    if (p == NULL) {
+
+        /* everything passed to the output filters must be sent first */
+
+        if (u->out_bufs || u->busy_bufs || r->out || r->buffered
+            || downstream->buffered || downstream->data != r)
+        {
+            return NGX_DECLINED;
+        }
+
+        p = ngx_linux_splice_pipe(r->pool, downstream->log);
+        if (p == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return NGX_DONE;
+        }
+
+        u->splice_from_upstream = p;
+
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = u->buffer.start;
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+            if (p->size && downstream->write->ready) {
+
+                n = ngx_linux_splice_send(downstream, p, p->size);
+
+                if (n == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return NGX_DONE;
+                }
+            }
+
+            if (p->size == 0) {
+
+                if (u->length == 0) {
+                    u->keepalive = !u->headers_in.connection_close;
+
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return NGX_DONE;
+                }
+
+                if (upstream->read->eof && u->length == -1) {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return NGX_DONE;
+                }
+
+                if (upstream->read->eof) {
+                    ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
+                                  "upstream prematurely closed connection");
+
+                    ngx_http_upstream_finalize_request(r, u,
+                                                       NGX_HTTP_BAD_GATEWAY);
+                    return NGX_DONE;
+                }
+
+                if (upstream->read->error) {
+                    ngx_http_upstream_finalize_request(r, u,
+                                                       NGX_HTTP_BAD_GATEWAY);
+                    return NGX_DONE;
+                }
+            }
+        }
+
+        size = (p->size < p->capacity) ? p->capacity - p->size : 0;
+
+        if (u->length != -1 && (off_t) size > u->length) {
+            size = (size_t) u->length;
+        }
+
+        if (size && upstream->read->ready) {
+
+            n = ngx_linux_splice_recv(upstream, p, size);
+
+            if (n == NGX_AGAIN) {
+
+                if (p->size && downstream->write->ready) {
+                    do_write = 1;
+                    continue;
+                }
+
+                break;
+            }
+
+            if (n == NGX_DECLINED) {
+                u->splice = 0;
+                return NGX_DECLINED;
+            }
+
+            if (n > 0) {
+                u->state->bytes_received += n;
+                u->state->response_length += n;
+
+                if (u->length != -1) {
+                    u->length -= n;
+                }
+            }
+
+            do_write = 1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 #if (NGX_THREADS)
 
 static ngx_int_t
@@ -4094,6 +4499,7 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     timeout = u->conf->next_upstream_timeout;
 
     if (u->request_sent
+        && !u->peer.connecting
         && (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)))
     {
         ft_type |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
@@ -5897,6 +6303,8 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 
     ngx_int_t                           rc;
     ngx_str_t                          *value;
+    ngx_uint_t                          i, n;
+    ngx_addr_t                         *addr;
     ngx_http_complex_value_t            cv;
     ngx_http_upstream_local_t         **plocal, *local;
     ngx_http_compile_complex_value_t    ccv;
@@ -5914,6 +6322,67 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
         return NGX_CONF_OK;
     }
 
+    local = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_local_t));
+    if (local == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *plocal = local;
+
+    n = cf->args->nelts - 1;
+
+    if (n > 1 && ngx_strcmp(value[n].data, "transparent") == 0) {
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+        local->transparent = 1;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "transparent proxying is not supported "
+                           "on this platform, ignored");
+#endif
+        n--;
+    }
+
+    if (n > 1) {
+
+        /* a pool of local addresses, selected in turn on each connect */
+
+        local->pool = ngx_palloc(cf->pool, sizeof(ngx_peer_local_pool_t));
+        if (local->pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        local->pool->addrs = ngx_pcalloc(cf->pool, n * sizeof(ngx_addr_t));
+        if (local->pool->addrs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        local->pool->naddrs = n;
+        local->pool->current = 0;
+
+        for (i = 0; i < n; i++) {
+            addr = &local->pool->addrs[i];
+
+            rc = ngx_parse_addr_port(cf->pool, addr, value[i + 1].data,
+                                     value[i + 1].len);
+
+            switch (rc) {
+            case NGX_OK:
+                addr->name = value[i + 1];
+                break;
+
+            case NGX_DECLINED:
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid address \"%V\"", &value[i + 1]);
+                /* fall through */
+
+            default:
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        return NGX_CONF_OK;
+    }
+
     ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
     ccv.cf = cf;
@@ -5924,13 +6393,6 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
         return NGX_CONF_ERROR;
     }
 
-    local = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_local_t));
-    if (local == NULL) {
-        return NGX_CONF_ERROR;
-    }
-
-    *plocal = local;
-
     if (cv.lengths) {
         local->value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
         if (local->value == NULL) {
@@ -5963,22 +6425,6 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
         }
     }
 
-    if (cf->args->nelts > 2) {
-        if (ngx_strcmp(value[2].data, "transparent") == 0) {
-#if (NGX_HAVE_TRANSPARENT_PROXY)
-            local->transparent = 1;
-#else
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "transparent proxying is not supported "
-                               "on this platform, ignored");
-#endif
-        } else {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid parameter \"%V\"", &value[2]);
-            return NGX_CONF_ERROR;
-        }
-    }
-
     return NGX_CONF_OK;
 }
 
@@ -5993,6 +6439,7 @@ ngx_http_upstream_set_local(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     if (local == NULL) {
         u->peer.local = NULL;
+        u->peer.local_pool = NULL;
         return NGX_OK;
     }
 
@@ -6000,6 +6447,12 @@ ngx_http_upstream_set_local(ngx_http_request_t *r, ngx_http_upstream_t *u,
     u->peer.transparent = local->transparent;
 #endif
 
+    if (local->pool) {
+        u->peer.local = NULL;
+        u->peer.local_pool = local->pool;
+        return NGX_OK;
+    }
+
     if (local->value == NULL) {
         u->peer.local = local->addr;
         return NGX_OK;
@@ -138,6 +138,7 @@ struct ngx_http_upstream_srv_conf_s {
 
 typedef struct {
     ngx_addr_t                      *addr;
+    ngx_peer_local_pool_t           *pool;
     ngx_http_complex_value_t        *value;
 #if (NGX_HAVE_TRANSPARENT_PROXY)
     ngx_uint_t                       transparent; /* unsigned  transparent:1; */
@@ -174,11 +175,13 @@ typedef struct {
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       buffering;
     ngx_flag_t                       request_buffering;
+    ngx_flag_t                       splice;
     ngx_flag_t                       pass_request_headers;
     ngx_flag_t                       pass_request_body;
 
     ngx_flag_t                       ignore_client_abort;
     ngx_flag_t                       intercept_errors;
+    ngx_flag_t                       fastopen;
     ngx_flag_t                       cyclic_temp_file;
     ngx_flag_t                       force_ranges;
 
@@ -339,6 +342,11 @@ struct ngx_http_upstream_s {
     ngx_buf_t                        buffer;
     off_t                            length;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t               *splice_from_upstream;
+    ngx_splice_pipe_t               *splice_from_client;
+#endif
+
     ngx_chain_t                     *out_bufs;
     ngx_chain_t                     *busy_bufs;
     ngx_chain_t                     *free_bufs;
@@ -386,6 +394,7 @@ struct ngx_http_upstream_s {
     unsigned                         buffering:1;
     unsigned                         keepalive:1;
     unsigned                         upgrade:1;
+    unsigned                         splice:1;
 
     unsigned                         request_sent:1;
     unsigned                         request_body_sent:1;
@@ -36,6 +36,7 @@ typedef struct {
     unsigned                bind:1;
     unsigned                wildcard:1;
     unsigned                ssl:1;
+    unsigned                proxy_protocol:1;
 #if (NGX_HAVE_INET6)
     unsigned                ipv6only:1;
 #endif
@@ -53,6 +54,7 @@ typedef struct {
     ngx_mail_conf_ctx_t    *ctx;
     ngx_str_t               addr_text;
     ngx_uint_t              ssl;    /* unsigned   ssl:1; */
+    ngx_uint_t              proxy_protocol; /* unsigned proxy_protocol:1; */
 } ngx_mail_addr_conf_t;
 
 typedef struct {
@@ -199,6 +201,7 @@ typedef struct {
     unsigned                backslash:1;
     unsigned                no_sync_literal:1;
     unsigned                starttls:1;
+    unsigned                ssl:1;
     unsigned                esmtp:1;
     unsigned                auth_method:3;
     unsigned                auth_wait:1;
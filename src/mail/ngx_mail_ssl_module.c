@@ -639,6 +639,8 @@ ngx_mail_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
 
             scf->shm_zone->init = ngx_ssl_session_cache_init;
+            scf->shm_zone->save = ngx_ssl_session_cache_save;
+            scf->shm_zone->restore = ngx_ssl_session_cache_restore;
 
             continue;
         }
@@ -99,6 +99,16 @@ typedef struct iocb  ngx_aiocb_t;
 #endif
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+#include <linux/filter.h>
+#endif
+
+
+#if (NGX_HAVE_UDP_SEGMENT)
+#include <netinet/udp.h>        /* UDP_SEGMENT */
+#endif
+
+
 #define NGX_LISTEN_BACKLOG        511
 
 
@@ -0,0 +1,214 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * splice() moves data between a socket and a pipe without copying it
+ * to user space, so a socket to socket transfer is done as two splice()
+ * calls through an intermediate pipe: ngx_linux_splice_recv() fills
+ * the pipe from a socket and ngx_linux_splice_send() drains it to
+ * another socket.  p->size tracks the number of bytes in the pipe.
+ */
+
+
+static void ngx_linux_splice_pipe_cleanup(void *data);
+
+
+ngx_splice_pipe_t *
+ngx_linux_splice_pipe(ngx_pool_t *pool, ngx_log_t *log)
+{
+#ifdef F_GETPIPE_SZ
+    int                  size;
+#endif
+    ngx_pool_cleanup_t  *cln;
+    ngx_splice_pipe_t   *p;
+
+    p = ngx_palloc(pool, sizeof(ngx_splice_pipe_t));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    if (pipe2(p->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe2() failed");
+        return NULL;
+    }
+
+    cln->handler = ngx_linux_splice_pipe_cleanup;
+    cln->data = p;
+
+    p->size = 0;
+    p->capacity = 16 * ngx_pagesize;
+
+#ifdef F_GETPIPE_SZ
+
+    size = fcntl(p->fd[1], F_GETPIPE_SZ);
+
+    if (size > 0) {
+        p->capacity = size;
+    }
+
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "splice pipe: %d:%d, capacity:%uz",
+                   p->fd[0], p->fd[1], p->capacity);
+
+    return p;
+}
+
+
+static void
+ngx_linux_splice_pipe_cleanup(void *data)
+{
+    ngx_splice_pipe_t  *p = data;
+
+    if (close(p->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(p->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+}
+
+
+ssize_t
+ngx_linux_splice_recv(ngx_connection_t *c, ngx_splice_pipe_t *p, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, p->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice recv: fd:%d %z of %uz, pipe:%uz",
+                       c->fd, n, size, p->size);
+
+        if (n > 0) {
+
+            /*
+             * a short read may be caused by the pipe capacity
+             * rather than by the socket, so rev->ready is kept
+             */
+
+            p->size += n;
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+
+            /*
+             * EAGAIN is also returned if the pipe is full,
+             * so the socket is only known to be drained
+             * when the pipe is empty
+             */
+
+            if (p->size == 0) {
+                rev->ready = 0;
+            }
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+            return NGX_AGAIN;
+        }
+
+        if ((err == NGX_EINVAL || err == NGX_ENOSYS) && p->size == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, err,
+                          "splice() is not supported, using recv()");
+            return NGX_DECLINED;
+        }
+
+        rev->ready = 0;
+        rev->error = 1;
+
+        return ngx_connection_error(c, err, "splice() failed");
+    }
+}
+
+
+ssize_t
+ngx_linux_splice_send(ngx_connection_t *c, ngx_splice_pipe_t *p, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    for ( ;; ) {
+        n = splice(p->fd[0], NULL, c->fd, NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice send: fd:%d %z of %uz, pipe:%uz",
+                       c->fd, n, size, p->size);
+
+        if (n > 0) {
+            if ((size_t) n < size) {
+                wev->ready = 0;
+            }
+
+            p->size -= n;
+            c->sent += n;
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, err, "splice() returned zero");
+            wev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            wev->ready = 0;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+            return NGX_AGAIN;
+        }
+
+        wev->error = 1;
+        (void) ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+}
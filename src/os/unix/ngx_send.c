@@ -54,6 +54,17 @@ ngx_unix_send(ngx_connection_t *c, u_char *buf, size_t size)
             return n;
         }
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+        if (err == NGX_EINPROGRESS) {
+
+            /* TCP Fast Open without a cookie, the SYN is sent without data */
+
+            err = NGX_EAGAIN;
+        }
+
+#endif
+
         if (err == NGX_EAGAIN || err == NGX_EINTR) {
             wev->ready = 0;
 
@@ -10,20 +10,76 @@
 #include <ngx_event.h>
 
 
+#if (NGX_HAVE_SENDMMSG)
+
+#define NGX_UDP_SENDMMSG_BATCH    64
+
+/*
+ * datagrams of the same size are coalesced into a single UDP_SEGMENT
+ * message only if they fit into an Ethernet frame along with the IP
+ * and UDP headers, larger datagrams cannot be segmented
+ */
+
+#define NGX_UDP_GSO_SEGMENTS      64
+#define NGX_UDP_GSO_SEGMENT_MAX   1472
+#define NGX_UDP_GSO_SEGMENT_MAX6  1452
+#define NGX_UDP_GSO_SIZE_MAX      65507
+
+
+typedef struct {
+    size_t          size;
+    size_t          segment;
+    ngx_uint_t      segments;
+    ngx_uint_t      closed;          /* unsigned  closed:1; */
+} ngx_udp_mmsg_info_t;
+
+
+typedef struct {
+    struct mmsghdr       msgs[NGX_UDP_SENDMMSG_BATCH];
+    ngx_udp_mmsg_info_t  info[NGX_UDP_SENDMMSG_BATCH];
+    struct iovec         iovs[NGX_IOVS_PREALLOCATE * 2];
+#if (NGX_HAVE_UDP_SEGMENT)
+    u_char               control[NGX_UDP_SENDMMSG_BATCH]
+                                [CMSG_SPACE(sizeof(uint16_t))];
+#endif
+    ngx_uint_t           nmsgs;
+    size_t               size;
+    ngx_uint_t           gso;        /* unsigned  gso:1; */
+} ngx_udp_mmsg_t;
+
+
+static ngx_chain_t *ngx_udp_output_chain_to_mmsg(ngx_connection_t *c,
+    ngx_udp_mmsg_t *mm, ngx_chain_t *in, off_t limit);
+static ssize_t ngx_sendmmsg(ngx_connection_t *c, ngx_udp_mmsg_t *mm);
+
+#else
+
+static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec);
+
+#endif
+
 static ngx_chain_t *ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *in, ngx_log_t *log);
-static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec);
+
+
+#if (NGX_HAVE_UDP_SEGMENT)
+static ngx_uint_t  ngx_udp_gso = 1;
+#endif
 
 
 ngx_chain_t *
 ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    ssize_t        n;
-    off_t          send;
-    ngx_chain_t   *cl;
-    ngx_event_t   *wev;
-    ngx_iovec_t    vec;
-    struct iovec   iovs[NGX_IOVS_PREALLOCATE];
+    ssize_t          n;
+    off_t            send;
+    ngx_chain_t     *cl;
+    ngx_event_t     *wev;
+#if (NGX_HAVE_SENDMMSG)
+    ngx_udp_mmsg_t   mm;
+#else
+    ngx_iovec_t      vec;
+    struct iovec     iovs[NGX_IOVS_PREALLOCATE];
+#endif
 
     wev = c->write;
 
@@ -50,15 +106,27 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     send = 0;
 
+#if !(NGX_HAVE_SENDMMSG)
     vec.iovs = iovs;
     vec.nalloc = NGX_IOVS_PREALLOCATE;
+#endif
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SENDMMSG)
+
+        /* create a batch of datagrams to be sent with a single sendmmsg() */
+
+        cl = ngx_udp_output_chain_to_mmsg(c, &mm, in, limit - send);
+
+#else
+
         /* create the iovec and coalesce the neighbouring bufs */
 
         cl = ngx_udp_output_chain_to_iovec(&vec, in, c->log);
 
+#endif
+
         if (cl == NGX_CHAIN_ERROR) {
             return NGX_CHAIN_ERROR;
         }
@@ -86,10 +154,29 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return in;
         }
 
+#if (NGX_HAVE_SENDMMSG)
+
+        n = ngx_sendmmsg(c, &mm);
+
+        if (n == NGX_DECLINED) {
+
+            /* UDP segmentation failed, resend the datagrams without it */
+
+            continue;
+        }
+
+        if (n > 0) {
+            send += n;
+        }
+
+#else
+
         send += vec.size;
 
         n = ngx_sendmsg(c, &vec);
 
+#endif
+
         if (n == NGX_ERROR) {
             return NGX_CHAIN_ERROR;
         }
@@ -110,6 +197,228 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 }
 
 
+#if (NGX_HAVE_SENDMMSG)
+
+static ngx_chain_t *
+ngx_udp_output_chain_to_mmsg(ngx_connection_t *c, ngx_udp_mmsg_t *mm,
+    ngx_chain_t *in, off_t limit)
+{
+    size_t                segment_max;
+    ngx_uint_t            used;
+    ngx_chain_t          *cl;
+    ngx_iovec_t           vec;
+    struct msghdr        *msg;
+    ngx_udp_mmsg_info_t  *info;
+
+    used = 0;
+
+    /*
+     * the peer address is not set in upstream connections,
+     * so the smaller IPv6 limit is used if the family is not known
+     */
+
+    segment_max = (c->sockaddr && c->sockaddr->sa_family == AF_INET)
+                  ? NGX_UDP_GSO_SEGMENT_MAX : NGX_UDP_GSO_SEGMENT_MAX6;
+
+    mm->nmsgs = 0;
+    mm->size = 0;
+
+#if (NGX_HAVE_UDP_SEGMENT)
+    mm->gso = ngx_udp_gso;
+#else
+    mm->gso = 0;
+#endif
+
+    /*
+     * the iovecs of all datagrams are allocated sequentially, so
+     * the iovecs of coalesced datagrams are always contiguous
+     */
+
+    while (in && used <= NGX_IOVS_PREALLOCATE && (off_t) mm->size < limit) {
+
+        vec.iovs = &mm->iovs[used];
+        vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+        cl = ngx_udp_output_chain_to_iovec(&vec, in, c->log);
+
+        if (cl == NGX_CHAIN_ERROR) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (cl == in) {
+            break;
+        }
+
+        info = mm->nmsgs ? &mm->info[mm->nmsgs - 1] : NULL;
+
+        if (mm->gso
+            && info
+            && !info->closed
+            && vec.size
+            && vec.size <= info->segment
+            && info->segments < NGX_UDP_GSO_SEGMENTS
+            && info->size + vec.size <= NGX_UDP_GSO_SIZE_MAX)
+        {
+            /* coalesce the datagram with the previous one */
+
+            msg = &mm->msgs[mm->nmsgs - 1].msg_hdr;
+            msg->msg_iovlen += vec.count;
+
+            info->size += vec.size;
+            info->segments++;
+
+            if (vec.size < info->segment) {
+                info->closed = 1;
+            }
+
+        } else {
+
+            if (mm->nmsgs == NGX_UDP_SENDMMSG_BATCH) {
+                break;
+            }
+
+            msg = &mm->msgs[mm->nmsgs].msg_hdr;
+            info = &mm->info[mm->nmsgs];
+
+            ngx_memzero(msg, sizeof(struct msghdr));
+
+            if (c->socklen) {
+                msg->msg_name = c->sockaddr;
+                msg->msg_namelen = c->socklen;
+            }
+
+            msg->msg_iov = vec.iovs;
+            msg->msg_iovlen = vec.count;
+
+            info->size = vec.size;
+            info->segment = vec.size;
+            info->segments = 1;
+            info->closed = (vec.size == 0
+                            || vec.size > segment_max);
+
+            mm->nmsgs++;
+        }
+
+        used += vec.count;
+        mm->size += vec.size;
+
+        in = cl;
+    }
+
+    if (mm->nmsgs == 0) {
+        return in;
+    }
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+    if (mm->gso) {
+        ngx_uint_t       i;
+        struct cmsghdr  *cmsg;
+
+        for (i = 0; i < mm->nmsgs; i++) {
+            info = &mm->info[i];
+
+            if (info->segments == 1) {
+                continue;
+            }
+
+            msg = &mm->msgs[i].msg_hdr;
+
+            msg->msg_control = mm->control[i];
+            msg->msg_controllen = sizeof(mm->control[i]);
+
+            ngx_memzero(mm->control[i], sizeof(mm->control[i]));
+
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+            *(uint16_t *) CMSG_DATA(cmsg) = (uint16_t) info->segment;
+        }
+    }
+
+#endif
+
+    return in;
+}
+
+
+static ssize_t
+ngx_sendmmsg(ngx_connection_t *c, ngx_udp_mmsg_t *mm)
+{
+    int         n;
+    size_t      sent;
+    ngx_err_t   err;
+    ngx_uint_t  i;
+
+eintr:
+
+    n = sendmmsg(c->fd, mm->msgs, mm->nmsgs, 0);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmmsg: %d of %ui, size:%uz", n, mm->nmsgs, mm->size);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() was interrupted");
+            goto eintr;
+
+        default:
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+            if (mm->gso
+                && mm->msgs[0].msg_hdr.msg_control
+                && (err == NGX_EIO
+                    || err == NGX_EINVAL
+                    || err == NGX_EOPNOTSUPP))
+            {
+
+                /*
+                 * segmentation is not supported by the kernel or
+                 * the network device, disable it in this process
+                 * and let the caller resend the datagrams separately
+                 */
+
+                ngx_log_error(NGX_LOG_NOTICE, c->log, err,
+                              "sendmmsg() with UDP_SEGMENT failed, "
+                              "UDP segmentation disabled");
+
+                ngx_udp_gso = 0;
+
+                return NGX_DECLINED;
+            }
+
+#endif
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    sent = 0;
+
+    for (i = 0; i < (ngx_uint_t) n; i++) {
+        sent += mm->info[i].size;
+    }
+
+    return sent;
+}
+
+#endif
+
+
 static ngx_chain_t *
 ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 {
@@ -196,6 +505,8 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 }
 
 
+#if !(NGX_HAVE_SENDMMSG)
+
 static ssize_t
 ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
 {
@@ -243,3 +554,5 @@ eintr:
 
     return n;
 }
+
+#endif
@@ -200,6 +200,16 @@ eintr:
                            "writev() not ready");
             return NGX_AGAIN;
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+        case NGX_EINPROGRESS:
+
+            /* TCP Fast Open without a cookie, the SYN is sent without data */
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "writev() connection in progress");
+            return NGX_AGAIN;
+#endif
+
         case NGX_EINTR:
             ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
                            "writev() was interrupted");
@@ -43,6 +43,7 @@ typedef DWORD                      ngx_err_t;
 #define NGX_ENOPROTOOPT            WSAENOPROTOOPT
 #define NGX_EOPNOTSUPP             WSAEOPNOTSUPP
 #define NGX_EADDRINUSE             WSAEADDRINUSE
+#define NGX_EADDRNOTAVAIL          WSAEADDRNOTAVAIL
 #define NGX_ECONNABORTED           WSAECONNABORTED
 #define NGX_ECONNRESET             WSAECONNRESET
 #define NGX_ENOTCONN               WSAENOTCONN
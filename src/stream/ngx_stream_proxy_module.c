@@ -12,6 +12,7 @@
 
 typedef struct {
     ngx_addr_t                      *addr;
+    ngx_peer_local_pool_t           *pool;
     ngx_stream_complex_value_t      *value;
 #if (NGX_HAVE_TRANSPARENT_PROXY)
     ngx_uint_t                       transparent; /* unsigned  transparent:1; */
@@ -26,10 +27,15 @@ typedef struct {
     size_t                           buffer_size;
     size_t                           upload_rate;
     size_t                           download_rate;
+    ngx_msec_t                       udp_idle_timeout;
+    ngx_uint_t                       requests;
     ngx_uint_t                       responses;
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
+    ngx_uint_t                       proxy_protocol_version;
+    ngx_flag_t                       splice;
+    ngx_flag_t                       fastopen;
     ngx_stream_upstream_local_t     *local;
 
 #if (NGX_STREAM_SSL)
@@ -70,8 +76,14 @@ static void ngx_stream_proxy_process_connection(ngx_event_t *ev,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_stream_proxy_test_fastopen(ngx_stream_session_t *s,
+    ngx_event_t *ev);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -109,6 +121,11 @@ static ngx_conf_bitmask_t  ngx_stream_proxy_ssl_protocols[] = {
 #endif
 
 
+static ngx_conf_num_bounds_t  ngx_stream_proxy_protocol_version_bounds = {
+    ngx_conf_check_num_bounds, 1, 2
+};
+
+
 static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_downstream_buffer = {
     ngx_conf_deprecated, "proxy_downstream_buffer", "proxy_buffer_size"
 };
@@ -128,7 +145,7 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       NULL },
 
     { ngx_string("proxy_bind"),
-      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
       ngx_stream_proxy_bind,
       NGX_STREAM_SRV_CONF_OFFSET,
       0,
@@ -190,6 +207,20 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, responses),
       NULL },
 
+    { ngx_string("proxy_requests"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, requests),
+      NULL },
+
+    { ngx_string("proxy_udp_idle_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_idle_timeout),
+      NULL },
+
     { ngx_string("proxy_next_upstream"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -218,6 +249,27 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol),
       NULL },
 
+    { ngx_string("proxy_protocol_version"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol_version),
+      &ngx_stream_proxy_protocol_version_bounds },
+
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
+    { ngx_string("proxy_fastopen"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, fastopen),
+      NULL },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -385,6 +437,7 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
     }
 
     u->peer.type = c->type;
+    u->peer.fastopen = pscf->fastopen;
     u->start_sec = ngx_time();
 
     c->write->handler = ngx_stream_proxy_downstream_handler;
@@ -397,7 +450,14 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         return;
     }
 
-    if (c->type == SOCK_STREAM) {
+    /*
+     * the first datagram is already read as the preread buffer,
+     * further datagrams of the same flow are passed to the session
+     * until the number of requests is reached, so the buffer is only
+     * needed if the session is kept as a flow
+     */
+
+    if (c->type == SOCK_STREAM || pscf->requests != 1) {
         p = ngx_pnalloc(c->pool, pscf->buffer_size);
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
@@ -408,10 +468,20 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         u->downstream_buf.end = p + pscf->buffer_size;
         u->downstream_buf.pos = p;
         u->downstream_buf.last = p;
+    }
 
+    if (c->type == SOCK_STREAM) {
         if (c->read->ready) {
             ngx_post_event(c->read, &ngx_posted_events);
         }
+
+    } else {
+        u->requests = 1;
+
+        if (pscf->requests != 1 && ngx_insert_udp_connection(c) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
     }
 
     if (pscf->upstream_value) {
@@ -603,6 +673,7 @@ ngx_stream_proxy_set_local(ngx_stream_session_t *s, ngx_stream_upstream_t *u,
 
     if (local == NULL) {
         u->peer.local = NULL;
+        u->peer.local_pool = NULL;
         return NGX_OK;
     }
 
@@ -610,6 +681,12 @@ ngx_stream_proxy_set_local(ngx_stream_session_t *s, ngx_stream_upstream_t *u,
     u->peer.transparent = local->transparent;
 #endif
 
+    if (local->pool) {
+        u->peer.local = NULL;
+        u->peer.local_pool = local->pool;
+        return NGX_OK;
+    }
+
     if (local->value == NULL) {
         u->peer.local = local->addr;
         return NGX_OK;
@@ -730,6 +807,8 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 {
     int                           tcp_nodelay;
     u_char                       *p;
+    size_t                        size;
+    ngx_buf_t                    *b;
     ngx_chain_t                  *cl;
     ngx_connection_t             *c, *pc;
     ngx_log_handler_pt            handler;
@@ -823,6 +902,41 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
         u->upstream_buf.last = p;
     }
 
+    if (u->resend) {
+
+        /*
+         * the data read from the client are kept in the buffer
+         * until TCP Fast Open connection is established
+         */
+
+        b = &u->downstream_buf;
+
+        u->upstream_out = NULL;
+
+        if (b->last > b->start) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "stream proxy resend buffer: %uz",
+                           b->last - b->start);
+
+            cl = ngx_chain_get_free_buf(c->pool, &u->free);
+            if (cl == NULL) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            cl->buf->pos = b->start;
+            cl->buf->last = b->last;
+            cl->buf->temporary = 1;
+            cl->buf->flush = 1;
+            cl->buf->last_buf = c->read->eof;
+            cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+
+            u->upstream_out = cl;
+        }
+
+        u->resend = 0;
+    }
+
     if (c->buffer && c->buffer->pos < c->buffer->last) {
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
                        "stream proxy add preread buffer: %uz",
@@ -854,7 +968,11 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
             return;
         }
 
-        p = ngx_pnalloc(c->pool, NGX_PROXY_PROTOCOL_MAX_HEADER);
+        size = (pscf->proxy_protocol_version == 2)
+               ? NGX_PROXY_PROTOCOL_MAX_HEADER
+               : NGX_PROXY_PROTOCOL_V1_MAX_HEADER;
+
+        p = ngx_pnalloc(c->pool, size);
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
@@ -862,7 +980,13 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
         cl->buf->pos = p;
 
-        p = ngx_proxy_protocol_write(c, p, p + NGX_PROXY_PROTOCOL_MAX_HEADER);
+        if (pscf->proxy_protocol_version == 2) {
+            p = ngx_proxy_protocol_v2_write(c, p, p + size);
+
+        } else {
+            p = ngx_proxy_protocol_write(c, p, p + size);
+        }
+
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
@@ -887,6 +1011,25 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
     u->connected = 1;
 
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * splice() to a TCP Fast Open socket does not initiate the connection,
+     * so the data are sent with the regular writes
+     */
+
+    u->splice = (pscf->splice && c->type == SOCK_STREAM && !pscf->fastopen);
+
+#if (NGX_STREAM_SSL)
+
+    if (c->ssl || pc->ssl) {
+        u->splice = 0;
+    }
+
+#endif
+
+#endif
+
     pc->read->handler = ngx_stream_proxy_upstream_handler;
     pc->write->handler = ngx_stream_proxy_upstream_handler;
 
@@ -915,7 +1058,17 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
                    "stream proxy send PROXY protocol header");
 
-    p = ngx_proxy_protocol_write(c, buf, buf + NGX_PROXY_PROTOCOL_MAX_HEADER);
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (pscf->proxy_protocol_version == 2) {
+        p = ngx_proxy_protocol_v2_write(c, buf,
+                                        buf + NGX_PROXY_PROTOCOL_MAX_HEADER);
+
+    } else {
+        p = ngx_proxy_protocol_write(c, buf,
+                                     buf + NGX_PROXY_PROTOCOL_MAX_HEADER);
+    }
+
     if (p == NULL) {
         ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return NGX_ERROR;
@@ -935,8 +1088,6 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
             return NGX_ERROR;
         }
 
-        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
-
         ngx_add_timer(pc->write, pscf->timeout);
 
         pc->write->handler = ngx_stream_proxy_connect_handler;
@@ -1090,6 +1241,8 @@ ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc)
             ngx_del_timer(pc->write);
         }
 
+        s->upstream->peer.connecting = 0;
+
         ngx_stream_proxy_init_upstream(s);
 
         return;
@@ -1302,6 +1455,13 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
 
+    if (u->peer.connecting
+        && ev->data == pc
+        && ngx_stream_proxy_test_fastopen(s, ev) != NGX_OK)
+    {
+        return;
+    }
+
     if (ev->timedout) {
         ev->timedout = 0;
 
@@ -1324,11 +1484,15 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
 
         } else {
             if (s->connection->type == SOCK_DGRAM) {
-                if (pscf->responses == NGX_MAX_INT32_VALUE) {
+                if (pscf->responses == NGX_MAX_INT32_VALUE
+                    || (pscf->udp_idle_timeout
+                        && u->responses == pscf->responses * u->requests))
+                {
 
                     /*
                      * successfully terminate timed out UDP session
-                     * with unspecified number of responses
+                     * with unspecified number of responses, or idle
+                     * UDP session with all responses received
                      */
 
                     pc->read->ready = 0;
@@ -1442,6 +1606,71 @@ ngx_stream_proxy_test_connect(ngx_connection_t *c)
 }
 
 
+static ngx_int_t
+ngx_stream_proxy_test_fastopen(ngx_stream_session_t *s, ngx_event_t *ev)
+{
+    ngx_connection_t       *pc;
+    ngx_stream_upstream_t  *u;
+
+    /*
+     * with TCP Fast Open the handshake is started by the first write,
+     * and the next event on the upstream connection reports its result
+     */
+
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, pc->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+
+        if (pc->sent) {
+
+            /* the data might have reached the server along with SYN */
+
+            ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+            return NGX_DECLINED;
+        }
+
+        goto failed;
+    }
+
+    if (ngx_stream_proxy_test_connect(pc) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "stream proxy fastopen connected");
+
+    u->peer.connecting = 0;
+
+    if (pc->write->timer_set) {
+        ngx_del_timer(pc->write);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    /*
+     * the connection was not established, the data queued for it
+     * are dropped and sent again to the next upstream
+     */
+
+    ngx_stream_set_ctx(s, NULL, ngx_stream_write_filter_module);
+
+    u->upstream_out = NULL;
+    u->upstream_busy = NULL;
+    pc->buffered = 0;
+
+    u->resend = 1;
+
+    ngx_stream_proxy_next_upstream(s);
+
+    return NGX_DECLINED;
+}
+
+
 static void
 ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_uint_t do_write)
@@ -1502,6 +1731,23 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (dst) {
+            rc = ngx_stream_proxy_splice(s, from_upstream, do_write);
+
+            if (rc == NGX_ERROR) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                break;
+            }
+        }
+
+#endif
+
         if (do_write && dst) {
 
             if (*out || *busy || dst->buffered) {
@@ -1517,10 +1763,18 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     return;
                 }
 
+                if (!from_upstream
+                    && u->peer.connecting
+                    && !dst->write->timer_set)
+                {
+                    /* the first write has started TCP Fast Open handshake */
+                    ngx_add_timer(dst->write, pscf->connect_timeout);
+                }
+
                 ngx_chain_update_chains(c->pool, &u->free, busy, out,
                                       (ngx_buf_tag_t) &ngx_stream_proxy_module);
 
-                if (*busy == NULL) {
+                if (*busy == NULL && (from_upstream || !u->peer.connecting)) {
                     b->pos = b->start;
                     b->last = b->start;
                 }
@@ -1580,10 +1834,19 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     }
                 }
 
-                if (c->type == SOCK_DGRAM && ++u->responses == pscf->responses)
-                {
-                    src->read->ready = 0;
-                    src->read->eof = 1;
+                if (c->type == SOCK_DGRAM) {
+                    if (!from_upstream) {
+                        if (++u->requests == pscf->requests) {
+                            ngx_delete_udp_connection(c);
+                        }
+
+                    } else if (++u->responses == pscf->responses * u->requests
+                               && (pscf->udp_idle_timeout == 0
+                                   || c->udp == NULL))
+                    {
+                        src->read->ready = 0;
+                        src->read->eof = 1;
+                    }
                 }
 
                 for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
@@ -1647,7 +1910,15 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
             return;
         }
 
-        if (!c->read->delayed && !pc->read->delayed) {
+        if (c->type == SOCK_DGRAM
+            && pscf->udp_idle_timeout
+            && u->responses == pscf->responses * u->requests)
+        {
+            /* all responses are received, wait for the next datagram */
+
+            ngx_add_timer(c->write, pscf->udp_idle_timeout);
+
+        } else if (!c->read->delayed && !pc->read->delayed) {
             ngx_add_timer(c->write, pscf->timeout);
 
         } else if (c->write->timer_set) {
@@ -1657,6 +1928,175 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_uint_t do_write)
+{
+    off_t                        *received, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_msec_t                    delay;
+    ngx_chain_t                  *out, *busy;
+    ngx_connection_t             *c, *pc, *src, *dst;
+    ngx_splice_pipe_t            *p, **pp;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    u = s->upstream;
+
+    c = s->connection;
+    pc = u->peer.connection;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        pp = &u->upstream_pipe;
+        limit_rate = pscf->download_rate;
+        received = &u->received;
+        out = u->downstream_out;
+        busy = u->downstream_busy;
+
+    } else {
+        src = c;
+        dst = pc;
+        pp = &u->downstream_pipe;
+        limit_rate = pscf->upload_rate;
+        received = &s->received;
+        out = u->upstream_out;
+        busy = u->upstream_busy;
+    }
+
+    p = *pp;
+
+    if (p == NULL || p->size == 0) {
+
+        /* buffered data, e.g. preread or PROXY protocol header, go first */
+
+        dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+
+        if (!u->splice || out || busy || dst->buffered) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (p == NULL) {
+        p = ngx_linux_splice_pipe(c->pool, c->log);
+        if (p == NULL) {
+            u->splice = 0;
+            return NGX_DECLINED;
+        }
+
+        *pp = p;
+    }
+
+    for ( ;; ) {
+
+        if (do_write && p->size && dst->write->ready) {
+
+            n = ngx_linux_splice_send(dst, p, p->size);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        size = (u->splice && p->size < p->capacity) ? p->capacity - p->size
+                                                     : 0;
+
+        if (size && src->read->ready && !src->read->delayed) {
+
+            if (limit_rate) {
+                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                        - *received;
+
+                if (limit <= 0) {
+                    src->read->delayed = 1;
+                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                    ngx_add_timer(src->read, delay);
+                    break;
+                }
+
+                if ((off_t) size > limit) {
+                    size = (size_t) limit;
+                }
+            }
+
+            n = ngx_linux_splice_recv(src, p, size);
+
+            if (n == NGX_AGAIN) {
+
+                if (p->size && dst->write->ready) {
+                    do_write = 1;
+                    continue;
+                }
+
+                break;
+            }
+
+            if (n == NGX_DECLINED) {
+                u->splice = 0;
+
+                if (p->size) {
+
+                    /* data already in the pipe are sent first */
+
+                    do_write = 1;
+                    continue;
+                }
+
+                dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+                return NGX_DECLINED;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+                n = 0;
+            }
+
+            if (limit_rate) {
+                delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+                if (delay > 0) {
+                    src->read->delayed = 1;
+                    ngx_add_timer(src->read, delay);
+                }
+            }
+
+            if (from_upstream) {
+                if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->state->response_time;
+                }
+            }
+
+            *received += n;
+            do_write = 1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    /* data left in the pipe are accounted as buffered by the connection */
+
+    if (p->size) {
+        dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+
+    } else {
+        dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -1839,10 +2279,15 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->upload_rate = NGX_CONF_UNSET_SIZE;
     conf->download_rate = NGX_CONF_UNSET_SIZE;
+    conf->udp_idle_timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
     conf->responses = NGX_CONF_UNSET_UINT;
     conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->next_upstream = NGX_CONF_UNSET;
     conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->proxy_protocol_version = NGX_CONF_UNSET_UINT;
+    conf->splice = NGX_CONF_UNSET;
+    conf->fastopen = NGX_CONF_UNSET;
     conf->local = NGX_CONF_UNSET_PTR;
 
 #if (NGX_STREAM_SSL)
@@ -1882,6 +2327,12 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->download_rate,
                               prev->download_rate, 0);
 
+    ngx_conf_merge_msec_value(conf->udp_idle_timeout,
+                              prev->udp_idle_timeout, 0);
+
+    ngx_conf_merge_uint_value(conf->requests,
+                              prev->requests, 0);
+
     ngx_conf_merge_uint_value(conf->responses,
                               prev->responses, NGX_MAX_INT32_VALUE);
 
@@ -1892,6 +2343,13 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
 
+    ngx_conf_merge_uint_value(conf->proxy_protocol_version,
+                              prev->proxy_protocol_version, 1);
+
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
+    ngx_conf_merge_value(conf->fastopen, prev->fastopen, 0);
+
     ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
 
 #if (NGX_STREAM_SSL)
@@ -2080,6 +2538,8 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ngx_int_t                            rc;
     ngx_str_t                           *value;
+    ngx_uint_t                           i, n;
+    ngx_addr_t                          *addr;
     ngx_stream_complex_value_t           cv;
     ngx_stream_upstream_local_t         *local;
     ngx_stream_compile_complex_value_t   ccv;
@@ -2095,6 +2555,67 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
+    local = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_local_t));
+    if (local == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    pscf->local = local;
+
+    n = cf->args->nelts - 1;
+
+    if (n > 1 && ngx_strcmp(value[n].data, "transparent") == 0) {
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+        local->transparent = 1;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "transparent proxying is not supported "
+                           "on this platform, ignored");
+#endif
+        n--;
+    }
+
+    if (n > 1) {
+
+        /* a pool of local addresses, selected in turn on each connect */
+
+        local->pool = ngx_palloc(cf->pool, sizeof(ngx_peer_local_pool_t));
+        if (local->pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        local->pool->addrs = ngx_pcalloc(cf->pool, n * sizeof(ngx_addr_t));
+        if (local->pool->addrs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        local->pool->naddrs = n;
+        local->pool->current = 0;
+
+        for (i = 0; i < n; i++) {
+            addr = &local->pool->addrs[i];
+
+            rc = ngx_parse_addr_port(cf->pool, addr, value[i + 1].data,
+                                     value[i + 1].len);
+
+            switch (rc) {
+            case NGX_OK:
+                addr->name = value[i + 1];
+                break;
+
+            case NGX_DECLINED:
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid address \"%V\"", &value[i + 1]);
+                /* fall through */
+
+            default:
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        return NGX_CONF_OK;
+    }
+
     ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
 
     ccv.cf = cf;
@@ -2105,13 +2626,6 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    local = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_local_t));
-    if (local == NULL) {
-        return NGX_CONF_ERROR;
-    }
-
-    pscf->local = local;
-
     if (cv.lengths) {
         local->value = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
         if (local->value == NULL) {
@@ -2144,21 +2658,5 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    if (cf->args->nelts > 2) {
-        if (ngx_strcmp(value[2].data, "transparent") == 0) {
-#if (NGX_HAVE_TRANSPARENT_PROXY)
-            local->transparent = 1;
-#else
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "transparent proxying is not supported "
-                               "on this platform, ignored");
-#endif
-        } else {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid parameter \"%V\"", &value[2]);
-            return NGX_CONF_ERROR;
-        }
-    }
-
     return NGX_CONF_OK;
 }
@@ -18,6 +18,8 @@ typedef struct {
     ngx_msec_t       handshake_timeout;
 
     ngx_flag_t       prefer_server_ciphers;
+    ngx_flag_t       async;
+    ngx_flag_t       ktls;
 
     ngx_ssl_t        ssl;
 
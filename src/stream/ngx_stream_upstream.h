@@ -117,6 +117,11 @@ typedef struct {
     ngx_buf_t                          downstream_buf;
     ngx_buf_t                          upstream_buf;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t                 *downstream_pipe;
+    ngx_splice_pipe_t                 *upstream_pipe;
+#endif
+
     ngx_chain_t                       *free;
     ngx_chain_t                       *upstream_out;
     ngx_chain_t                       *upstream_busy;
@@ -125,6 +130,7 @@ typedef struct {
 
     off_t                              received;
     time_t                             start_sec;
+    ngx_uint_t                         requests;
     ngx_uint_t                         responses;
 
     ngx_str_t                          ssl_name;
@@ -134,6 +140,8 @@ typedef struct {
     ngx_stream_upstream_state_t       *state;
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
+    unsigned                           splice:1;
+    unsigned                           resend:1;
 } ngx_stream_upstream_t;
 
 